@@ -3,10 +3,26 @@ plugin_LTLIBRARIES = src/libgstbt.la
 
 src_libgstbt_la_SOURCES = \
 src/gst_bt.c \
+src/gst_bt_session.cpp \
+src/gst_bt_session.hpp \
+src/gst_bt_trace.c \
+src/gst_bt_trace.h \
 src/gst_bt_type.c \
 src/gst_bt_type.h \
 src/gst_bt_src.cpp \
 src/gst_bt_src.hpp \
+src/gst_bt_ram_storage.cpp \
+src/gst_bt_ram_storage.hpp \
+src/gst_bt_uring_storage.cpp \
+src/gst_bt_uring_storage.hpp \
+src/gst_bt_range.cpp \
+src/gst_bt_range.hpp \
+src/gst_bt_piece_cache.cpp \
+src/gst_bt_piece_cache.hpp \
+src/gst_bt_piece_queue.cpp \
+src/gst_bt_piece_queue.hpp \
+src/gst_bt_scheduler.cpp \
+src/gst_bt_scheduler.hpp \
 src/gst_bt_demux.cpp \
 src/gst_bt_demux.hpp
 
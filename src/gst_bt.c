@@ -24,6 +24,7 @@
 #include "gst_bt_src.hpp"
 #include "gst_bt_demux.hpp"
 #include "gst_bt_type.h"
+#include "gst_bt_trace.h"
 
 #if HAVE_GST_1
 #define PLUGIN_NAME bt
@@ -33,6 +34,8 @@
 
 GST_DEBUG_CATEGORY (gst_bt_demux_debug);
 GST_DEBUG_CATEGORY (gst_bt_src_debug);
+GST_DEBUG_CATEGORY (gst_bt_trace_debug);
+GST_DEBUG_CATEGORY (gst_bt_session_debug);
 
 static gboolean
 plugin_init (GstPlugin * plugin)
@@ -40,6 +43,10 @@ plugin_init (GstPlugin * plugin)
   /* first register the debug categories */
   GST_DEBUG_CATEGORY_INIT (gst_bt_demux_debug, "btdemux", 0, "BitTorrent demuxer");
   GST_DEBUG_CATEGORY_INIT (gst_bt_src_debug, "btsrc", 0, "BitTorrent source");
+  GST_DEBUG_CATEGORY_INIT (gst_bt_trace_debug, "bttrace", 0,
+      "BitTorrent piece lifecycle");
+  GST_DEBUG_CATEGORY_INIT (gst_bt_session_debug, "btsession", 0,
+      "BitTorrent session");
 
   if (!gst_element_register (plugin, "btdemux",
           GST_RANK_PRIMARY + 1, GST_TYPE_BT_DEMUX))
@@ -50,6 +57,7 @@ plugin_init (GstPlugin * plugin)
     return FALSE;
 
   gst_bt_type_init (plugin);
+  gst_bt_trace_init (plugin);
 
   return TRUE;
 }
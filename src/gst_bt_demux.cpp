@@ -30,22 +30,64 @@
 
 #include "gst_bt.h"
 #include "gst_bt_demux.hpp"
+#include "gst_bt_scheduler.hpp"
+#include "gst_bt_piece_cache.hpp"
+#include "gst_bt_piece_queue.hpp"
+#include "gst_bt_range.hpp"
+#include "gst_bt_ram_storage.hpp"
+#include "gst_bt_uring_storage.hpp"
+#include "gst_bt_trace.h"
 #include <gst/base/gsttypefindhelper.h>
 
 #include <glib/gstdio.h>
+#include <string.h>
 
 #include <iterator>
 #include <deque>
 
+#include <boost/bind.hpp>
+
 #include "libtorrent/session.hpp"
 #include "libtorrent/torrent_info.hpp"
 #include "libtorrent/alert_types.hpp"
+#include "libtorrent/ip_filter.hpp"
+#include "libtorrent/peer_info.hpp"
 #include "libtorrent/time.hpp"
 
 #define DEFAULT_TYPEFIND TRUE
+#define DEFAULT_TYPEFIND_SIZE (64 * 1024)
 #define DEFAULT_BUFFER_PIECES 3
 #define DEFAULT_DIR "btdemux"
 #define DEFAULT_TEMP_REMOVE TRUE
+#define DEFAULT_STATS_INTERVAL 0
+#define DEFAULT_MAX_QUEUED_BYTES (64 * 1024 * 1024)
+#define DEFAULT_SESSION_PROFILE GST_BT_SESSION_PROFILE_DEFAULT
+#define DEFAULT_STORAGE GST_BT_DEMUX_STORAGE_DISK
+#define DEFAULT_RING_SIZE (64 * 1024 * 1024)
+#define DEFAULT_URING_QUEUE_DEPTH 64
+#define DEFAULT_URING_DIRECT FALSE
+#define DEFAULT_BUFFERING_UPLOAD_LIMIT -1
+#define DEFAULT_BUFFERING_UNCHOKE_SLOTS -1
+#define DEFAULT_STALL_TIMEOUT 5000
+#define DEFAULT_ALERT_THREADS 0
+#define DEFAULT_LOW_WATERMARK_BYTES 0
+#define DEFAULT_HIGH_WATERMARK_BYTES 0
+#define DEFAULT_LOW_WATERMARK_TIME 0
+#define DEFAULT_HIGH_WATERMARK_TIME 0
+#define DEFAULT_CACHE_SIZE (16 * 1024 * 1024)
+#define DEFAULT_WEB_SEEDS NULL
+#define DEFAULT_PEERS NULL
+#define DEFAULT_WEB_SEEDS_BACKOFF_RATE (1024 * 1024)
+
+/* how often we ask libtorrent for the torrent status */
+#define UPDATE_INTERVAL (GST_SECOND)
+/* the pieces a stream can have queued, the budget is bounded to them */
+#define PIECE_QUEUE_MIN_SIZE 16
+#define PIECE_QUEUE_MAX_SIZE 1024
+/* stall timeouts a slow peer stays blocked */
+#define BLOCK_TIMEOUTS 6
+/* a peer is slow when below the average download rate divided by this */
+#define SLOW_PEER_RATIO 4
 
 GST_DEBUG_CATEGORY_EXTERN (gst_bt_demux_debug);
 #define GST_CAT_DEFAULT gst_bt_demux_debug
@@ -54,7 +96,52 @@ GST_DEBUG_CATEGORY_EXTERN (gst_bt_demux_debug);
 static void
 gst_bt_demux_send_buffering (GstBtDemux * thiz, libtorrent::torrent_handle h);
 static void
+gst_bt_demux_emit_overrun (GstBtDemux * thiz);
+static void
+gst_bt_demux_emit_underrun (GstBtDemux * thiz);
+static void
 gst_bt_demux_check_no_more_pads (GstBtDemux * thiz);
+static GSList *
+gst_bt_demux_get_streams (GstBtDemux * thiz);
+static void
+gst_bt_demux_stream_queue_piece (GstBtDemuxStream * thiz, GstBtDemux * demux,
+    boost::shared_array <char> buffer, gint piece, gint size);
+static void
+gst_bt_demux_stream_start_pushing (GstBtDemuxStream * thiz,
+    GstBtDemux * demux);
+
+/* the moments of a piece lifecycle we keep track of */
+typedef enum _GstBtDemuxPieceStage
+{
+  GST_BT_DEMUX_PIECE_REQUESTED,
+  GST_BT_DEMUX_PIECE_FINISHED,
+  GST_BT_DEMUX_PIECE_READ,
+  GST_BT_DEMUX_PIECE_PUSHED,
+  GST_BT_DEMUX_PIECE_STAGES,
+} GstBtDemuxPieceStage;
+
+typedef struct _GstBtDemuxPushJob
+{
+  GstBtDemux *demux;
+  GstBtDemuxStream *stream;
+  GstTaskPool *pool;
+  /* the id to join, protected by the jobs lock */
+  gpointer id;
+  gboolean queued;
+  gboolean done;
+} GstBtDemuxPushJob;
+
+/* A piece alert handled on an alert worker, only for the streams of the
+ * worker
+ */
+typedef struct _GstBtDemuxAlertJob
+{
+  gint type;
+  gint piece;
+  libtorrent::torrent_handle h;
+  gint worker;
+  guint num_workers;
+} GstBtDemuxAlertJob;
 
 typedef struct _GstBtDemuxBufferData
 {
@@ -66,31 +153,43 @@ typedef struct _GstBtDemuxBufferData
 /*----------------------------------------------------------------------------*
  *                            The buffer helper                               *
  *----------------------------------------------------------------------------*/
+static GstBtDemuxBufferData * gst_bt_demux_buffer_data_new (void)
+{
+  /* the shared array must be constructed */
+  return new GstBtDemuxBufferData ();
+}
+
 static void gst_bt_demux_buffer_data_free (gpointer data)
 {
-  g_free (data);
+  delete (GstBtDemuxBufferData *) data;
 }
 
 GstBuffer * gst_bt_demux_buffer_new (boost::shared_array <char> buffer,
-    gint piece, gint size, GstBtDemuxStream * s)
+    gint piece, gint size, gint piece_length, GstBtDemuxStream * s)
 {
   GstBuffer *buf;
   GstBtDemuxBufferData *buf_data;
+  GstBtRange range;
   guint8 *data;
+  gint64 offset;
+  gint begin, end;
 
-  buf_data = g_new0 (GstBtDemuxBufferData, 1);
+  buf_data = gst_bt_demux_buffer_data_new ();
   buf_data->buffer = buffer;
 
-  data = (guint8 *)buffer.get ();
   /* handle the offsets */
-  if (piece == s->start_piece) {
-    data += s->start_offset;
-    size -= s->start_offset;
-  }
-
-  if (piece == s->end_piece) {
-    size -= size - s->end_offset;
-  }
+  range.start_piece = s->sched.start_piece;
+  range.start_offset = s->start_offset;
+  range.end_piece = s->sched.end_piece;
+  range.end_offset = s->end_offset;
+  if (!gst_bt_range_clip (&range, piece, size, &begin, &end))
+    begin = end = 0;
+
+  data = (guint8 *)buffer.get () + begin;
+  size = end - begin;
+  /* where the data is on the file */
+  offset = (gint64) (piece - range.start_piece) * piece_length + begin -
+      range.start_offset;
 
   /* create the buffer */
 #if HAVE_GST_1
@@ -103,6 +202,8 @@ GstBuffer * gst_bt_demux_buffer_new (boost::shared_array <char> buffer,
   GST_BUFFER_MALLOCDATA (buf) = (guint8 *)buf_data;
   GST_BUFFER_FREE_FUNC (buf) = gst_bt_demux_buffer_data_free;
 #endif
+  GST_BUFFER_OFFSET (buf) = offset;
+  GST_BUFFER_OFFSET_END (buf) = offset + size;
 
   return buf;
 }
@@ -129,130 +230,1177 @@ gst_bt_demux_selector_policy_get_type (void)
 }
 
 /*----------------------------------------------------------------------------*
- *                             The stream class                               *
+ *                               The storage                                  *
  *----------------------------------------------------------------------------*/
+static GType
+gst_bt_demux_storage_get_type (void)
+{
+  static GType gst_bt_demux_storage_type = 0;
+  static const GEnumValue storage_types[] = {
+    {GST_BT_DEMUX_STORAGE_DISK, "Files on the temporary location", "disk" },
+    {GST_BT_DEMUX_STORAGE_RAM, "Ring of pieces in memory", "ram" },
+    {GST_BT_DEMUX_STORAGE_IO_URING, "Files on the temporary location "
+        "accessed through io_uring", "io-uring" },
+    {0, NULL, NULL}
+  };
 
-G_DEFINE_TYPE (GstBtDemuxStream, gst_bt_demux_stream, GST_TYPE_PAD);
+  if (!gst_bt_demux_storage_type) {
+    gst_bt_demux_storage_type =
+        g_enum_register_static ("GstBtDemuxStorage", storage_types);
+  }
+  return gst_bt_demux_storage_type;
+}
+
+/* Set the storage of the torrent to add */
+static void
+gst_bt_demux_storage_params (GstBtDemux * thiz,
+    libtorrent::add_torrent_params & tp)
+{
+  if (thiz->ram_ring) {
+    gst_bt_ram_ring_unref ((GstBtRamRing *) thiz->ram_ring);
+    thiz->ram_ring = NULL;
+  }
+
+  if (thiz->storage == GST_BT_DEMUX_STORAGE_RAM) {
+    GstBtRamRing *ring;
+    guint64 ring_pieces;
+    guint64 min_pieces;
 
+    /* keep at least the read-ahead on both sides of the playhead, but never
+     * more than the whole torrent
+     */
+    ring_pieces = thiz->ring_size / tp.ti->piece_length ();
+    min_pieces = ((guint64) thiz->buffer_pieces * 2) + 1;
+    if (ring_pieces < min_pieces)
+      ring_pieces = min_pieces;
+    if (ring_pieces > (guint64) tp.ti->num_pieces ())
+      ring_pieces = tp.ti->num_pieces ();
+    if (ring_pieces > G_MAXINT)
+      ring_pieces = G_MAXINT;
+
+    GST_DEBUG_OBJECT (thiz, "Using a RAM ring of %" G_GUINT64_FORMAT
+        " pieces", ring_pieces);
+    ring = gst_bt_ram_ring_new ((gint) ring_pieces, tp.ti->num_pieces (),
+        tp.ti->piece_length (), tp.ti->total_size ());
+    tp.storage = boost::bind (&gst_bt_ram_storage_new, _1, _2, _3, _4, _5,
+        ring);
+    tp.extensions.push_back (boost::bind (&gst_bt_ram_storage_plugin_new, _1,
+        ring));
+    thiz->ram_ring = ring;
+  } else if (thiz->storage == GST_BT_DEMUX_STORAGE_IO_URING) {
+#if HAVE_IO_URING
+    GST_DEBUG_OBJECT (thiz, "Using io_uring with a queue depth of %d",
+        thiz->uring_queue_depth);
+    tp.storage = boost::bind (&gst_bt_uring_storage_new, _1, _2, _3, _4,
+        _5, thiz->uring_queue_depth, thiz->uring_direct ? true : false);
+#else
+    GST_WARNING_OBJECT (thiz, "No io_uring support, using the disk storage");
+#endif
+  }
+}
+
+/* Whether a piece can be read. Libtorrent keeps having the pieces evicted
+ * from the RAM ring until its plugin forgets them
+ */
 static gboolean
-gst_bt_demux_stream_start_buffering (GstBtDemuxStream * thiz,
-    libtorrent::torrent_handle h, int max_pieces)
+gst_bt_demux_have_piece (GstBtDemux * thiz, libtorrent::torrent_handle h,
+    gint piece)
 {
-  using namespace libtorrent;
-  int i;
-  int start = thiz->current_piece + 1;
-  int end = thiz->current_piece + max_pieces;
+  if (!h.have_piece (piece))
+    return FALSE;
+
+  if (thiz->ram_ring && !gst_bt_ram_ring_has_piece (
+      (GstBtRamRing *) thiz->ram_ring, piece))
+    return FALSE;
 
-  /* do not overflow */
-  if (end > thiz->end_piece)
-    end = thiz->end_piece;
+  return TRUE;
+}
 
-  /* count how many consecutive pieces need to be downloaded */
-  thiz->buffering_count = 0;
-  for (i = start; i <= end; i++) {
+/*----------------------------------------------------------------------------*
+ *                             The statistics                                 *
+ *----------------------------------------------------------------------------*/
+static void
+gst_bt_demux_histogram_add (GstBtDemuxHistogram * thiz, GstClockTime latency)
+{
+  guint64 ms = latency / GST_MSECOND;
+  gint i = 0;
 
-    /* already downloaded */
-    if (h.have_piece (i))
+  while (ms && i < GST_BT_DEMUX_HISTOGRAM_SIZE - 1) {
+    ms >>= 1;
+    i++;
+  }
+  thiz->count[i]++;
+}
+
+static void
+gst_bt_demux_histogram_get_value (GstBtDemuxHistogram * thiz, GValue * value)
+{
+  gint i;
+
+  g_value_init (value, GST_TYPE_ARRAY);
+  for (i = 0; i < GST_BT_DEMUX_HISTOGRAM_SIZE; i++) {
+    GValue v = { 0, };
+
+    g_value_init (&v, G_TYPE_UINT64);
+    g_value_set_uint64 (&v, thiz->count[i]);
+    gst_value_array_append_value (value, &v);
+    g_value_unset (&v);
+  }
+}
+
+/* Keep track of when a piece reached a stage and accumulate the time it took
+ * from the previous one
+ */
+static void
+gst_bt_demux_piece_mark (GstBtDemux * thiz, gint piece,
+    GstBtDemuxPieceStage stage)
+{
+  GstClockTime *times;
+  GstClockTime now;
+
+  GST_OBJECT_LOCK (thiz);
+  if (!thiz->piece_times || piece < 0 || piece >= thiz->num_pieces) {
+    GST_OBJECT_UNLOCK (thiz);
+    return;
+  }
+
+  now = gst_util_get_timestamp ();
+  times = &thiz->piece_times[piece * GST_BT_DEMUX_PIECE_STAGES];
+  times[stage] = now;
+
+  switch (stage) {
+    case GST_BT_DEMUX_PIECE_FINISHED:
+      if (GST_CLOCK_TIME_IS_VALID (times[GST_BT_DEMUX_PIECE_REQUESTED]))
+        gst_bt_demux_histogram_add (&thiz->download_latency,
+            now - times[GST_BT_DEMUX_PIECE_REQUESTED]);
+      break;
+
+    case GST_BT_DEMUX_PIECE_READ:
+      if (GST_CLOCK_TIME_IS_VALID (times[GST_BT_DEMUX_PIECE_FINISHED]))
+        gst_bt_demux_histogram_add (&thiz->read_latency,
+            now - times[GST_BT_DEMUX_PIECE_FINISHED]);
+      break;
+
+    case GST_BT_DEMUX_PIECE_PUSHED:
+      if (GST_CLOCK_TIME_IS_VALID (times[GST_BT_DEMUX_PIECE_READ]))
+        gst_bt_demux_histogram_add (&thiz->push_latency,
+            now - times[GST_BT_DEMUX_PIECE_READ]);
+      break;
+
+    default:
+      break;
+  }
+  GST_OBJECT_UNLOCK (thiz);
+}
+
+static void
+gst_bt_demux_stats_init (GstBtDemux * thiz, gint num_pieces)
+{
+  gint i;
+
+  GST_OBJECT_LOCK (thiz);
+  g_free (thiz->piece_times);
+  thiz->num_pieces = num_pieces;
+  thiz->piece_times = g_new (GstClockTime,
+      num_pieces * GST_BT_DEMUX_PIECE_STAGES);
+  for (i = 0; i < num_pieces * GST_BT_DEMUX_PIECE_STAGES; i++)
+    thiz->piece_times[i] = GST_CLOCK_TIME_NONE;
+
+  memset (&thiz->download_latency, 0, sizeof (GstBtDemuxHistogram));
+  memset (&thiz->read_latency, 0, sizeof (GstBtDemuxHistogram));
+  memset (&thiz->push_latency, 0, sizeof (GstBtDemuxHistogram));
+  thiz->download_rate = 0;
+  thiz->upload_rate = 0;
+  thiz->num_peers = 0;
+  GST_OBJECT_UNLOCK (thiz);
+}
+
+static void
+gst_bt_demux_stats_cleanup (GstBtDemux * thiz)
+{
+  GST_OBJECT_LOCK (thiz);
+  g_free (thiz->piece_times);
+  thiz->piece_times = NULL;
+  thiz->num_pieces = 0;
+  GST_OBJECT_UNLOCK (thiz);
+}
+
+static GstStructure *
+gst_bt_demux_get_stats (GstBtDemux * thiz)
+{
+  GstStructure *stats;
+  GSList *walk;
+  GValue streams = { 0, };
+  GValue histogram = { 0, };
+  guint64 pushed = 0;
+  guint64 dropped = 0;
+
+  g_value_init (&streams, GST_TYPE_ARRAY);
+
+  g_mutex_lock (thiz->streams_lock);
+  for (walk = thiz->streams; walk; walk = g_slist_next (walk)) {
+    GstBtDemuxStream *stream = GST_BT_DEMUX_STREAM (walk->data);
+    GstStructure *s;
+    GValue v = { 0, };
+    GstClockTime elapsed;
+    guint64 throughput = 0;
+
+    g_static_rec_mutex_lock (stream->lock);
+    if (!stream->sched.requested) {
+      g_static_rec_mutex_unlock (stream->lock);
       continue;
+    }
+
+    /* bytes per second since the stream was activated */
+    elapsed = gst_util_get_timestamp () - stream->activated;
+    if (elapsed)
+      throughput = gst_util_uint64_scale (stream->bytes, GST_SECOND, elapsed);
+
+    s = gst_structure_new ("GstBtDemuxStreamStats",
+        "index", G_TYPE_INT, stream->sched.idx,
+        "buffering", G_TYPE_BOOLEAN, stream->sched.buffering,
+        "buffering-level", G_TYPE_INT, stream->sched.buffering_level,
+        "queued", G_TYPE_INT, gst_bt_piece_queue_length ((GstBtPieceQueue *) stream->ipc),
+        "pushed", G_TYPE_UINT64, stream->pushed,
+        "dropped", G_TYPE_UINT64, stream->dropped,
+        "bytes", G_TYPE_UINT64, stream->bytes,
+        "throughput", G_TYPE_UINT64, throughput,
+        "first-buffer-latency", G_TYPE_UINT64, stream->first_buffer,
+        NULL);
+    pushed += stream->pushed;
+    dropped += stream->dropped;
+    g_static_rec_mutex_unlock (stream->lock);
 
-    thiz->buffering_count++;
+    g_value_init (&v, GST_TYPE_STRUCTURE);
+    g_value_take_boxed (&v, s);
+    gst_value_array_append_value (&streams, &v);
+    g_value_unset (&v);
   }
+  g_mutex_unlock (thiz->streams_lock);
+
+  GST_OBJECT_LOCK (thiz);
+  stats = gst_structure_new ("GstBtDemuxStats",
+      "download-rate", G_TYPE_INT, thiz->download_rate,
+      "upload-rate", G_TYPE_INT, thiz->upload_rate,
+      "num-peers", G_TYPE_INT, thiz->num_peers,
+      "queued-bytes", G_TYPE_UINT64, thiz->queued_bytes,
+      "pieces-pushed", G_TYPE_UINT64, pushed,
+      "pieces-dropped", G_TYPE_UINT64, dropped,
+      NULL);
+
+  gst_bt_demux_histogram_get_value (&thiz->download_latency, &histogram);
+  gst_structure_set_value (stats, "download-latency", &histogram);
+  g_value_unset (&histogram);
+  gst_bt_demux_histogram_get_value (&thiz->read_latency, &histogram);
+  gst_structure_set_value (stats, "read-latency", &histogram);
+  g_value_unset (&histogram);
+  gst_bt_demux_histogram_get_value (&thiz->push_latency, &histogram);
+  gst_structure_set_value (stats, "push-latency", &histogram);
+  g_value_unset (&histogram);
+  GST_OBJECT_UNLOCK (thiz);
+
+  gst_structure_set_value (stats, "streams", &streams);
+  g_value_unset (&streams);
+
+  return stats;
+}
+
+/*----------------------------------------------------------------------------*
+ *                            The memory budget                               *
+ *----------------------------------------------------------------------------*/
+/* The slots of the stream queues, every piece the budget allows plus the
+ * one always let go and a short last piece
+ */
+static guint
+gst_bt_demux_queue_size (GstBtDemux * thiz)
+{
+  guint64 pieces = PIECE_QUEUE_MAX_SIZE;
+
+  if (thiz->max_queued_bytes && thiz->piece_length)
+    pieces = MIN (pieces, thiz->max_queued_bytes / thiz->piece_length + 2);
 
-  if (thiz->buffering_count) {
-    thiz->buffering = TRUE;
-    thiz->buffering_level = 0;
+  return MAX ((guint) pieces, PIECE_QUEUE_MIN_SIZE);
+}
+
+static gboolean
+gst_bt_demux_budget_allows (GstBtDemux * thiz)
+{
+  guint64 max;
+
+  /* always let one piece go, no matter how big it is */
+  if (!thiz->queued_bytes)
     return TRUE;
-  } else {
-    return FALSE;
+
+  /* never more than what the stream queues hold */
+  max = (guint64) (thiz->queue_size - 2) * thiz->piece_length;
+  if (thiz->max_queued_bytes)
+    max = MIN (max, thiz->max_queued_bytes);
+
+  return thiz->queued_bytes + thiz->piece_length <= max;
+}
+
+static void
+gst_bt_demux_budget_add (GstBtDemux * thiz, gint64 bytes)
+{
+  GST_OBJECT_LOCK (thiz);
+  if (bytes < 0 && (guint64) -bytes > thiz->queued_bytes)
+    thiz->queued_bytes = 0;
+  else
+    thiz->queued_bytes += bytes;
+  GST_OBJECT_UNLOCK (thiz);
+}
+
+/* Must be called with the object lock, returns TRUE if the overrun starts */
+static gboolean
+gst_bt_demux_delay_read (GstBtDemux * thiz, gint piece)
+{
+  gboolean overrun = FALSE;
+
+  if (!g_queue_find (thiz->pending_reads, GINT_TO_POINTER (piece))) {
+    GST_DEBUG_OBJECT (thiz, "Delaying the read of piece %d, queued %"
+        G_GUINT64_FORMAT " bytes", piece, thiz->queued_bytes);
+    overrun = !thiz->overrun;
+    thiz->overrun = TRUE;
+    g_queue_push_tail (thiz->pending_reads, GINT_TO_POINTER (piece));
   }
+
+  return overrun;
 }
 
+/* Every read in flight accounts for a whole piece until its data arrives,
+ * if the budget is exhausted the read is delayed until enough data has been
+ * pushed downstream. The recently read pieces are queued on the stream
+ * directly, within the budget too
+ */
 static void
-gst_bt_demux_stream_push_loop (gpointer user_data)
+gst_bt_demux_request_read (GstBtDemux * thiz, libtorrent::torrent_handle h,
+    GstBtDemuxStream * stream, gint piece)
+{
+  boost::shared_array <char> buffer;
+  gboolean overrun;
+  gint size;
+
+  GST_OBJECT_LOCK (thiz);
+  if (!gst_bt_demux_budget_allows (thiz)) {
+    overrun = gst_bt_demux_delay_read (thiz, piece);
+    GST_OBJECT_UNLOCK (thiz);
+
+    if (overrun)
+      gst_bt_demux_emit_overrun (thiz);
+    return;
+  }
+  thiz->queued_bytes += thiz->piece_length;
+  GST_OBJECT_UNLOCK (thiz);
+
+  if (gst_bt_piece_cache_lookup ((GstBtPieceCache *) thiz->piece_cache, piece,
+      buffer, &size)) {
+    GST_DEBUG_OBJECT (stream, "Piece %d found on the cache", piece);
+    GST_BT_TRACE (stream, piece_read, stream->sched.idx, piece);
+    gst_bt_demux_stream_queue_piece (stream, thiz, buffer, piece, size);
+    /* the queued data is accounted instead */
+    gst_bt_demux_budget_add (thiz, -thiz->piece_length);
+    return;
+  }
+
+  h.read_piece (piece);
+}
+
+/* issue the delayed reads that fit in the budget, once every delayed read
+ * has been issued and there is room again the overrun is over
+ */
+static void
+gst_bt_demux_flush_reads (GstBtDemux * thiz, libtorrent::torrent_handle h)
+{
+  gboolean underrun = FALSE;
+
+  GST_OBJECT_LOCK (thiz);
+  while (!g_queue_is_empty (thiz->pending_reads) &&
+      gst_bt_demux_budget_allows (thiz)) {
+    gint piece;
+
+    piece = GPOINTER_TO_INT (g_queue_pop_head (thiz->pending_reads));
+    thiz->queued_bytes += thiz->piece_length;
+    GST_OBJECT_UNLOCK (thiz);
+
+    GST_DEBUG_OBJECT (thiz, "Reading delayed piece %d", piece);
+    h.read_piece (piece);
+
+    GST_OBJECT_LOCK (thiz);
+  }
+
+  if (thiz->overrun && g_queue_is_empty (thiz->pending_reads) &&
+      gst_bt_demux_budget_allows (thiz)) {
+    thiz->overrun = FALSE;
+    underrun = TRUE;
+  }
+  GST_OBJECT_UNLOCK (thiz);
+
+  if (underrun)
+    gst_bt_demux_emit_underrun (thiz);
+}
+
+static void
+gst_bt_demux_budget_reset (GstBtDemux * thiz)
+{
+  GST_OBJECT_LOCK (thiz);
+  thiz->queued_bytes = 0;
+  thiz->overrun = FALSE;
+  g_queue_clear (thiz->pending_reads);
+  GST_OBJECT_UNLOCK (thiz);
+}
+
+/*----------------------------------------------------------------------------*
+ *                         The buffering watermarks                           *
+ *----------------------------------------------------------------------------*/
+/* The bytes per second the stream is being played at, 0 if not known yet */
+static guint64
+gst_bt_demux_stream_output_rate (GstBtDemuxStream * stream)
+{
+  GstClockTime elapsed;
+
+  if (!stream->bytes || !GST_CLOCK_TIME_IS_VALID (stream->activated))
+    return 0;
+
+  elapsed = gst_util_get_timestamp () - stream->activated;
+  if (!elapsed)
+    return 0;
+
+  return gst_util_uint64_scale (stream->bytes, GST_SECOND, elapsed);
+}
+
+/* Translate a watermark in bytes and time into pieces of the stream, the
+ * larger of both wins. The time is converted with the output rate of the
+ * stream so it is only used once the stream is being played
+ */
+static gint
+gst_bt_demux_stream_watermark_pieces (GstBtDemux * thiz,
+    GstBtDemuxStream * stream, guint64 bytes, GstClockTime time, gint def)
+{
+  guint64 rate;
+
+  if (time && (rate = gst_bt_demux_stream_output_rate (stream)))
+    bytes = MAX (bytes, gst_util_uint64_scale (time, rate, GST_SECOND));
+
+  if (!bytes || thiz->piece_length <= 0)
+    return def;
+
+  return MAX (1, (bytes + thiz->piece_length - 1) / thiz->piece_length);
+}
+
+/* The pieces to buffer before playing again */
+static gint
+gst_bt_demux_stream_high_pieces (GstBtDemux * thiz, GstBtDemuxStream * stream)
+{
+  gint ret;
+
+  GST_OBJECT_LOCK (thiz);
+  ret = gst_bt_demux_stream_watermark_pieces (thiz, stream,
+      thiz->high_watermark_bytes, thiz->high_watermark_time,
+      thiz->buffer_pieces);
+  GST_OBJECT_UNLOCK (thiz);
+
+  return ret;
+}
+
+/* The pieces that need to be ready to keep playing */
+static gint
+gst_bt_demux_stream_low_pieces (GstBtDemux * thiz, GstBtDemuxStream * stream)
+{
+  gint high;
+  gint ret;
+
+  high = gst_bt_demux_stream_high_pieces (thiz, stream);
+  GST_OBJECT_LOCK (thiz);
+  ret = gst_bt_demux_stream_watermark_pieces (thiz, stream,
+      thiz->low_watermark_bytes, thiz->low_watermark_time, 1);
+  GST_OBJECT_UNLOCK (thiz);
+
+  return MIN (ret, high);
+}
+
+/*----------------------------------------------------------------------------*
+ *                            The upload policy                               *
+ *----------------------------------------------------------------------------*/
+/* While buffering the uploads compete with the playhead pieces for the
+ * uplink, throttle them until the read-ahead is complete again. The values
+ * applied are kept, so relaxing undoes exactly what was throttled even if
+ * the properties changed meanwhile
+ */
+static void
+gst_bt_demux_update_upload_policy (GstBtDemux * thiz,
+    libtorrent::torrent_handle h)
+{
+  gint upload_limit = -1;
+  gint unchoke_slots = -1;
+  gint applied_limit;
+  gint applied_slots;
+
+  GST_OBJECT_LOCK (thiz);
+  if (thiz->buffering) {
+    upload_limit = thiz->buffering_upload_limit;
+    unchoke_slots = thiz->buffering_unchoke_slots;
+  }
+  applied_limit = thiz->upload_limit_applied;
+  applied_slots = thiz->unchoke_slots_applied;
+  thiz->upload_limit_applied = upload_limit;
+  thiz->unchoke_slots_applied = unchoke_slots;
+  GST_OBJECT_UNLOCK (thiz);
+
+  if (upload_limit != applied_limit) {
+    if (upload_limit >= 0) {
+      GST_DEBUG_OBJECT (thiz, "Throttling the upload to %d bytes/s",
+          upload_limit);
+      h.set_upload_limit (upload_limit ? upload_limit : 1);
+    } else {
+      GST_DEBUG_OBJECT (thiz, "Relaxing the upload rate");
+      /* back to the session limits */
+      h.set_upload_limit (-1);
+    }
+  }
+
+  if (unchoke_slots != applied_slots) {
+    if (unchoke_slots >= 0) {
+      GST_DEBUG_OBJECT (thiz, "Throttling the upload to %d unchoke slots",
+          unchoke_slots);
+      h.set_max_uploads (unchoke_slots);
+    } else {
+      GST_DEBUG_OBJECT (thiz, "Relaxing the unchoke slots");
+      h.set_max_uploads (-1);
+    }
+  }
+}
+
+/*----------------------------------------------------------------------------*
+ *                            The stall recovery                              *
+ *----------------------------------------------------------------------------*/
+enum {
+  GST_BT_DEMUX_STALL_NONE,
+  /* request the piece as time critical, libtorrent then asks the busy blocks
+   * to other peers too
+   */
+  GST_BT_DEMUX_STALL_DEADLINE,
+  /* block the slow peers holding blocks of the piece */
+  GST_BT_DEMUX_STALL_BLOCK_PEERS,
+};
+
+static GstClockTime
+gst_bt_demux_piece_requested (GstBtDemux * thiz, gint piece)
+{
+  GstClockTime ret = GST_CLOCK_TIME_NONE;
+
+  GST_OBJECT_LOCK (thiz);
+  if (thiz->piece_times && piece >= 0 && piece < thiz->num_pieces)
+    ret = thiz->piece_times[piece * GST_BT_DEMUX_PIECE_STAGES +
+        GST_BT_DEMUX_PIECE_REQUESTED];
+  GST_OBJECT_UNLOCK (thiz);
+
+  return ret;
+}
+
+/* Set the session filter back to the one before blocking any peer, plus the
+ * peers still blocked. Call it without the object lock
+ */
+static void
+gst_bt_demux_apply_blocked_peers (GstBtDemux * thiz)
 {
   using namespace libtorrent;
-  GstBtDemux *demux;
-  GstBtDemuxStream *thiz;
-  GstBtDemuxBufferData *ipc_data;
-  GstBuffer *buf;
-  GstFlowReturn ret;
-  GstBtDemuxBufferData *buf_data;
-  GSList *walk;
-  guint8 *data;
+  GHashTableIter iter;
+  gpointer key;
   session *s;
-  torrent_handle h;
-  gboolean update_buffering = FALSE;
-  gboolean send_eos = FALSE;
+  ip_filter filter;
 
-  thiz = GST_BT_DEMUX_STREAM (user_data);
-  demux = GST_BT_DEMUX (gst_pad_get_parent (GST_PAD (thiz)));
+  GST_OBJECT_LOCK (thiz);
+  if (!thiz->ip_filter) {
+    GST_OBJECT_UNLOCK (thiz);
+    return;
+  }
 
-  if (demux->finished) {
-    gst_pad_pause_task (GST_PAD (thiz));
+  filter = *((ip_filter *) thiz->ip_filter);
+  g_hash_table_iter_init (&iter, thiz->blocked_peers);
+  while (g_hash_table_iter_next (&iter, &key, NULL)) {
+    error_code ec;
+    address addr = address::from_string ((const gchar *) key, ec);
+
+    if (!ec)
+      filter.add_rule (addr, addr, ip_filter::blocked);
+  }
+
+  /* nothing blocked anymore */
+  if (!g_hash_table_size (thiz->blocked_peers)) {
+    delete ((ip_filter *) thiz->ip_filter);
+    thiz->ip_filter = NULL;
+  }
+  GST_OBJECT_UNLOCK (thiz);
+
+  s = (session *)thiz->session;
+  s->set_ip_filter (filter);
+}
+
+/* Unblock the peers blocked for long enough, or every peer if now is not
+ * valid
+ */
+static void
+gst_bt_demux_expire_blocked_peers (GstBtDemux * thiz, GstClockTime now)
+{
+  GHashTableIter iter;
+  gpointer key, value;
+  gint expired = 0;
+
+  GST_OBJECT_LOCK (thiz);
+  g_hash_table_iter_init (&iter, thiz->blocked_peers);
+  while (g_hash_table_iter_next (&iter, &key, &value)) {
+    if (GST_CLOCK_TIME_IS_VALID (now) && *((GstClockTime *) value) > now)
+      continue;
+
+    GST_INFO_OBJECT (thiz, "Unblocking peer %s", (const gchar *) key);
+    g_hash_table_iter_remove (&iter);
+    expired++;
+  }
+  GST_OBJECT_UNLOCK (thiz);
+
+  if (expired)
+    gst_bt_demux_apply_blocked_peers (thiz);
+}
+
+/* Block the snubbed peers and the ones far slower than the average that are
+ * holding blocks of the piece until the expiration time, so its blocks are
+ * requested to others. The last peer having the piece is never blocked
+ */
+static void
+gst_bt_demux_block_slow_peers (GstBtDemux * thiz, libtorrent::torrent_handle h,
+    gint piece, GstClockTime expiration)
+{
+  using namespace libtorrent;
+  std::vector<peer_info> peers;
+  std::vector<peer_info>::iterator it;
+  session *s;
+  ip_filter current;
+  gchar *direct;
+  gint64 total = 0;
+  gint holders = 0;
+  gint blocked = 0;
+
+  h.get_peer_info (peers);
+  if (peers.empty ())
     return;
+
+  GST_OBJECT_LOCK (thiz);
+  direct = g_strdup (thiz->peers);
+  GST_OBJECT_UNLOCK (thiz);
+
+  for (it = peers.begin (); it != peers.end (); ++it) {
+    total += it->down_speed;
+    if (it->pieces.size () > piece && it->pieces[piece])
+      holders++;
   }
 
-  ipc_data = (GstBtDemuxBufferData *)g_async_queue_pop (thiz->ipc);
-  if (!ipc_data) {
-    gst_pad_pause_task (GST_PAD (thiz));
+  for (it = peers.begin (); it != peers.end (); ++it) {
+    GstClockTime *value;
+    std::string addr;
+
+    if (it->downloading_piece_index != piece)
+      continue;
+
+    /* the mirrors are not affected by the filter */
+    if (it->connection_type != peer_info::standard_bittorrent)
+      continue;
+
+    if (!(it->flags & peer_info::snubbed) && (gint64) it->down_speed *
+        SLOW_PEER_RATIO * (gint64) peers.size () >= total)
+      continue;
+
+    /* never leave the piece without peers */
+    if (holders <= 1)
+      break;
+
+    /* never block the peers we were told about */
+    addr = it->ip.address ().to_string ();
+    if (gst_bt_session_has_peer (direct, addr.c_str ()))
+      continue;
+
+    GST_INFO_OBJECT (thiz, "Blocking peer %s holding piece %d at %d bytes/s",
+        addr.c_str (), piece, it->down_speed);
+    value = g_new (GstClockTime, 1);
+    *value = expiration;
+    GST_OBJECT_LOCK (thiz);
+    g_hash_table_replace (thiz->blocked_peers, g_strdup (addr.c_str ()),
+        value);
+    GST_OBJECT_UNLOCK (thiz);
+    holders--;
+    blocked++;
+  }
+  g_free (direct);
+
+  if (!blocked)
+    return;
+
+  /* keep the filter to go back to */
+  s = (session *)thiz->session;
+  current = s->get_ip_filter ();
+  GST_OBJECT_LOCK (thiz);
+  if (!thiz->ip_filter)
+    thiz->ip_filter = new ip_filter (current);
+  GST_OBJECT_UNLOCK (thiz);
+
+  gst_bt_demux_apply_blocked_peers (thiz);
+}
+
+/* Watch the time the playhead piece of every stream takes to download and
+ * escalate its request when it is over the stall timeout
+ */
+static void
+gst_bt_demux_check_stalls (GstBtDemux * thiz, libtorrent::torrent_handle h)
+{
+  GSList *walk;
+  GstClockTime timeout;
+  GstClockTime now;
+
+  GST_OBJECT_LOCK (thiz);
+  timeout = thiz->stall_timeout * GST_MSECOND;
+  GST_OBJECT_UNLOCK (thiz);
+
+  now = gst_util_get_timestamp ();
+  gst_bt_demux_expire_blocked_peers (thiz, now);
+
+  if (!timeout)
     return;
+
+  g_mutex_lock (thiz->streams_lock);
+  for (walk = thiz->streams; walk; walk = g_slist_next (walk)) {
+    GstBtDemuxStream *stream = GST_BT_DEMUX_STREAM (walk->data);
+    GstClockTime requested;
+    gint piece;
+    gint level;
+    gint i;
+
+    g_static_rec_mutex_lock (stream->lock);
+    piece = gst_bt_scheduler_next_piece (&stream->sched,
+        stream->sched.current_piece);
+    if (!stream->sched.requested || stream->finished ||
+        !gst_bt_scheduler_piece_in_segment (&stream->sched, piece) ||
+        gst_bt_demux_have_piece (thiz, h, piece)) {
+      g_static_rec_mutex_unlock (stream->lock);
+      continue;
+    }
+
+    if (stream->stall_piece != piece) {
+      stream->stall_piece = piece;
+      stream->stall_level = GST_BT_DEMUX_STALL_NONE;
+    }
+
+    requested = gst_bt_demux_piece_requested (thiz, piece);
+    if (!GST_CLOCK_TIME_IS_VALID (requested) || now - requested < timeout) {
+      g_static_rec_mutex_unlock (stream->lock);
+      continue;
+    }
+
+    level = (gint) MIN ((now - requested) / timeout,
+        (GstClockTime) GST_BT_DEMUX_STALL_BLOCK_PEERS);
+    if (level <= stream->stall_level) {
+      g_static_rec_mutex_unlock (stream->lock);
+      continue;
+    }
+
+    GST_WARNING_OBJECT (stream, "Piece %d stalled for %" GST_TIME_FORMAT
+        ", escalating to level %d", piece, GST_TIME_ARGS (now - requested),
+        level);
+    GST_BT_TRACE (stream, piece_stalled, stream->sched.idx, piece);
+
+    /* a long stall skips levels, apply every one of them */
+    for (i = stream->stall_level + 1; i <= level; i++) {
+      if (i == GST_BT_DEMUX_STALL_DEADLINE)
+        h.set_piece_deadline (piece, 0);
+      else if (i == GST_BT_DEMUX_STALL_BLOCK_PEERS)
+        gst_bt_demux_block_slow_peers (thiz, h, piece,
+            now + timeout * BLOCK_TIMEOUTS);
+    }
+    stream->stall_level = level;
+    g_static_rec_mutex_unlock (stream->lock);
   }
+  g_mutex_unlock (thiz->streams_lock);
+}
+
+/* Every stream is handled by the alert worker of its file, so the alerts of
+ * a stream are handled in order even if a piece spans several files. A
+ * negative worker takes every stream
+ */
+static gboolean
+gst_bt_demux_stream_on_worker (GstBtDemuxStream * stream, gint worker,
+    guint num_workers)
+{
+  return worker < 0 || (guint) stream->sched.idx % num_workers ==
+      (guint) worker;
+}
 
-  if (!ipc_data->size) {
-    gst_bt_demux_buffer_data_free (ipc_data);
+/* A piece failed its hash check, libtorrent downloads it again but if it is
+ * part of a read-ahead do not wait for the picker to get to it
+ */
+static void
+gst_bt_demux_piece_hash_failed (GstBtDemux * thiz,
+    libtorrent::torrent_handle h, gint piece, gint worker, guint num_workers)
+{
+  GSList *streams, *walk;
+  gboolean urgent = FALSE;
+
+  streams = gst_bt_demux_get_streams (thiz);
+  for (walk = streams; walk; walk = g_slist_next (walk)) {
+    GstBtDemuxStream *stream = GST_BT_DEMUX_STREAM (walk->data);
+
+    if (!gst_bt_demux_stream_on_worker (stream, worker, num_workers))
+      continue;
+
+    g_static_rec_mutex_lock (stream->lock);
+    if (stream->sched.requested &&
+        gst_bt_scheduler_piece_in_window (&stream->sched, piece,
+        gst_bt_demux_stream_high_pieces (thiz, stream))) {
+      GST_BT_TRACE (stream, piece_hash_failed, stream->sched.idx, piece);
+      /* start the stall detection again */
+      if (stream->stall_piece == piece)
+        stream->stall_piece = -1;
+      urgent = TRUE;
+    }
+    g_static_rec_mutex_unlock (stream->lock);
+  }
+  g_slist_free_full (streams, gst_object_unref);
+
+  if (urgent) {
+    gst_bt_demux_piece_mark (thiz, piece, GST_BT_DEMUX_PIECE_REQUESTED);
+    h.set_piece_deadline (piece, 0);
+  }
+}
+
+/*----------------------------------------------------------------------------*
+ *                              The web seeds                                 *
+ *----------------------------------------------------------------------------*/
+/* Add the mirrors set on the element to the ones of the metainfo url-list */
+static void
+gst_bt_demux_web_seeds_params (GstBtDemux * thiz,
+    libtorrent::add_torrent_params & tp)
+{
+  gchar **urls;
+  gint i;
+
+  GST_OBJECT_LOCK (thiz);
+  urls = thiz->web_seeds ? g_strsplit (thiz->web_seeds, ",", -1) : NULL;
+  GST_OBJECT_UNLOCK (thiz);
+
+  if (!urls)
     return;
+
+  for (i = 0; urls[i]; i++) {
+    g_strstrip (urls[i]);
+    if (*urls[i] == '\0')
+      continue;
+    GST_DEBUG_OBJECT (thiz, "Adding web seed '%s'", urls[i]);
+    tp.url_seeds.push_back (urls[i]);
+  }
+  g_strfreev (urls);
+}
+
+/* Keep the urls of every mirror of the torrent, we need them to add them
+ * back after backing off
+ */
+static void
+gst_bt_demux_web_seeds_init (GstBtDemux * thiz, libtorrent::torrent_handle h)
+{
+  std::set<std::string> seeds = h.url_seeds ();
+  std::set<std::string>::iterator it;
+  gchar **urls;
+  gint i = 0;
+
+  urls = g_new0 (gchar *, seeds.size () + 1);
+  for (it = seeds.begin (); it != seeds.end (); ++it)
+    urls[i++] = g_strdup (it->c_str ());
+
+  GST_OBJECT_LOCK (thiz);
+  g_strfreev (thiz->web_seed_urls);
+  thiz->web_seed_urls = urls;
+  thiz->web_seeds_active = TRUE;
+  GST_OBJECT_UNLOCK (thiz);
+
+  GST_INFO_OBJECT (thiz, "Using %d web seeds", i);
+}
+
+/* The mirrors fill the read-ahead while the peer connections ramp up. Once
+ * the swarm alone delivers the backoff rate stop them to not waste their
+ * bandwidth, and use them again when it is not enough anymore
+ */
+static void
+gst_bt_demux_update_web_seeds (GstBtDemux * thiz,
+    libtorrent::torrent_handle h)
+{
+  using namespace libtorrent;
+  std::vector<peer_info> peers;
+  std::vector<peer_info>::iterator it;
+  gboolean active;
+  gboolean buffering;
+  guint backoff_rate;
+  gint swarm_rate = 0;
+  gint i;
+
+  GST_OBJECT_LOCK (thiz);
+  if (!thiz->web_seed_urls || !thiz->web_seed_urls[0] ||
+      !thiz->web_seeds_backoff_rate) {
+    GST_OBJECT_UNLOCK (thiz);
+    return;
+  }
+  active = thiz->web_seeds_active;
+  buffering = thiz->buffering;
+  backoff_rate = thiz->web_seeds_backoff_rate;
+  GST_OBJECT_UNLOCK (thiz);
+
+  /* the mirrors are not part of the swarm */
+  h.get_peer_info (peers);
+  for (it = peers.begin (); it != peers.end (); ++it) {
+    if (it->connection_type == peer_info::standard_bittorrent)
+      swarm_rate += it->down_speed;
+  }
+
+  if (active && !buffering && (guint) swarm_rate >= backoff_rate) {
+    active = FALSE;
+  } else if (!active && (buffering || (guint) swarm_rate < backoff_rate / 2)) {
+    active = TRUE;
+  } else {
+    return;
+  }
+
+  GST_DEBUG_OBJECT (thiz, "%s the web seeds, the swarm delivers %d bytes/s",
+      active ? "Using" : "Backing off from", swarm_rate);
+
+  GST_OBJECT_LOCK (thiz);
+  thiz->web_seeds_active = active;
+  for (i = 0; thiz->web_seed_urls[i]; i++) {
+    if (active)
+      h.add_url_seed (thiz->web_seed_urls[i]);
+    else
+      h.remove_url_seed (thiz->web_seed_urls[i]);
+  }
+  GST_OBJECT_UNLOCK (thiz);
+}
+
+/*----------------------------------------------------------------------------*
+ *                           The scheduler torrent                            *
+ *----------------------------------------------------------------------------*/
+class GstBtDemuxTorrent : public GstBtTorrent
+{
+public:
+  GstBtDemuxTorrent (GstBtDemux * demux, libtorrent::torrent_handle h)
+      : demux (demux), h (h) {}
+
+  bool have_piece (int piece)
+  {
+    return gst_bt_demux_have_piece (demux, h, piece);
+  }
+
+  int piece_priority (int piece)
+  {
+    return h.piece_priority (piece);
+  }
+
+  void piece_priority (int piece, int priority)
+  {
+    h.piece_priority (piece, priority);
+    if (priority)
+      gst_bt_demux_piece_mark (demux, piece, GST_BT_DEMUX_PIECE_REQUESTED);
+  }
+
+  void read_piece (GstBtSchedulerStream * stream, int piece)
+  {
+    gst_bt_demux_request_read (demux, h, demux->files[stream->idx].stream,
+        piece);
   }
 
+private:
+  GstBtDemux *demux;
+  libtorrent::torrent_handle h;
+};
+
+/* A piece could not be read. The pieces evicted from the RAM ring are
+ * downloaded again while the streams waiting for them buffer, on any other
+ * storage it is fatal
+ */
+static void
+gst_bt_demux_read_failed (GstBtDemux * thiz, libtorrent::torrent_handle h,
+    gint piece, const libtorrent::error_code & ec)
+{
+  GstBtDemuxTorrent t (thiz, h);
+  GSList *walk;
+  gboolean update_buffering = FALSE;
+
+  if (!thiz->ram_ring) {
+    GST_ELEMENT_ERROR (thiz, RESOURCE, READ,
+        ("Failed to read piece %d", piece), ("%s", ec.message ().c_str ()));
+    return;
+  }
+
+  GST_DEBUG_OBJECT (thiz, "Piece %d evicted before being read", piece);
+  g_mutex_lock (thiz->streams_lock);
+  for (walk = thiz->streams; walk; walk = g_slist_next (walk)) {
+    GstBtDemuxStream *stream = GST_BT_DEMUX_STREAM (walk->data);
+    gint high;
+
+    g_static_rec_mutex_lock (stream->lock);
+    if (!stream->sched.requested || piece != gst_bt_scheduler_next_piece (
+        &stream->sched, stream->sched.current_piece)) {
+      g_static_rec_mutex_unlock (stream->lock);
+      continue;
+    }
+
+    /* request it again and wait for it */
+    high = gst_bt_demux_stream_high_pieces (thiz, stream);
+    gst_bt_scheduler_add_piece (&stream->sched, t, piece, high);
+    update_buffering |= gst_bt_scheduler_start_buffering (&stream->sched, t,
+        high);
+    g_static_rec_mutex_unlock (stream->lock);
+  }
+
+  if (update_buffering)
+    gst_bt_demux_send_buffering (thiz, h);
+  g_mutex_unlock (thiz->streams_lock);
+}
+
+/*----------------------------------------------------------------------------*
+ *                             The stream class                               *
+ *----------------------------------------------------------------------------*/
+
+G_DEFINE_TYPE (GstBtDemuxStream, gst_bt_demux_stream, GST_TYPE_PAD);
+
+/* Typefind the first piece received and add the pad to the element. This
+ * runs on the stream thread given that adding the pad links and autoplugs
+ * downstream synchronously
+ */
+static void
+gst_bt_demux_stream_expose (GstBtDemuxStream * thiz, GstBtDemux * demux,
+    GstBtPieceQueueItem * ipc_data)
+{
+  GstCaps *caps = NULL;
+  gboolean typefind;
+  guint typefind_size;
+
+  GST_OBJECT_LOCK (demux);
+  typefind = demux->typefind;
+  typefind_size = demux->typefind_size;
+  GST_OBJECT_UNLOCK (demux);
+
+  if (typefind) {
+    GstTypeFindProbability prob;
+    GstBuffer *buf;
+    gsize size;
+
+    g_static_rec_mutex_lock (thiz->lock);
+    buf = gst_bt_demux_buffer_new (ipc_data->buffer, ipc_data->piece,
+        ipc_data->size, demux->piece_length, thiz);
+    g_static_rec_mutex_unlock (thiz->lock);
+
+    /* only look at the beginning of the data */
+#if HAVE_GST_1
+    size = gst_buffer_get_size (buf);
+#else
+    size = GST_BUFFER_SIZE (buf);
+#endif
+    if (typefind_size && typefind_size < size) {
+      GstBuffer *prefix;
+
+#if HAVE_GST_1
+      prefix = gst_buffer_copy_region (buf, GST_BUFFER_COPY_MEMORY, 0,
+          typefind_size);
+#else
+      prefix = gst_buffer_create_sub (buf, 0, typefind_size);
+#endif
+      gst_buffer_unref (buf);
+      buf = prefix;
+    }
+
+    caps = gst_type_find_helper_for_buffer (GST_OBJECT (demux), buf, &prob);
+    gst_buffer_unref (buf);
+  }
+
+  gst_pad_set_active (GST_PAD (thiz), TRUE);
+  if (caps) {
+    gst_pad_set_caps (GST_PAD (thiz), caps);
+    gst_caps_unref (caps);
+  }
+  gst_element_add_pad (GST_ELEMENT (demux), GST_PAD (gst_object_ref (thiz)));
+
+  g_static_rec_mutex_lock (thiz->lock);
+  thiz->exposed = TRUE;
+  g_static_rec_mutex_unlock (thiz->lock);
+
+  g_mutex_lock (demux->streams_lock);
+  gst_bt_demux_check_no_more_pads (demux);
+  g_mutex_unlock (demux->streams_lock);
+}
+
+/* Push a piece received from the alert thread downstream */
+static void
+gst_bt_demux_stream_push_data (GstBtDemuxStream * thiz, GstBtDemux * demux,
+    GstBtPieceQueueItem * ipc_data)
+{
+  using namespace libtorrent;
+  GstBuffer *buf;
+  GstFlowReturn ret;
+  gsize size;
+  session *s;
+  torrent_handle h;
+  gboolean update_buffering = FALSE;
+  gboolean send_eos = FALSE;
+  gboolean send_segment_done = FALSE;
+  gboolean expose;
+  gint next;
+
+  GST_BT_TRACE (thiz, piece_popped, thiz->sched.idx, ipc_data->piece);
+
   s = (session *)demux->session;
   h = s->get_torrents ()[0];
 
   g_static_rec_mutex_lock (thiz->lock);
-  if (ipc_data->piece < thiz->start_piece && ipc_data->piece > thiz->end_piece) {
-    gst_bt_demux_buffer_data_free (ipc_data);
+  expose = thiz->sched.requested && !thiz->exposed;
+  g_static_rec_mutex_unlock (thiz->lock);
+
+  /* create the pad if needed */
+  if (expose)
+    gst_bt_demux_stream_expose (thiz, demux, ipc_data);
+
+  g_static_rec_mutex_lock (thiz->lock);
+  if (!gst_bt_scheduler_piece_in_segment (&thiz->sched, ipc_data->piece)) {
     g_static_rec_mutex_unlock (thiz->lock);
-    return;
+    goto release;
   }
 
-  if (!thiz->requested) {
-    gst_bt_demux_buffer_data_free (ipc_data);
+  if (!thiz->sched.requested) {
     g_static_rec_mutex_unlock (thiz->lock);
-    return;
+    goto release;
   }
 
   /* in case we are not expecting this buffer */
-  if (ipc_data->piece != thiz->current_piece + 1) {
+  next = gst_bt_scheduler_next_piece (&thiz->sched, thiz->sched.current_piece);
+  if (ipc_data->piece != next) {
     GST_DEBUG_OBJECT (thiz, "Dropping piece %d, waiting for %d on "
-        "file %d", ipc_data->piece, thiz->current_piece + 1, thiz->idx);
-    gst_bt_demux_buffer_data_free (ipc_data);
+        "file %d", ipc_data->piece, next, thiz->sched.idx);
+    thiz->dropped++;
     g_static_rec_mutex_unlock (thiz->lock);
-    return;
+    goto release;
   }
 
   buf = gst_bt_demux_buffer_new (ipc_data->buffer, ipc_data->piece,
-    ipc_data->size, thiz);
+    ipc_data->size, demux->piece_length, thiz);
+  /* backwards or skipping, every piece is a discontinuity */
+  if (thiz->sched.step != 1)
+    GST_BUFFER_FLAG_SET (buf, GST_BUFFER_FLAG_DISCONT);
 
   GST_DEBUG_OBJECT (thiz, "Received piece %d of size %d on file %d",
-      ipc_data->piece, ipc_data->size, thiz->idx);
+      ipc_data->piece, ipc_data->size, thiz->sched.idx);
 
   /* read the next piece */
-  if (ipc_data->piece + 1 <= thiz->end_piece) {
-    if (h.have_piece (ipc_data->piece + 1)) {
-      GST_DEBUG_OBJECT (thiz, "Reading next piece %d, current: %d",
-          ipc_data->piece + 1, thiz->current_piece);
-      h.read_piece (ipc_data->piece + 1);
-    } else {
-      int i;
-
-      GST_DEBUG_OBJECT (thiz, "Start buffering next piece %d",
-          ipc_data->piece + 1);
-      /* start buffering now that the piece is not available */
-      gst_bt_demux_stream_start_buffering (thiz, h,
-          demux->buffer_pieces);
-      update_buffering = TRUE;
-    }
+  {
+    GstBtDemuxTorrent t (demux, h);
+
+    update_buffering = gst_bt_scheduler_piece_pushed (&thiz->sched, t,
+        ipc_data->piece, gst_bt_demux_stream_high_pieces (demux, thiz),
+        gst_bt_demux_stream_low_pieces (demux, thiz));
   }
 
-  if (thiz->pending_segment) {
+  if (thiz->sched.pending_segment) {
     GstEvent *event;
 #if HAVE_GST_1
     GstSegment *segment;
@@ -262,25 +1410,45 @@ gst_bt_demux_stream_push_loop (gpointer user_data)
 #if HAVE_GST_1
     segment = gst_segment_new ();
     gst_segment_init (segment, GST_FORMAT_BYTES);
-    gst_segment_do_seek (segment, 1.0, GST_FORMAT_BYTES,
-        GST_SEEK_FLAG_NONE, GST_SEEK_TYPE_SET, thiz->start_byte,
+    gst_segment_do_seek (segment, thiz->sched.rate, GST_FORMAT_BYTES,
+        thiz->segment_seek ? GST_SEEK_FLAG_SEGMENT : GST_SEEK_FLAG_NONE,
+        GST_SEEK_TYPE_SET, thiz->start_byte,
         GST_SEEK_TYPE_SET, thiz->end_byte, &update);
     event = gst_event_new_segment (segment);
 #else
-    event = gst_event_new_new_segment (FALSE, 1.0, GST_FORMAT_BYTES,
-        thiz->start_byte, thiz->end_byte, thiz->start_byte);
+    event = gst_event_new_new_segment (FALSE, thiz->sched.rate,
+        GST_FORMAT_BYTES, thiz->start_byte, thiz->end_byte, thiz->start_byte);
 #endif
     gst_pad_push_event (GST_PAD (thiz), event);
-    thiz->pending_segment = FALSE;
+    thiz->sched.pending_segment = FALSE;
+    thiz->last_byte = -1;
   }
 
   GST_DEBUG_OBJECT (thiz, "Pushing buffer, size: %d, file: %d, piece: %d",
-      ipc_data->size, thiz->idx, ipc_data->piece);
+      ipc_data->size, thiz->sched.idx, ipc_data->piece);
 
   /* keep track of the current piece */
-  thiz->current_piece = ipc_data->piece;
+  thiz->sched.current_piece = ipc_data->piece;
+  if (demux->ram_ring)
+    gst_bt_ram_ring_set_playhead ((GstBtRamRing *) demux->ram_ring,
+        ipc_data->piece);
+
+#if HAVE_GST_1
+  size = gst_buffer_get_size (buf);
+#else
+  size = GST_BUFFER_SIZE (buf);
+#endif
+  /* where the data pushed ends, backwards it is where the buffer starts */
+  thiz->last_byte = thiz->sched.rate < 0.0 ? (gint64) GST_BUFFER_OFFSET (buf) :
+      (gint64) GST_BUFFER_OFFSET_END (buf);
 
   ret = gst_pad_push (GST_PAD (thiz), buf);
+  thiz->pushed++;
+  thiz->bytes += size;
+  if (!GST_CLOCK_TIME_IS_VALID (thiz->first_buffer))
+    thiz->first_buffer = gst_util_get_timestamp () - thiz->activated;
+  GST_BT_TRACE (thiz, piece_pushed, thiz->sched.idx, ipc_data->piece);
+  gst_bt_demux_piece_mark (demux, ipc_data->piece, GST_BT_DEMUX_PIECE_PUSHED);
   if (ret != GST_FLOW_OK) {
     send_eos = TRUE;
     if (ret == GST_FLOW_NOT_LINKED || ret <= GST_FLOW_UNEXPECTED) {
@@ -291,160 +1459,300 @@ gst_bt_demux_stream_push_loop (gpointer user_data)
     }
   }
 
-#if 0
-  /* send the end of segment in case we need to */
-  if (ipc_data->piece == thiz->end_piece) {
-
+  /* send the EOS downstream, check that last push didnt trigger a new seek */
+  if (!gst_bt_scheduler_piece_in_segment (&thiz->sched,
+      gst_bt_scheduler_next_piece (&thiz->sched, ipc_data->piece)) &&
+      !thiz->sched.pending_segment) {
+    if (thiz->segment_seek && !send_eos)
+      send_segment_done = TRUE;
+    else
+      send_eos = TRUE;
   }
+
+  /* wait for the next segment seek */
+  if (send_segment_done) {
+    gint64 stop = thiz->sched.rate < 0.0 ? thiz->start_byte : thiz->end_byte;
+
+    GST_DEBUG_OBJECT (thiz, "Segment done on file %d", thiz->sched.idx);
+    gst_element_post_message (GST_ELEMENT_CAST (demux),
+        gst_message_new_segment_done (GST_OBJECT_CAST (demux),
+        GST_FORMAT_BYTES, stop));
+#if HAVE_GST_1
+    gst_pad_push_event (GST_PAD (thiz),
+        gst_event_new_segment_done (GST_FORMAT_BYTES, stop));
 #endif
+  }
 
-  /* send the EOS downstream, check that last push didnt trigger a new seek */
-  if (ipc_data->piece == thiz->last_piece && !thiz->pending_segment)
-    send_eos = TRUE;
+  if (send_eos) {
+    GstEvent *eos;
+
+    eos = gst_event_new_eos ();
+    GST_DEBUG_OBJECT (thiz, "Sending EOS on file %d", thiz->sched.idx);
+    gst_pad_push_event (GST_PAD (thiz), eos);
+    gst_pad_pause_task (GST_PAD (thiz));
+    thiz->finished = TRUE;
+  }
+  g_static_rec_mutex_unlock (thiz->lock);
+
+  /* send information about the whole element, only then the other streams
+   * are involved
+   */
+  if (update_buffering) {
+    g_mutex_lock (demux->streams_lock);
+    gst_bt_demux_send_buffering (demux, h);
+    g_mutex_unlock (demux->streams_lock);
+  }
+
+release:
+  /* the piece is not ours anymore, let more reads go */
+  gst_bt_demux_budget_add (demux, -ipc_data->size);
+  gst_bt_demux_flush_reads (demux, h);
+}
+
+/* The dedicated pad task, blocks until a piece arrives */
+static void
+gst_bt_demux_stream_push_loop (gpointer user_data)
+{
+  GstBtDemux *demux;
+  GstBtDemuxStream *thiz;
+  GstBtPieceQueueItem ipc_data;
+
+  thiz = GST_BT_DEMUX_STREAM (user_data);
+  demux = GST_BT_DEMUX (gst_pad_get_parent (GST_PAD (thiz)));
+  if (!demux) {
+    gst_pad_pause_task (GST_PAD (thiz));
+    return;
+  }
+
+  if (demux->finished) {
+    gst_pad_pause_task (GST_PAD (thiz));
+    goto done;
+  }
 
-  if (send_eos) {
-    GstEvent *eos;
+  /* prerolled, hand the stream over to the shared pool */
+  if (demux->task_pool && GST_STATE (demux) == GST_STATE_PLAYING) {
+    g_static_rec_mutex_lock (thiz->lock);
+    GST_DEBUG_OBJECT (thiz, "Moving to the shared pool");
+    thiz->pad_task = FALSE;
+    gst_pad_pause_task (GST_PAD (thiz));
+    if (!gst_bt_piece_queue_is_empty ((GstBtPieceQueue *) thiz->ipc))
+      gst_bt_demux_stream_start_pushing (thiz, demux);
+    g_static_rec_mutex_unlock (thiz->lock);
+    goto done;
+  }
 
-    eos = gst_event_new_eos ();
-    GST_DEBUG_OBJECT (thiz, "Sending EOS on file %d", thiz->idx);
-    gst_pad_push_event (GST_PAD (thiz), eos);
+  /* closed, we are shutting down */
+  if (!gst_bt_piece_queue_pop ((GstBtPieceQueue *) thiz->ipc, &ipc_data)) {
     gst_pad_pause_task (GST_PAD (thiz));
-    thiz->finished = TRUE;
+    goto done;
   }
-  g_static_rec_mutex_unlock (thiz->lock);
 
-  /* send information about the whole element */
-  g_mutex_unlock (demux->streams_lock);
-  if (update_buffering)
-    gst_bt_demux_send_buffering (demux, h);
+  gst_bt_demux_stream_push_data (thiz, demux, &ipc_data);
 
-  g_mutex_unlock (demux->streams_lock);
-  gst_bt_demux_buffer_data_free (ipc_data);
+done:
+  gst_object_unref (demux);
 }
 
-
+/* The job run on the shared task pool, pushes every queued piece and
+ * returns, so a few threads can serve every stream
+ */
 static void
-gst_bt_demux_stream_update_buffering (GstBtDemuxStream * thiz,
-    libtorrent::torrent_handle h, int max_pieces)
+gst_bt_demux_stream_push_job (gpointer user_data)
 {
-  using namespace libtorrent;
-  int i;
-  int start = thiz->current_piece + 1;
-  int end = thiz->current_piece + max_pieces;
-  int buffered_pieces = 0;
-
-  /* do not overflow */
-  if (end > thiz->end_piece)
-    end = thiz->end_piece;
+  GstBtDemuxPushJob *job = (GstBtDemuxPushJob *) user_data;
+  GstBtDemuxStream *thiz = job->stream;
+  GstBtDemux *demux = job->demux;
+
+  for (;;) {
+    GstBtPieceQueueItem ipc_data;
+
+    /* the lock keeps the scheduled flag in sync with the queue */
+    g_static_rec_mutex_lock (thiz->lock);
+    if (demux->finished || !gst_bt_piece_queue_try_pop (
+        (GstBtPieceQueue *) thiz->ipc, &ipc_data)) {
+      thiz->scheduled = FALSE;
+      g_static_rec_mutex_unlock (thiz->lock);
+      break;
+    }
+    g_static_rec_mutex_unlock (thiz->lock);
 
-  /* count how many consecutive pieces have been downloaded */
-  for (i = start; i <= end; i++) {
-    if (h.have_piece (i))
-      buffered_pieces++;
+    gst_bt_demux_stream_push_data (thiz, demux, &ipc_data);
   }
+  gst_object_unref (thiz);
 
-  if (buffered_pieces > thiz->buffering_count)
-    buffered_pieces = thiz->buffering_count;
-
-  thiz->buffering = TRUE;
-  thiz->buffering_level = (buffered_pieces * 100) / thiz->buffering_count;
-  GST_DEBUG_OBJECT (thiz, "Buffering level %d (%d/%d)", thiz->buffering_level,
-      buffered_pieces, thiz->buffering_count);
+  /* the demuxer reference is released once joined */
+  g_mutex_lock (demux->jobs_lock);
+  job->done = TRUE;
+  g_cond_broadcast (demux->jobs_cond);
+  g_mutex_unlock (demux->jobs_lock);
 }
 
+/* Join the finished jobs, or wait for every job to finish and join them
+ * all. Must be called without the jobs lock
+ */
 static void
-gst_bt_demux_stream_add_piece (GstBtDemuxStream * thiz,
-    libtorrent::torrent_handle h, int piece, int max_pieces)
+gst_bt_demux_reap_jobs (GstBtDemux * thiz, gboolean wait)
 {
-  using namespace libtorrent;
+  GList *walk, *next, *reaped = NULL;
 
-  GST_DEBUG_OBJECT (thiz, "Adding more pieces at %d, current: %d, "
-      "max: %d", piece, thiz->current_piece, max_pieces);
-  for (piece; piece <= thiz->end_piece; piece++) {
-    int priority;
+  g_mutex_lock (thiz->jobs_lock);
+  for (;;) {
+    gboolean pending = FALSE;
 
-    if (h.have_piece (piece))
-      continue;
+    for (walk = thiz->jobs; walk; walk = next) {
+      GstBtDemuxPushJob *job = (GstBtDemuxPushJob *) walk->data;
 
-    /* if already scheduled, do nothing */
-    priority = h.piece_priority (piece);
-    if (priority == 7)
-      continue;
+      next = g_list_next (walk);
+      if (!job->queued || !job->done) {
+        pending = TRUE;
+        continue;
+      }
 
-    /* max priority */
-    priority = 7;
+      thiz->jobs = g_list_remove_link (thiz->jobs, walk);
+      reaped = g_list_concat (walk, reaped);
+    }
 
-    h.piece_priority (piece, priority);
-    GST_DEBUG_OBJECT (thiz, "Requesting piece %d, prio: %d, current: %d, ",
-        piece, priority, thiz->current_piece);
-    break;
+    if (!wait || !pending)
+      break;
+    g_cond_wait (thiz->jobs_cond, thiz->jobs_lock);
+  }
+  g_mutex_unlock (thiz->jobs_lock);
+
+  for (walk = reaped; walk; walk = g_list_next (walk)) {
+    GstBtDemuxPushJob *job = (GstBtDemuxPushJob *) walk->data;
+
+    /* the default pool does not return an id, nothing to join */
+    if (job->id)
+      gst_task_pool_join (job->pool, job->id);
+    gst_object_unref (job->pool);
+    gst_object_unref (job->demux);
+    g_free (job);
   }
+  g_list_free (reaped);
 }
 
-static gboolean
-gst_bt_demux_stream_activate (GstBtDemuxStream * thiz,
-    libtorrent::torrent_handle h, int max_pieces)
+/* Start pushing the queued pieces, must be called with the stream lock. A
+ * sink blocks on the push while prerolling, until every other stream has
+ * prerolled too, so until the element is playing every stream keeps its own
+ * pad task instead of holding a thread of the shared pool
+ */
+static void
+gst_bt_demux_stream_start_pushing (GstBtDemuxStream * thiz,
+    GstBtDemux * demux)
 {
-  gboolean ret = FALSE;
+  GstBtDemuxPushJob *job;
+  GstTaskPool *pool = demux->task_pool;
+  GError *err = NULL;
+  gpointer id;
 
-  thiz->requested = TRUE;
-  thiz->current_piece = thiz->start_piece - 1;
-  thiz->pending_segment = TRUE;
-
-  GST_DEBUG_OBJECT (thiz, "Activating stream '%s', start: %d, "
-      "start_offset: %d, end: %d, end_offset: %d, current: %d",
-      GST_PAD_NAME (thiz), thiz->start_piece, thiz->start_offset,
-      thiz->end_piece, thiz->end_offset, thiz->current_piece);
+  /* a job is already draining the queue */
+  if (thiz->scheduled)
+    return;
 
-  if (h.have_piece (thiz->start_piece)) {
-    /* request the first non-downloaded piece */
-    if (thiz->start_piece != thiz->end_piece) {
-      int i;
+  if (!pool || thiz->pad_task || GST_STATE (demux) != GST_STATE_PLAYING) {
+    /* the pad task moves to the pool by itself once playing */
+    thiz->pad_task = pool != NULL;
+#if HAVE_GST_1
+    gst_pad_start_task (GST_PAD (thiz), gst_bt_demux_stream_push_loop,
+        thiz, NULL);
+#else
+    gst_pad_start_task (GST_PAD (thiz), gst_bt_demux_stream_push_loop,
+        thiz);
+#endif
+    return;
+  }
 
-      for (i = 1; i < max_pieces; i++) {
-        gst_bt_demux_stream_add_piece (thiz, h, thiz->start_piece + i,
-            max_pieces);
-      }
-    }
+  /* do not pile up the finished jobs */
+  gst_bt_demux_reap_jobs (demux, FALSE);
+
+  job = g_new0 (GstBtDemuxPushJob, 1);
+  job->demux = GST_BT_DEMUX (gst_object_ref (demux));
+  job->stream = GST_BT_DEMUX_STREAM (gst_object_ref (thiz));
+  job->pool = GST_TASK_POOL (gst_object_ref (pool));
+
+  g_mutex_lock (demux->jobs_lock);
+  demux->jobs = g_list_prepend (demux->jobs, job);
+  g_mutex_unlock (demux->jobs_lock);
+
+  thiz->scheduled = TRUE;
+  id = gst_task_pool_push (pool, gst_bt_demux_stream_push_job, job, &err);
+  if (err) {
+    GST_ERROR_OBJECT (thiz, "Failed to push the job: %s", err->message);
+    g_error_free (err);
+    thiz->scheduled = FALSE;
+
+    g_mutex_lock (demux->jobs_lock);
+    demux->jobs = g_list_remove (demux->jobs, job);
+    g_mutex_unlock (demux->jobs_lock);
+
+    gst_object_unref (job->pool);
+    gst_object_unref (job->stream);
+    gst_object_unref (job->demux);
+    g_free (job);
+    return;
+  }
 
-  } else {
-    int i;
+  g_mutex_lock (demux->jobs_lock);
+  job->id = id;
+  job->queued = TRUE;
+  g_cond_broadcast (demux->jobs_cond);
+  g_mutex_unlock (demux->jobs_lock);
+}
 
-    for (i = 0; i < max_pieces; i++) {
-      gst_bt_demux_stream_add_piece (thiz, h, thiz->start_piece + i,
-          max_pieces);
-    }
-    /* start the buffering */
-    gst_bt_demux_stream_start_buffering (thiz, h, max_pieces);
-    ret = TRUE;
+/* Hand a piece to the stream thread, must be called with the stream lock so
+ * there is a single producer at a time. The piece only counts on the budget
+ * once queued, a closed queue drops it and a full one reads it again later
+ */
+static void
+gst_bt_demux_stream_queue_piece (GstBtDemuxStream * thiz, GstBtDemux * demux,
+    boost::shared_array <char> buffer, gint piece, gint size)
+{
+  gboolean overrun = FALSE;
+
+  /* account it first, the consumer releases it as soon as it is pushed */
+  gst_bt_demux_budget_add (demux, size);
+  if (!gst_bt_piece_queue_push ((GstBtPieceQueue *) thiz->ipc, buffer, piece,
+      size)) {
+    GST_OBJECT_LOCK (demux);
+    demux->queued_bytes -= MIN (demux->queued_bytes, (guint64) size);
+    if (!gst_bt_piece_queue_is_closed ((GstBtPieceQueue *) thiz->ipc))
+      overrun = gst_bt_demux_delay_read (demux, piece);
+    GST_OBJECT_UNLOCK (demux);
+
+    GST_DEBUG_OBJECT (thiz, "Queue closed or full, dropping piece %d", piece);
+    if (overrun)
+      gst_bt_demux_emit_overrun (demux);
+    return;
   }
+  GST_BT_TRACE (thiz, piece_queued, thiz->sched.idx, piece);
 
-  return ret;
+  /* start the task */
+  gst_bt_demux_stream_start_pushing (thiz, demux);
 }
 
 static void
-gst_bt_demux_stream_info (GstBtDemuxStream * thiz,
-    libtorrent::torrent_handle h, gint * start_offset,
-    gint * start_piece, gint * end_offset, gint * end_piece,
-    gint64 * size)
+gst_bt_demux_stream_info (GstBtDemuxStream * thiz, GstBtDemux * demux,
+    GstBtRange * range, gint64 * offset, gint64 * size)
 {
-  using namespace libtorrent;
-  file_entry fe;
-  int piece_length;
-  torrent_info ti = h.get_torrent_info ();
-
-  piece_length = ti.piece_length ();
-  fe = ti.file_at (thiz->idx);
-  if (start_piece)
-    *start_piece = fe.offset / piece_length;
-  if (start_offset)
-    *start_offset = fe.offset % piece_length;
-  if (end_piece)
-    *end_piece = (fe.offset + fe.size) / piece_length;
-  if (end_offset)
-    *end_offset = (fe.offset + fe.size) % piece_length;
+  GstBtDemuxFile *file;
+
+  /* the files table does not change while the stream exists */
+  file = &demux->files[thiz->sched.idx];
+  if (range)
+    gst_bt_range_map (file->offset, file->size, demux->piece_length, range);
+  if (offset)
+    *offset = file->offset;
   if (size)
-    *size = fe.size;
+    *size = file->size;
+}
+
+/* Measure the time to the first buffer and the throughput from now */
+static void
+gst_bt_demux_stream_reset_stats (GstBtDemuxStream * thiz)
+{
+  thiz->activated = gst_util_get_timestamp ();
+  thiz->first_buffer = GST_CLOCK_TIME_NONE;
+  thiz->bytes = 0;
 }
 
 static gboolean
@@ -457,18 +1765,22 @@ gst_bt_demux_stream_seek (GstBtDemuxStream * thiz, GstEvent * event)
   GstSeekType start_type, stop_type;
   gint64 start, stop;
   gdouble rate;
-  gint start_piece, start_offset, end_piece, end_offset;
+  gint64 file_offset, file_size;
+  GstBtRange range;
   torrent_handle h;
   session *s;
   int piece_length;
-  int tmp;
   gboolean update_buffering;
   gboolean ret = FALSE;
 
+  /* keep the demuxer alive until we are done */
   demux = GST_BT_DEMUX (gst_pad_get_parent (GST_PAD (thiz)));
+  if (!demux)
+    return FALSE;
+
   s = (session *)demux->session;
   h = s->get_torrents ()[0];
-  gst_object_unref (demux);
+  GstBtDemuxTorrent t (demux, h);
 
   /* get the piece length */
   torrent_info ti = h.get_torrent_info ();
@@ -481,31 +1793,26 @@ gst_bt_demux_stream_seek (GstBtDemuxStream * thiz, GstEvent * event)
   if (format != GST_FORMAT_BYTES)
     goto beach;
 
-  if (rate < 0.0)
+  if (rate == 0.0)
     goto beach;
 
-  gst_bt_demux_stream_info (thiz, h, &start_offset,
-      &start_piece, &end_offset, &end_piece, NULL);
+  gst_bt_demux_stream_info (thiz, demux, NULL, &file_offset, &file_size);
 
+  /* the segment is relative to the file */
   if (start < 0)
     start = 0;
+  if (start > file_size)
+    start = file_size;
 
-  if (stop < 0) {
-    int num_pieces;
+  if (stop < 0 || stop > file_size)
+    stop = file_size;
 
-    num_pieces = end_piece - start_piece + 1;
-    if (num_pieces == 1) {
-      /* all the bytes on a single piece */
-      stop = end_offset - start_offset;
-    } else {
-      /* count the full pieces */
-      stop = (num_pieces - 2) * piece_length;
-      /* add the start bytes */
-      stop += piece_length - start_offset;
-      /* add the end bytes */
-      stop += end_offset;
-    }
-  }
+  if (stop < start)
+    goto beach;
+
+  if (!gst_bt_range_map (file_offset + start, stop - start, piece_length,
+      &range))
+    goto beach;
 
   if (flags & GST_SEEK_FLAG_FLUSH) {
     GstEvent *flush_stop;
@@ -518,41 +1825,66 @@ gst_bt_demux_stream_seek (GstBtDemuxStream * thiz, GstEvent * event)
 #endif
     gst_pad_push_event (GST_PAD (thiz), flush_stop);
   } else {
-    /* TODO we need to close the segment */
-  }
-
-  if (flags & GST_SEEK_FLAG_SEGMENT) {
-    GST_ERROR ("Segment seek");
+#if !HAVE_GST_1
+    /* close the running segment at the last byte pushed */
+    g_static_rec_mutex_lock (thiz->lock);
+    if (thiz->sched.requested && !thiz->sched.pending_segment &&
+        thiz->last_byte >= 0) {
+      gint64 seg_start, seg_stop;
+
+      if (thiz->sched.rate < 0.0) {
+        seg_start = thiz->last_byte;
+        seg_stop = thiz->end_byte;
+      } else {
+        seg_start = thiz->start_byte;
+        seg_stop = thiz->last_byte;
+      }
+      gst_pad_push_event (GST_PAD (thiz), gst_event_new_new_segment (TRUE,
+          thiz->sched.rate, GST_FORMAT_BYTES, seg_start, seg_stop,
+          seg_start));
+    }
+    g_static_rec_mutex_unlock (thiz->lock);
+#endif
   }
 
   g_static_rec_mutex_lock (thiz->lock);
+  /* on a segment seek we post a segment done instead of sending the EOS */
+  thiz->segment_seek = (flags & GST_SEEK_FLAG_SEGMENT) ? TRUE : FALSE;
 
   /* update the stream segment */
   thiz->start_byte = start;
-  thiz->end_byte = stop,
+  thiz->end_byte = stop;
 
-  thiz->end_piece = start_piece + ((stop + start_offset) / piece_length);
-  thiz->end_offset = start_piece + ((stop + start_offset) % piece_length); 
+  thiz->sched.start_piece = range.start_piece;
+  thiz->start_offset = range.start_offset;
+  thiz->sched.end_piece = range.end_piece;
+  thiz->end_offset = range.end_offset;
 
-  tmp = start_piece;
-  thiz->start_piece = start_piece + ((start + start_offset) / piece_length);
-  thiz->start_offset = tmp + ((start + start_offset) % piece_length);
+  gst_bt_scheduler_set_rate (&thiz->sched, rate, flags & GST_SEEK_FLAG_SKIP);
 
   GST_DEBUG_OBJECT (thiz, "Seeking to, start: %d, start_offset: %d, end: %d, "
-      "end_offset: %d", thiz->start_piece, thiz->start_offset,
-      thiz->end_piece, thiz->end_offset);
+      "end_offset: %d, rate: %f", thiz->sched.start_piece, thiz->start_offset,
+      thiz->sched.end_piece, thiz->end_offset, rate);
+
+  /* a looping segment is played again and again, keep it in memory */
+  if (thiz->segment_seek)
+    gst_bt_piece_cache_pin ((GstBtPieceCache *) demux->piece_cache,
+        thiz->sched.idx, thiz->sched.start_piece, thiz->sched.end_piece);
+  else
+    gst_bt_piece_cache_unpin ((GstBtPieceCache *) demux->piece_cache,
+        thiz->sched.idx);
 
   /* activate again this stream */
-  update_buffering = gst_bt_demux_stream_activate (thiz, h,
-      demux->buffer_pieces);
+  gst_bt_demux_stream_reset_stats (thiz);
+  update_buffering = gst_bt_scheduler_activate (&thiz->sched, t,
+      gst_bt_demux_stream_high_pieces (demux, thiz));
   if (!update_buffering) {
     /* FIXME what if the demuxer is already buffering ? */
     /* start directly */
-    GST_DEBUG_OBJECT (thiz, "Starting stream '%s', reading piece %d, "
-        "current: %d", GST_PAD_NAME (thiz), thiz->start_piece,
-        thiz->current_piece);
-    h.read_piece (thiz->start_piece);
-    g_static_rec_mutex_unlock (thiz->lock);
+    GST_DEBUG_OBJECT (thiz, "Starting stream '%s'", GST_PAD_NAME (thiz));
+    gst_bt_scheduler_read_piece (&thiz->sched, t,
+        gst_bt_scheduler_next_piece (&thiz->sched,
+        thiz->sched.current_piece));
   }
 
   ret = TRUE;
@@ -564,6 +1896,7 @@ gst_bt_demux_stream_seek (GstBtDemuxStream * thiz, GstEvent * event)
     gst_bt_demux_send_buffering (demux, h);
 
 beach:
+  gst_object_unref (demux);
   return ret;
 }
 
@@ -615,17 +1948,12 @@ gst_bt_demux_stream_query (GstPad * pad, GstObject * object, GstQuery * query)
 
     case GST_QUERY_DURATION:
       {
-        session *s;
-        torrent_handle h;
         GstFormat fmt;
         gint64 bytes;
 
-        s = (session *)demux->session;
-        h = s->get_torrents ()[0];
-
         gst_query_parse_duration (query, &fmt, NULL);
         if (fmt == GST_FORMAT_BYTES) {
-          gst_bt_demux_stream_info (thiz, h, NULL, NULL, NULL, NULL, &bytes);
+          gst_bt_demux_stream_info (thiz, demux, NULL, NULL, &bytes);
           gst_query_set_duration (query, GST_FORMAT_BYTES, bytes);
           ret = TRUE;
         }
@@ -685,7 +2013,7 @@ gst_bt_demux_stream_dispose (GObject * object)
   }
 
   if (thiz->ipc) {
-    g_async_queue_unref (thiz->ipc);
+    gst_bt_piece_queue_free ((GstBtPieceQueue *) thiz->ipc);
     thiz->ipc = NULL;
   }
 
@@ -715,6 +2043,10 @@ gst_bt_demux_stream_init (GstBtDemuxStream * thiz)
 {
   thiz->lock = g_new (GStaticRecMutex, 1);
   g_static_rec_mutex_init (thiz->lock);
+  thiz->stall_piece = -1;
+  thiz->last_byte = -1;
+  thiz->sched.rate = 1.0;
+  thiz->sched.step = 1;
 
 #if HAVE_GST_1
   gst_pad_set_event_function (GST_PAD (thiz),
@@ -728,9 +2060,6 @@ gst_bt_demux_stream_init (GstBtDemuxStream * thiz)
       GST_DEBUG_FUNCPTR (gst_bt_demux_stream_query_simple));
 #endif
 
-  /* our ipc */
-  thiz->ipc = g_async_queue_new_full (
-      (GDestroyNotify)gst_bt_demux_buffer_data_free);
 }
 
 /*----------------------------------------------------------------------------*
@@ -740,16 +2069,44 @@ enum {
   PROP_0,
   PROP_SELECTOR_POLICY,
   PROP_TYPEFIND,
+  PROP_TYPEFIND_SIZE,
   PROP_N_STREAMS,
   PROP_CURRENT_STREAM,
   PROP_TEMP_LOCATION,
   PROP_TEMP_REMOVE,
+  PROP_STATS,
+  PROP_STATS_INTERVAL,
+  PROP_MAX_QUEUED_BYTES,
+  PROP_CURRENT_LEVEL_BYTES,
+  PROP_TASK_POOL,
+  PROP_SESSION_PROFILE,
+  PROP_SESSION_SETTINGS,
+  PROP_STORAGE,
+  PROP_RING_SIZE,
+  PROP_URING_QUEUE_DEPTH,
+  PROP_URING_DIRECT,
+  PROP_BUFFERING_UPLOAD_LIMIT,
+  PROP_BUFFERING_UNCHOKE_SLOTS,
+  PROP_STALL_TIMEOUT,
+  PROP_ALERT_THREADS,
+  PROP_LOW_WATERMARK_BYTES,
+  PROP_HIGH_WATERMARK_BYTES,
+  PROP_LOW_WATERMARK_TIME,
+  PROP_HIGH_WATERMARK_TIME,
+  PROP_CACHE_SIZE,
+  PROP_WEB_SEEDS,
+  PROP_WEB_SEEDS_BACKOFF_RATE,
+  PROP_PEERS,
 };
 
 enum
 {
   SIGNAL_GET_STREAM_TAGS,
+  SIGNAL_ADD_PEER,
+  SIGNAL_PREFETCH,
   SIGNAL_STREAMS_CHANGED,
+  SIGNAL_OVERRUN,
+  SIGNAL_UNDERRUN,
   LAST_SIGNAL
 };
 
@@ -833,6 +2190,8 @@ gst_bt_demux_sink_event (GstPad * pad, GstObject * object,
 
     tp.ti = torrent_info;
     tp.save_path = thiz->temp_location;
+    gst_bt_demux_web_seeds_params (thiz, tp);
+    gst_bt_demux_storage_params (thiz, tp);
 
     session = (libtorrent::session *)thiz->session;
     session->async_add_torrent (tp);
@@ -911,85 +2270,296 @@ gst_bt_demux_cclosure_marshal_BOXED__INT (GClosure     * closure,
   g_value_take_boxed (return_value, v_return);
 }
 
+#define g_marshal_value_peek_int64(v)    g_value_get_int64 (v)
+void
+gst_bt_demux_cclosure_marshal_BOOLEAN__INT_INT64_INT64_INT (
+                             GClosure     * closure,
+                             GValue       * return_value G_GNUC_UNUSED,
+                             guint         n_param_values,
+                             const GValue * param_values,
+                             gpointer      invocation_hint G_GNUC_UNUSED,
+                             gpointer      marshal_data)
+{
+  typedef gboolean (*GMarshalFunc_BOOLEAN__INT_INT64_INT64_INT) (
+                                               gpointer     data1,
+                                               gint         arg_1,
+                                               gint64       arg_2,
+                                               gint64       arg_3,
+                                               gint         arg_4,
+                                               gpointer     data2);
+  register GMarshalFunc_BOOLEAN__INT_INT64_INT64_INT callback;
+  register GCClosure * cc = (GCClosure *) closure;
+  register gpointer data1, data2;
+  gboolean v_return;
+
+  g_return_if_fail (return_value != NULL);
+  g_return_if_fail (n_param_values == 5);
+
+  if (G_CCLOSURE_SWAP_DATA (closure)) {
+    data1 = closure->data;
+    data2 = g_value_peek_pointer (param_values + 0);
+  }
+  else {
+    data1 = g_value_peek_pointer (param_values + 0);
+    data2 = closure->data;
+  }
+  callback = (GMarshalFunc_BOOLEAN__INT_INT64_INT64_INT) (marshal_data ?
+      marshal_data : cc->callback);
+
+  v_return = callback (data1, g_marshal_value_peek_int (param_values + 1),
+      g_marshal_value_peek_int64 (param_values + 2),
+      g_marshal_value_peek_int64 (param_values + 3),
+      g_marshal_value_peek_int (param_values + 4), data2);
+
+  g_value_set_boolean (return_value, v_return);
+}
+
+static void
+gst_bt_demux_emit_overrun (GstBtDemux * thiz)
+{
+  GST_DEBUG_OBJECT (thiz, "Memory budget reached");
+  g_signal_emit (thiz, gst_bt_demux_signals[SIGNAL_OVERRUN], 0);
+}
+
+static void
+gst_bt_demux_emit_underrun (GstBtDemux * thiz)
+{
+  GST_DEBUG_OBJECT (thiz, "Memory budget available again");
+  g_signal_emit (thiz, gst_bt_demux_signals[SIGNAL_UNDERRUN], 0);
+}
+
+/* Get the stream of a file, creating it on first use. Call it with the
+ * streams lock held
+ */
+static GstBtDemuxStream *
+gst_bt_demux_get_stream (GstBtDemux * thiz, gint idx)
+{
+  GstBtDemuxStream *stream;
+  GstBtDemuxFile *file;
+  GstBtRange range;
+  gchar *name;
+
+  if (idx < 0 || idx >= thiz->num_files)
+    return NULL;
+
+  file = &thiz->files[idx];
+  if (file->stream)
+    return file->stream;
+
+  /* create the pad */
+  name = g_strdup_printf ("src_%02d", idx);
+  stream = (GstBtDemuxStream *) g_object_new (
+      GST_TYPE_BT_DEMUX_STREAM, "name", name, "direction",
+      GST_PAD_SRC, "template", gst_static_pad_template_get (&src_factory), NULL);
+  g_free (name);
+
+  /* set the idx and the path */
+  stream->sched.idx = idx;
+  stream->path = g_strdup (file->path);
+
+  /* our ipc, the budget keeps it from filling up */
+  GST_OBJECT_LOCK (thiz);
+  stream->ipc = gst_bt_piece_queue_new (thiz->queue_size);
+  GST_OBJECT_UNLOCK (thiz);
+
+  /* get the pieces and offsets related to the file */
+  gst_bt_demux_stream_info (stream, thiz, &range, NULL, &stream->end_byte);
+  stream->sched.start_piece = range.start_piece;
+  stream->start_offset = range.start_offset;
+  stream->sched.end_piece = range.end_piece;
+  stream->end_offset = range.end_offset;
+  stream->start_byte = 0;
+  stream->last_piece = stream->sched.end_piece;
+
+  GST_INFO_OBJECT (thiz, "Adding stream %s for file '%s', "
+      " start_piece: %d, start_offset: %d, end_piece: %d, "
+      "end_offset: %d", GST_PAD_NAME (stream), stream->path,
+      stream->sched.start_piece, stream->start_offset, stream->sched.end_piece,
+      stream->end_offset);
+
+  /* add it to our list of streams */
+  file->stream = stream;
+  thiz->streams = g_slist_prepend (thiz->streams, stream);
+
+  return stream;
+}
 
 static GstTagList *
 gst_bt_demux_get_stream_tags (GstBtDemux * thiz, gint stream)
+{
+  GstTagList *tags = NULL;
+
+  g_mutex_lock (thiz->streams_lock);
+  if (stream >= 0 && stream < thiz->num_files) {
+#if HAVE_GST_1
+    tags = gst_tag_list_new_empty ();
+#else
+    tags = gst_tag_list_new ();
+#endif
+    /* set the file name, there is no standard tag for the file size */
+    gst_tag_list_add (tags, GST_TAG_MERGE_REPLACE, GST_TAG_TITLE,
+        thiz->files[stream].path, NULL);
+  }
+  g_mutex_unlock (thiz->streams_lock);
+
+  return tags;
+}
+
+/* Connect to the peers we were told about, libtorrent does nothing for the
+ * ones already connected so this also reconnects the dropped ones
+ */
+static void
+gst_bt_demux_connect_peers (GstBtDemux * thiz)
+{
+  gchar *peers;
+
+  GST_OBJECT_LOCK (thiz);
+  peers = g_strdup (thiz->peers);
+  GST_OBJECT_UNLOCK (thiz);
+
+  gst_bt_session_connect_peers (GST_OBJECT (thiz), thiz->session, peers);
+  g_free (peers);
+}
+
+static void
+gst_bt_demux_add_peer (GstBtDemux * thiz, const gchar * peer)
+{
+  gchar *peers;
+
+  if (!peer || !gst_bt_session_connect_peers (GST_OBJECT (thiz),
+      thiz->session, peer)) {
+    GST_WARNING_OBJECT (thiz, "Can not add the peer '%s'", peer);
+    return;
+  }
+
+  /* keep it for the reconnections */
+  GST_OBJECT_LOCK (thiz);
+  if (thiz->peers)
+    peers = g_strconcat (thiz->peers, ",", peer, NULL);
+  else
+    peers = g_strdup (peer);
+  g_free (thiz->peers);
+  thiz->peers = peers;
+  GST_OBJECT_UNLOCK (thiz);
+}
+
+/* Download a range of a file in the background without creating its pad, a
+ * negative length means up to the end of the file. Only the download
+ * priorities are raised, the pieces stay on the storage until a stream
+ * reads them, so the memory budget is not involved
+ */
+static gboolean
+gst_bt_demux_prefetch (GstBtDemux * thiz, gint stream, gint64 start,
+    gint64 length, gint priority)
 {
   using namespace libtorrent;
-  session *s;
-  file_entry fe;
   std::vector<torrent_handle> torrents;
-  int i;
+  std::vector<int> priorities;
+  GstBtDemuxFile *file;
+  GstBtRange range;
+  torrent_handle h;
+  session *s;
+  gboolean changed = FALSE;
+  gint piece;
 
-  if (!thiz->streams)
-    return NULL;
+  g_mutex_lock (thiz->streams_lock);
+  if (stream < 0 || stream >= thiz->num_files) {
+    g_mutex_unlock (thiz->streams_lock);
+    GST_WARNING_OBJECT (thiz, "Can not prefetch the unknown stream %d",
+        stream);
+    return FALSE;
+  }
+
+  file = &thiz->files[stream];
+  start = CLAMP (start, 0, file->size);
+  if (length < 0 || length > file->size - start)
+    length = file->size - start;
+
+  if (!gst_bt_range_map (file->offset + start, length, thiz->piece_length,
+      &range)) {
+    g_mutex_unlock (thiz->streams_lock);
+    return FALSE;
+  }
+  g_mutex_unlock (thiz->streams_lock);
 
-  /* get the torrent_info */
   s = (session *)thiz->session;
   torrents = s->get_torrents ();
+  if (torrents.empty ())
+    return FALSE;
 
-  torrent_info ti = torrents[0].get_torrent_info ();
-
-  for (i = 0; i < ti.num_files (); i++) {
-    file_entry fe = ti.file_at (i);
+  /* below the playing streams */
+  priority = CLAMP (priority, 1, 6);
+  GST_DEBUG_OBJECT (thiz, "Prefetching pieces %d to %d of stream %d with "
+      "priority %d", range.start_piece, range.end_piece, stream, priority);
 
-    /* TODO get the stream tags (i.e metadata) */
-    /* set the file name */
-    /* set the file size */
+  /* a single round trip to the network thread, never lowering the priority
+   * of the pieces already wanted
+   */
+  h = torrents[0];
+  priorities = h.piece_priorities ();
+  for (piece = range.start_piece; piece <= range.end_piece &&
+      piece < (gint) priorities.size (); piece++) {
+    if (priorities[piece] < priority) {
+      priorities[piece] = priority;
+      changed = TRUE;
+    }
   }
-  
-  return NULL;
+
+  if (changed)
+    h.prioritize_pieces (priorities);
+
+  return TRUE;
+}
+
+/* A copy of the streams with a reference on each, so the caller can work on
+ * them without holding the streams lock
+ */
+static GSList *
+gst_bt_demux_get_streams (GstBtDemux * thiz)
+{
+  GSList *ret = NULL;
+  GSList *walk;
+
+  g_mutex_lock (thiz->streams_lock);
+  for (walk = thiz->streams; walk; walk = g_slist_next (walk))
+    ret = g_slist_prepend (ret, gst_object_ref (walk->data));
+  g_mutex_unlock (thiz->streams_lock);
+
+  return g_slist_reverse (ret);
 }
 
 static GSList *
 gst_bt_demux_get_policy_streams (GstBtDemux * thiz)
 {
-  using namespace libtorrent;
   GSList *ret = NULL;
+  gint i;
 
   switch (thiz->policy) {
     case GST_BT_DEMUX_SELECTOR_POLICY_ALL:
       {
-        GSList *walk;
-
-        /* copy the streams list */
-        for (walk = thiz->streams; walk; walk = g_slist_next (walk)) {
-          GstBtDemuxStream *stream = GST_BT_DEMUX_STREAM (walk->data);
-          ret = g_slist_append (ret, gst_object_ref (stream));
+        /* every file gets its stream */
+        for (i = thiz->num_files - 1; i >= 0; i--) {
+          GstBtDemuxStream *stream = gst_bt_demux_get_stream (thiz, i);
+          ret = g_slist_prepend (ret, gst_object_ref (stream));
         }
         break;
       }
 
     case GST_BT_DEMUX_SELECTOR_POLICY_LARGER:
       {
-        file_entry fe;
-        session *s;
-        std::vector<torrent_handle> torrents;
-        int i;
         int index = 0;
 
-        s = (session *)thiz->session;
-        torrents = s->get_torrents ();
-        if (torrents.size () < 1)
-          break;
-
-        torrent_info ti = torrents[0].get_torrent_info ();
-        if (ti.num_files () < 1)
+        if (thiz->num_files < 1)
           break;
 
-        fe = ti.file_at (0);
-        for (i = 0; i < ti.num_files (); i++) {
-          file_entry fee = ti.file_at (i);
-
+        for (i = 0; i < thiz->num_files; i++) {
           /* get the larger file */
-          if (fee.size > fe.size) {
-            fe = fee;
+          if (thiz->files[i].size > thiz->files[index].size)
             index = i;
-          }
         }
 
-        ret = g_slist_append (ret, gst_object_ref (g_slist_nth_data (
-            thiz->streams, index)));
+        ret = g_slist_append (ret, gst_object_ref (gst_bt_demux_get_stream (
+            thiz, index)));
       }
 
     default:
@@ -1005,16 +2575,18 @@ gst_bt_demux_check_no_more_pads (GstBtDemux * thiz)
   GSList *walk;
   gboolean send = TRUE;
 
-  /* whenever every requested stream has an active pad inform about the
+  /* whenever every requested stream has an exposed pad inform about the
    * no more pads
    */
   for (walk = thiz->streams; walk; walk = g_slist_next (walk)) {
     GstBtDemuxStream *stream = GST_BT_DEMUX_STREAM (walk->data);
 
-    if (stream->requested && !gst_pad_is_active (GST_PAD (stream)))
+    g_static_rec_mutex_lock (stream->lock);
+    if (stream->sched.requested && !stream->exposed)
       send = FALSE;
-    if (!stream->requested && gst_pad_is_active (GST_PAD (stream)))
+    if (!stream->sched.requested && stream->exposed)
       send = FALSE;
+    g_static_rec_mutex_unlock (stream->lock);
   }
 
   if (send) {
@@ -1023,6 +2595,34 @@ gst_bt_demux_check_no_more_pads (GstBtDemux * thiz)
   }
 }
 
+/* Post the buffering level along with the download and playback rates and
+ * the estimated time to download the missing bytes
+ */
+static void
+gst_bt_demux_post_buffering (GstBtDemux * thiz, gdouble level,
+    guint64 missing, guint64 avg_out)
+{
+  GstMessage *message;
+  gint64 left = -1;
+  gint avg_in;
+
+  GST_OBJECT_LOCK (thiz);
+  avg_in = thiz->download_rate;
+  GST_OBJECT_UNLOCK (thiz);
+
+  if (avg_in > 0)
+    left = gst_util_uint64_scale (missing, 1000, avg_in);
+
+  GST_DEBUG_OBJECT (thiz, "Buffering %f%%, in: %d bytes/s, out: %"
+      G_GUINT64_FORMAT " bytes/s, left: %" G_GINT64_FORMAT " ms", level,
+      avg_in, avg_out, left);
+
+  message = gst_message_new_buffering (GST_OBJECT_CAST (thiz), (gint) level);
+  gst_message_set_buffering_stats (message, GST_BUFFERING_STREAM, avg_in,
+      (gint) MIN (avg_out, (guint64) G_MAXINT), left);
+  gst_element_post_message (GST_ELEMENT_CAST (thiz), message);
+}
+
 static void
 gst_bt_demux_send_buffering (GstBtDemux * thiz, libtorrent::torrent_handle h)
 {
@@ -1030,6 +2630,8 @@ gst_bt_demux_send_buffering (GstBtDemux * thiz, libtorrent::torrent_handle h)
   GSList *walk;
   int num_buffering = 0;
   int buffering = 0;
+  guint64 missing = 0;
+  guint64 avg_out = 0;
   gboolean start_pushing = FALSE;
 
   /* generate the real buffering level */
@@ -1038,21 +2640,24 @@ gst_bt_demux_send_buffering (GstBtDemux * thiz, libtorrent::torrent_handle h)
 
     g_static_rec_mutex_lock (stream->lock);
 
-    if (!stream->requested) {
+    if (!stream->sched.requested) {
       g_static_rec_mutex_unlock (stream->lock);
       continue;
     }
 
-    if (!stream->buffering) {
+    avg_out += gst_bt_demux_stream_output_rate (stream);
+    if (!stream->sched.buffering) {
       g_static_rec_mutex_unlock (stream->lock);
       continue;
     }
 
-    buffering += stream->buffering_level;
+    buffering += stream->sched.buffering_level;
+    missing += (guint64) thiz->piece_length * stream->sched.buffering_count *
+        (100 - stream->sched.buffering_level) / 100;
     /* unset the stream buffering */
-    if (stream->buffering_level == 100) {
-      stream->buffering = FALSE;
-      stream->buffering_level = 0;
+    if (stream->sched.buffering_level == 100) {
+      stream->sched.buffering = FALSE;
+      stream->sched.buffering_level = 0;
     }
     num_buffering++;
     g_static_rec_mutex_unlock (stream->lock);
@@ -1061,37 +2666,40 @@ gst_bt_demux_send_buffering (GstBtDemux * thiz, libtorrent::torrent_handle h)
   if (num_buffering) {
     gdouble level = ((gdouble) buffering) / num_buffering;
     if (thiz->buffering) {
-      gst_element_post_message (GST_ELEMENT_CAST (thiz),
-          gst_message_new_buffering (GST_OBJECT_CAST (thiz), level));
+      gst_bt_demux_post_buffering (thiz, level, missing, avg_out);
       if (level >= 100.0) {
         thiz->buffering = FALSE;
         start_pushing = TRUE;
       }
     } else if (level < 100.0) {
-      gst_element_post_message (GST_ELEMENT_CAST (thiz),
-          gst_message_new_buffering (GST_OBJECT_CAST (thiz), level));
+      gst_bt_demux_post_buffering (thiz, level, missing, avg_out);
       thiz->buffering = TRUE;
     }
   }
 
   /* start pushing buffers on every stream */
   if (start_pushing) {
+    GstBtDemuxTorrent t (thiz, h);
+
     for (walk = thiz->streams; walk; walk = g_slist_next (walk)) {
       GstBtDemuxStream *stream = GST_BT_DEMUX_STREAM (walk->data);
 
       g_static_rec_mutex_lock (stream->lock);
-      if (!stream->requested) {
+      if (!stream->sched.requested) {
         g_static_rec_mutex_unlock (stream->lock);
         continue;
       }
 
-      GST_DEBUG_OBJECT (thiz, "Buffering finished, reading piece %d"
-          ", current: %d", stream->current_piece + 1,
-          stream->current_piece);
-      h.read_piece (stream->current_piece + 1);
+      GST_DEBUG_OBJECT (thiz, "Buffering finished on stream '%s'",
+          GST_PAD_NAME (stream));
+      gst_bt_scheduler_read_piece (&stream->sched, t,
+          gst_bt_scheduler_next_piece (&stream->sched,
+          stream->sched.current_piece));
       g_static_rec_mutex_unlock (stream->lock);
     }
   }
+
+  gst_bt_demux_update_upload_policy (thiz, h);
 }
 
 static void
@@ -1106,7 +2714,7 @@ gst_bt_demux_activate_streams (GstBtDemux * thiz)
 
 
   g_mutex_lock (thiz->streams_lock);
-  if (!thiz->streams) {
+  if (!thiz->num_files) {
     g_mutex_unlock (thiz->streams_lock);
     return;
   }
@@ -1120,6 +2728,7 @@ gst_bt_demux_activate_streams (GstBtDemux * thiz)
 
   s = (session *)thiz->session;
   h = s->get_torrents ()[0];
+  GstBtDemuxTorrent t (thiz, h);
 
   /* mark every stream as not requested */
   for (walk = thiz->streams; walk; walk = g_slist_next (walk)) {
@@ -1128,7 +2737,7 @@ gst_bt_demux_activate_streams (GstBtDemux * thiz)
     /* TODO set the priority to 0 on every piece */
     /* Actually inactivate it? */
     g_static_rec_mutex_lock (stream->lock);
-    stream->requested = FALSE;
+    stream->sched.requested = FALSE;
     g_static_rec_mutex_unlock (stream->lock);
   }
 
@@ -1138,8 +2747,9 @@ gst_bt_demux_activate_streams (GstBtDemux * thiz)
 
     g_static_rec_mutex_lock (stream->lock);
     GST_DEBUG_OBJECT (thiz, "Requesting stream %s", GST_PAD_NAME (stream));
-    update_buffering |= gst_bt_demux_stream_activate (stream, h,
-        thiz->buffer_pieces);
+    gst_bt_demux_stream_reset_stats (stream);
+    update_buffering |= gst_bt_scheduler_activate (&stream->sched, t,
+        gst_bt_demux_stream_high_pieces (thiz, stream));
     g_static_rec_mutex_unlock (stream->lock);
   }
 
@@ -1151,19 +2761,139 @@ gst_bt_demux_activate_streams (GstBtDemux * thiz)
     for (walk = streams; walk; walk = g_slist_next (walk)) {
       GstBtDemuxStream *stream = GST_BT_DEMUX_STREAM (walk->data);
 
-      g_static_rec_mutex_lock (stream->lock);
-      GST_DEBUG_OBJECT (thiz, "Starting stream '%s', reading piece %d, "
-          "current: %d", GST_PAD_NAME (stream), stream->start_piece,
-          stream->current_piece);
-      h.read_piece (stream->start_piece);
-      g_static_rec_mutex_unlock (stream->lock);
-    }
+      g_static_rec_mutex_lock (stream->lock);
+      GST_DEBUG_OBJECT (thiz, "Starting stream '%s'", GST_PAD_NAME (stream));
+      gst_bt_scheduler_read_piece (&stream->sched, t,
+          stream->sched.start_piece);
+      g_static_rec_mutex_unlock (stream->lock);
+    }
+  }
+
+  g_slist_free_full (streams, gst_object_unref);
+  g_mutex_unlock (thiz->streams_lock);
+}
+
+
+/* A piece has finished downloading, let the streams of the worker schedule
+ * their reads
+ */
+static void
+gst_bt_demux_piece_finished (GstBtDemux * thiz, libtorrent::torrent_handle h,
+    gint piece, gint worker, guint num_workers)
+{
+  GstBtDemuxTorrent t (thiz, h);
+  GSList *streams, *walk;
+  gboolean update_buffering = FALSE;
+
+  /* read the piece once it is finished and send downstream in order,
+   * without the streams lock given that the workers run in parallel
+   */
+  streams = gst_bt_demux_get_streams (thiz);
+  for (walk = streams; walk; walk = g_slist_next (walk)) {
+    GstBtDemuxStream *stream = GST_BT_DEMUX_STREAM (walk->data);
+
+    if (!gst_bt_demux_stream_on_worker (stream, worker, num_workers))
+      continue;
+
+    g_static_rec_mutex_lock (stream->lock);
+    if (piece < stream->sched.start_piece || piece > stream->sched.end_piece) {
+      g_static_rec_mutex_unlock (stream->lock);
+      continue;
+    }
+
+    if (!stream->sched.requested) {
+      g_static_rec_mutex_unlock (stream->lock);
+      continue;
+    }
+
+    update_buffering |= gst_bt_scheduler_piece_finished (&stream->sched, t,
+        piece, gst_bt_demux_stream_high_pieces (thiz, stream));
+    g_static_rec_mutex_unlock (stream->lock);
+  }
+  g_slist_free_full (streams, gst_object_unref);
+
+  if (update_buffering) {
+    g_mutex_lock (thiz->streams_lock);
+    gst_bt_demux_send_buffering (thiz, h);
+    g_mutex_unlock (thiz->streams_lock);
+  }
+}
+
+static void
+gst_bt_demux_alert_worker (gpointer data, gpointer user_data)
+{
+  GstBtDemux *thiz = GST_BT_DEMUX (user_data);
+  GstBtDemuxAlertJob *job = (GstBtDemuxAlertJob *) data;
+
+  if (job->type == libtorrent::piece_finished_alert::alert_type)
+    gst_bt_demux_piece_finished (thiz, job->h, job->piece, job->worker,
+        job->num_workers);
+  else
+    gst_bt_demux_piece_hash_failed (thiz, job->h, job->piece, job->worker,
+        job->num_workers);
+  delete job;
+}
+
+/* The index of the file where the byte at offset is */
+static gint
+gst_bt_demux_offset_file (GstBtDemux * thiz, gint64 offset)
+{
+  gint low = 0;
+  gint high = thiz->num_files - 1;
+
+  while (low < high) {
+    gint mid = (low + high + 1) / 2;
+
+    if (thiz->files[mid].offset <= offset)
+      low = mid;
+    else
+      high = mid - 1;
   }
 
-  g_slist_free_full (streams, gst_object_unref);
-  g_mutex_unlock (thiz->streams_lock);
+  return low;
 }
 
+/* The alerts that only touch the piece priorities and the buffering of the
+ * streams are handled on the alert workers, the rest stays on the alert
+ * thread. The read pieces are kept here too, given that they must reach every
+ * stream in order. The piece goes to the worker of every file it spans, so
+ * each worker keeps the order of its streams. Returns FALSE if there are no
+ * workers
+ */
+static gboolean
+gst_bt_demux_defer_piece (GstBtDemux * thiz, gint type,
+    libtorrent::torrent_handle h, gint piece)
+{
+  gint64 offset = (gint64) piece * thiz->piece_length;
+  gint first, last;
+  gint i;
+
+  GST_OBJECT_LOCK (thiz);
+  if (!thiz->alert_pools || !thiz->num_files) {
+    GST_OBJECT_UNLOCK (thiz);
+    return FALSE;
+  }
+
+  first = gst_bt_demux_offset_file (thiz, offset);
+  last = gst_bt_demux_offset_file (thiz, offset + thiz->piece_length - 1);
+  /* every worker at most once */
+  if (last - first >= (gint) thiz->num_alert_pools)
+    last = first + thiz->num_alert_pools - 1;
+
+  for (i = first; i <= last; i++) {
+    GstBtDemuxAlertJob *job = new GstBtDemuxAlertJob ();
+
+    job->type = type;
+    job->piece = piece;
+    job->h = h;
+    job->worker = i % thiz->num_alert_pools;
+    job->num_workers = thiz->num_alert_pools;
+    g_thread_pool_push (thiz->alert_pools[job->worker], job, NULL);
+  }
+  GST_OBJECT_UNLOCK (thiz);
+
+  return TRUE;
+}
 
 /* thread reading messages from libtorrent */
 static gboolean
@@ -1194,49 +2924,42 @@ gst_bt_demux_handle_alert (GstBtDemux * thiz, libtorrent::alert * a)
               "piece length: %d", p->params.ti->num_files (),
               p->params.ti->num_pieces (), p->params.ti->piece_length ());
 
-          /* create the streams */
-          for (i = 0; i < p->params.ti->num_files (); i++) {
-            GstBtDemuxStream *stream;
-            gchar *name;
-            file_entry fe;
-
-            /* create the pads */
-            name = g_strdup_printf ("src_%02d", i);
-
-            /* initialize the streams */
-            stream = (GstBtDemuxStream *) g_object_new (
-                GST_TYPE_BT_DEMUX_STREAM, "name", name, "direction",
-                GST_PAD_SRC, "template", gst_static_pad_template_get (&src_factory), NULL);
-            g_free (name);
-
-            /* set the idx */
-            stream->idx = i;
-
-            /* set the path */
-            fe =  p->params.ti->file_at (i);
-            stream->path = g_strdup (fe.path.c_str ());
-
-            /* get the pieces and offsets related to the file */
-            gst_bt_demux_stream_info (stream, h, &stream->start_offset,
-                &stream->start_piece, &stream->end_offset, &stream->end_piece,
-                &stream->end_byte);
-            stream->start_byte = 0;
-            stream->last_piece = stream->end_piece;
-
-            GST_INFO_OBJECT (thiz, "Adding stream %s for file '%s', "
-                " start_piece: %d, start_offset: %d, end_piece: %d, "
-                "end_offset: %d", GST_PAD_NAME (stream), stream->path,
-                stream->start_piece, stream->start_offset, stream->end_piece,
-                stream->end_offset);
-
-            /* add it to our list of streams */
-            thiz->streams = g_slist_append (thiz->streams, stream);
+          /* keep the files metadata only, the streams are created once
+           * selected
+           */
+          GST_OBJECT_LOCK (thiz);
+          thiz->piece_length = p->params.ti->piece_length ();
+          thiz->queue_size = gst_bt_demux_queue_size (thiz);
+          GST_OBJECT_UNLOCK (thiz);
+          g_mutex_lock (thiz->streams_lock);
+          thiz->num_files = p->params.ti->num_files ();
+          thiz->files = g_new0 (GstBtDemuxFile, thiz->num_files);
+          thiz->paths = g_string_chunk_new (4096);
+          for (i = 0; i < thiz->num_files; i++) {
+            file_entry fe = p->params.ti->file_at (i);
+
+            thiz->files[i].offset = fe.offset;
+            thiz->files[i].size = fe.size;
+            thiz->files[i].path = g_string_chunk_insert (thiz->paths,
+                fe.path.c_str ());
           }
+          g_mutex_unlock (thiz->streams_lock);
 
           /* mark every piece to none-priority */
           for (i = 0; i < p->params.ti->num_pieces (); i++) {
             h.piece_priority (i, 0);
           }
+          gst_bt_demux_stats_init (thiz, p->params.ti->num_pieces ());
+
+          /* start with every mirror to find the first pieces quickly */
+          gst_bt_demux_web_seeds_init (thiz, h);
+          gst_bt_demux_connect_peers (thiz);
+
+          /* a new torrent starts with the session upload limits */
+          GST_OBJECT_LOCK (thiz);
+          thiz->upload_limit_applied = -1;
+          thiz->unchoke_slots_applied = -1;
+          GST_OBJECT_UNLOCK (thiz);
 
           /* inform that we do know the available streams now */
           g_signal_emit (thiz, gst_bt_demux_signals[SIGNAL_STREAMS_CHANGED], 0);
@@ -1256,137 +2979,137 @@ gst_bt_demux_handle_alert (GstBtDemux * thiz, libtorrent::alert * a)
 
     case piece_finished_alert::alert_type:
       {
-        GSList *walk;
         piece_finished_alert *p = alert_cast<piece_finished_alert>(a);
-        torrent_handle h = p->handle;
-        torrent_status s = h.status();
-        gboolean update_buffering = FALSE;
 
+        gst_bt_demux_piece_mark (thiz, p->piece_index,
+            GST_BT_DEMUX_PIECE_FINISHED);
         GST_DEBUG_OBJECT (thiz, "Piece %d completed (down: %d kb/s, "
-            "up: %d kb/s, peers: %d)", p->piece_index, s.download_rate / 1000,
-            s.upload_rate  / 1000, s.num_peers);
-
-        g_mutex_lock (thiz->streams_lock);
-        /* read the piece once it is finished and send downstream in order */
-        for (walk = thiz->streams; walk; walk = g_slist_next (walk)) {
-          GstBtDemuxStream *stream = GST_BT_DEMUX_STREAM (walk->data);
-
-          g_static_rec_mutex_lock (stream->lock);
-          if (p->piece_index < stream->start_piece ||
-              p->piece_index > stream->end_piece) {
-            g_static_rec_mutex_unlock (stream->lock);
-            continue;
-          }
-
-          if (!stream->requested) {
-            g_static_rec_mutex_unlock (stream->lock);
-            continue;
-          }
-
-          /* low the priority again */
-          h.piece_priority (p->piece_index, 0);
-
-          /* update the buffering */
-          if (stream->buffering) {
-            gst_bt_demux_stream_update_buffering (stream, h, thiz->buffer_pieces);
-            update_buffering |= TRUE;
-          }
-
-          /* download the next piece */
-          gst_bt_demux_stream_add_piece (stream, h, p->piece_index + 1,
-              thiz->buffer_pieces);
-          g_static_rec_mutex_unlock (stream->lock);
-        }
+            "up: %d kb/s, peers: %d)", p->piece_index,
+            thiz->download_rate / 1000, thiz->upload_rate  / 1000,
+            thiz->num_peers);
 
-        if (update_buffering)
-          gst_bt_demux_send_buffering (thiz, h);
+        if (!gst_bt_demux_defer_piece (thiz, a->type (), p->handle,
+            p->piece_index))
+          gst_bt_demux_piece_finished (thiz, p->handle, p->piece_index, -1, 0);
+        break;
+      }
 
-        g_mutex_unlock (thiz->streams_lock);
+    case hash_failed_alert::alert_type:
+      {
+        hash_failed_alert *p = alert_cast<hash_failed_alert>(a);
+
+        GST_WARNING_OBJECT (thiz, "Piece %d failed the hash check",
+            p->piece_index);
+        if (!gst_bt_demux_defer_piece (thiz, a->type (), p->handle,
+            p->piece_index))
+          gst_bt_demux_piece_hash_failed (thiz, p->handle, p->piece_index, -1,
+              0);
         break;
       }
+
     case read_piece_alert::alert_type:
       {
         GSList *walk;
+        GSList *removed = NULL;
         read_piece_alert *p = alert_cast<read_piece_alert>(a);
-        gboolean topology_changed = FALSE;
+
+        gst_bt_demux_piece_mark (thiz, p->piece, GST_BT_DEMUX_PIECE_READ);
+        /* the read is not in flight anymore, the queued data is accounted
+         * instead
+         */
+        gst_bt_demux_budget_add (thiz, -thiz->piece_length);
+        if (!p->buffer) {
+          gst_bt_demux_read_failed (thiz, p->handle, p->piece, p->ec);
+          gst_bt_demux_flush_reads (thiz, p->handle);
+          break;
+        }
+        gst_bt_piece_cache_add ((GstBtPieceCache *) thiz->piece_cache,
+            p->piece, p->buffer, p->size);
 
         g_mutex_lock (thiz->streams_lock);
         /* read the piece once it is finished and send downstream in order */
         for (walk = thiz->streams; walk; walk = g_slist_next (walk)) {
-          GstBtDemuxBufferData *ipc_data;
           GstBtDemuxStream *stream = GST_BT_DEMUX_STREAM (walk->data);
 
           g_static_rec_mutex_lock (stream->lock);
-          if (p->piece < stream->start_piece ||
-              p->piece > stream->end_piece) {
+          if (p->piece < stream->sched.start_piece ||
+              p->piece > stream->sched.end_piece) {
             g_static_rec_mutex_unlock (stream->lock);
             continue;
           }
 
-          /* in case the pad is active but not requested, disable it */
-          if (gst_pad_is_active (GST_PAD (stream)) && !stream->requested) {
-            topology_changed = TRUE;
-            gst_pad_set_active (GST_PAD (stream), FALSE);
-            gst_element_remove_pad (GST_ELEMENT (thiz), GST_PAD (stream));
-            gst_pad_stop_task (GST_PAD (stream));
+          /* in case the pad is exposed but not requested, disable it once
+           * the locks the pad task takes are released
+           */
+          if (stream->exposed && !stream->sched.requested) {
+            stream->exposed = FALSE;
+            removed = g_slist_prepend (removed, gst_object_ref (stream));
             g_static_rec_mutex_unlock (stream->lock);
             continue;
           }
 
-          if (!stream->requested) {
+          if (!stream->sched.requested) {
             g_static_rec_mutex_unlock (stream->lock);
             continue;
           }
 
-          /* create the pad if needed */
-          if (!gst_pad_is_active (GST_PAD (stream))) {
-            gst_pad_set_active (GST_PAD (stream), TRUE);
-            gst_element_add_pad (GST_ELEMENT (thiz), GST_PAD (
-                gst_object_ref (stream)));
-            topology_changed = TRUE;
-
-            if (thiz->typefind) {
-              GstTypeFindProbability prob;
-              GstCaps *caps;
-              GstBuffer *buf;
-
-              buf = gst_bt_demux_buffer_new (p->buffer, p->piece, p->size,
-                  stream);
-
-              caps = gst_type_find_helper_for_buffer (GST_OBJECT (thiz), buf, &prob);
-              gst_buffer_unref (buf);
-
-              if (caps) {
-                gst_pad_set_caps (GST_PAD (stream), caps);
-                gst_caps_unref (caps);
-              }
-            }
-          }
-
+          GST_BT_TRACE (stream, piece_read, stream->sched.idx, p->piece);
           /* send the data to the stream thread */
-          ipc_data = g_new0 (GstBtDemuxBufferData, 1);
-          ipc_data->buffer = p->buffer;
-          ipc_data->piece = p->piece;
-          ipc_data->size = p->size;
-          g_async_queue_push (stream->ipc, ipc_data);
+          gst_bt_demux_stream_queue_piece (stream, thiz, p->buffer, p->piece,
+              p->size);
+          g_static_rec_mutex_unlock (stream->lock);
+        }
+        g_mutex_unlock (thiz->streams_lock);
 
-          /* start the task */
-#if HAVE_GST_1
-          gst_pad_start_task (GST_PAD (stream), gst_bt_demux_stream_push_loop,
-              stream, NULL);
-#else
-          gst_pad_start_task (GST_PAD (stream), gst_bt_demux_stream_push_loop,
-              stream);
-#endif
+        for (walk = removed; walk; walk = g_slist_next (walk)) {
+          GstBtDemuxStream *stream = GST_BT_DEMUX_STREAM (walk->data);
+          gint64 dropped;
+
+          /* wake up the task, stop it and accept pieces again in case the
+           * stream is requested later
+           */
+          gst_bt_piece_queue_close ((GstBtPieceQueue *) stream->ipc);
+          gst_pad_stop_task (GST_PAD (stream));
+          gst_pad_set_active (GST_PAD (stream), FALSE);
+          gst_element_remove_pad (GST_ELEMENT (thiz), GST_PAD (stream));
+
+          /* the pool jobs pop with the stream lock */
+          g_static_rec_mutex_lock (stream->lock);
+          stream->pad_task = FALSE;
+          dropped = gst_bt_piece_queue_reopen (
+              (GstBtPieceQueue *) stream->ipc);
           g_static_rec_mutex_unlock (stream->lock);
+
+          /* the dropped pieces will never be pushed */
+          gst_bt_demux_budget_add (thiz, -dropped);
         }
 
-        if (topology_changed)
+        if (removed) {
+          g_mutex_lock (thiz->streams_lock);
           gst_bt_demux_check_no_more_pads (thiz);
-        g_mutex_unlock (thiz->streams_lock);
+          g_mutex_unlock (thiz->streams_lock);
+          g_slist_free_full (removed, gst_object_unref);
+        }
+
+        gst_bt_demux_flush_reads (thiz, p->handle);
       }
       break;
 
+    case state_update_alert::alert_type:
+      {
+        state_update_alert *p = alert_cast<state_update_alert>(a);
+
+        if (p->status.size () < 1)
+          break;
+
+        GST_OBJECT_LOCK (thiz);
+        thiz->download_rate = p->status[0].download_rate;
+        thiz->upload_rate = p->status[0].upload_rate;
+        thiz->num_peers = p->status[0].num_peers;
+        GST_OBJECT_UNLOCK (thiz);
+        break;
+      }
+
     case torrent_removed_alert::alert_type:
       /* a safe cleanup, the torrent has been removed */
       ret = TRUE;
@@ -1405,6 +3128,49 @@ gst_bt_demux_handle_alert (GstBtDemux * thiz, libtorrent::alert * a)
   return ret;
 }
 
+/* periodic work done on the alert thread */
+static void
+gst_bt_demux_tick (GstBtDemux * thiz)
+{
+  using namespace libtorrent;
+  session *s;
+  std::vector<torrent_handle> torrents;
+  GstClockTime now;
+  gboolean send_stats = FALSE;
+
+  s = (session *)thiz->session;
+  now = gst_util_get_timestamp ();
+
+  /* the status arrives asynchronously as a state update alert */
+  torrents = s->get_torrents ();
+  if (!GST_CLOCK_TIME_IS_VALID (thiz->last_update) ||
+      now - thiz->last_update >= UPDATE_INTERVAL) {
+    s->post_torrent_updates ();
+    if (!torrents.empty ()) {
+      gst_bt_demux_update_web_seeds (thiz, torrents[0]);
+      gst_bt_demux_connect_peers (thiz);
+    }
+    thiz->last_update = now;
+  }
+
+  if (!torrents.empty ())
+    gst_bt_demux_check_stalls (thiz, torrents[0]);
+
+  GST_OBJECT_LOCK (thiz);
+  if (thiz->stats_interval && (!GST_CLOCK_TIME_IS_VALID (thiz->last_stats) ||
+      now - thiz->last_stats >= thiz->stats_interval * GST_MSECOND)) {
+    thiz->last_stats = now;
+    send_stats = TRUE;
+  }
+  GST_OBJECT_UNLOCK (thiz);
+
+  if (send_stats) {
+    gst_element_post_message (GST_ELEMENT_CAST (thiz),
+        gst_message_new_element (GST_OBJECT_CAST (thiz),
+        gst_bt_demux_get_stats (thiz)));
+  }
+}
+
 static void
 gst_bt_demux_loop (gpointer user_data)
 {
@@ -1412,11 +3178,14 @@ gst_bt_demux_loop (gpointer user_data)
   GstBtDemux *thiz;
   
   thiz = GST_BT_DEMUX (user_data);
+  thiz->last_update = GST_CLOCK_TIME_NONE;
+  thiz->last_stats = GST_CLOCK_TIME_NONE;
   while (!thiz->finished) {
     session *s;
     s = (session *)thiz->session;
 
-    if (s->wait_for_alert (libtorrent::seconds(10)) != NULL) {
+    if (s->wait_for_alert (libtorrent::milliseconds (
+        UPDATE_INTERVAL / GST_MSECOND)) != NULL) {
       std::deque<alert*> alerts;
       s->pop_alerts(&alerts);
 
@@ -1430,6 +3199,9 @@ gst_bt_demux_loop (gpointer user_data)
       }
       alerts.clear();
     }
+
+    if (!thiz->finished)
+      gst_bt_demux_tick (thiz);
   }
   gst_task_stop (thiz->task);
 }
@@ -1437,6 +3209,41 @@ gst_bt_demux_loop (gpointer user_data)
 static void
 gst_bt_demux_task_setup (GstBtDemux * thiz)
 {
+  GST_OBJECT_LOCK (thiz);
+  gst_bt_session_apply_settings (GST_OBJECT (thiz), thiz->session,
+      thiz->session_profile, thiz->session_settings);
+
+  /* the workers to offload the alert thread, every one on its own pool to
+   * handle its alerts in order
+   */
+  if (thiz->alert_threads) {
+    guint i;
+
+    thiz->alert_pools = g_new0 (GThreadPool *, thiz->alert_threads);
+    thiz->num_alert_pools = thiz->alert_threads;
+    for (i = 0; i < thiz->num_alert_pools; i++) {
+      GError *err = NULL;
+
+      thiz->alert_pools[i] = g_thread_pool_new (gst_bt_demux_alert_worker,
+          thiz, 1, FALSE, &err);
+      if (thiz->alert_pools[i])
+        continue;
+
+      GST_WARNING_OBJECT (thiz, "Failed to create the alert workers: %s",
+          err->message);
+      g_error_free (err);
+      /* use the ones created */
+      thiz->num_alert_pools = i;
+      break;
+    }
+
+    if (!thiz->num_alert_pools) {
+      g_free (thiz->alert_pools);
+      thiz->alert_pools = NULL;
+    }
+  }
+  GST_OBJECT_UNLOCK (thiz);
+
   /* to pop from the libtorrent async system */
 #if HAVE_GST_1
   thiz->task = gst_task_new (gst_bt_demux_loop, thiz, NULL);
@@ -1451,22 +3258,42 @@ static void
 gst_bt_demux_task_cleanup (GstBtDemux * thiz)
 {
   using namespace libtorrent;
-  GSList *walk;
+  GSList *streams, *walk;
+  GThreadPool **pools;
+  guint num_pools;
+  guint i;
   session *s;
   std::vector<torrent_handle> torrents;
 
-  /* pause every task */
-  g_mutex_lock (thiz->streams_lock);
-  for (walk = thiz->streams; walk; walk = g_slist_next (walk)) {
+  /* stop every task, without the streams lock as the pad tasks take it
+   * when exposing their pad
+   */
+  streams = gst_bt_demux_get_streams (thiz);
+  for (walk = streams; walk; walk = g_slist_next (walk)) {
     GstBtDemuxStream *stream = GST_BT_DEMUX_STREAM (walk->data);
-    GstBtDemuxBufferData *ipc_data;
 
-    /* send a cleanup buffer */
-    ipc_data = g_new0 (GstBtDemuxBufferData, 1);
-    g_async_queue_push (stream->ipc, ipc_data);
+    /* wake up the task */
+    gst_bt_piece_queue_close ((GstBtPieceQueue *) stream->ipc);
     gst_pad_stop_task (GST_PAD (stream));
+    stream->pad_task = FALSE;
   }
-  g_mutex_unlock (thiz->streams_lock);
+  g_slist_free_full (streams, gst_object_unref);
+
+  /* wait for the jobs on the shared pool */
+  gst_bt_demux_reap_jobs (thiz, TRUE);
+
+  /* finish the pending alerts before removing the torrent, the new ones are
+   * handled on the alert thread
+   */
+  GST_OBJECT_LOCK (thiz);
+  pools = thiz->alert_pools;
+  num_pools = thiz->num_alert_pools;
+  thiz->alert_pools = NULL;
+  thiz->num_alert_pools = 0;
+  GST_OBJECT_UNLOCK (thiz);
+  for (i = 0; i < num_pools; i++)
+    g_thread_pool_free (pools[i], FALSE, TRUE);
+  g_free (pools);
 
   s = (session *)thiz->session;
   torrents = s->get_torrents ();
@@ -1494,26 +3321,48 @@ gst_bt_demux_task_cleanup (GstBtDemux * thiz)
 static void
 gst_bt_demux_cleanup (GstBtDemux * thiz)
 {
-  /* remove every pad reference */
-  if (thiz->streams) {
-    /* finally remove the files if we need to */
-    if (thiz->temp_remove) {
-      GSList *walk;
-
-      for (walk = thiz->streams; walk; walk = g_slist_next (walk)) {
-        GstBtDemuxStream *stream = GST_BT_DEMUX_STREAM (walk->data);
-        gchar *to_remove;
-
-        to_remove = g_build_path (G_DIR_SEPARATOR_S, thiz->temp_location,
-            stream->path, NULL);
-        g_remove (to_remove);
-        g_free (to_remove);
-      }
+  /* finally remove the files if we need to */
+  if (thiz->temp_remove) {
+    gint i;
+
+    for (i = 0; i < thiz->num_files; i++) {
+      gchar *to_remove;
+
+      to_remove = g_build_path (G_DIR_SEPARATOR_S, thiz->temp_location,
+          thiz->files[i].path, NULL);
+      g_remove (to_remove);
+      g_free (to_remove);
     }
+  }
 
+  /* remove every pad reference */
+  if (thiz->streams) {
     g_slist_free_full (thiz->streams, gst_object_unref);
     thiz->streams = NULL;
   }
+
+  if (thiz->files) {
+    g_free (thiz->files);
+    thiz->files = NULL;
+    thiz->num_files = 0;
+  }
+
+  if (thiz->paths) {
+    g_string_chunk_free (thiz->paths);
+    thiz->paths = NULL;
+  }
+
+  GST_OBJECT_LOCK (thiz);
+  g_strfreev (thiz->web_seed_urls);
+  thiz->web_seed_urls = NULL;
+  GST_OBJECT_UNLOCK (thiz);
+
+  /* give the session its filter back */
+  gst_bt_demux_expire_blocked_peers (thiz, GST_CLOCK_TIME_NONE);
+
+  gst_bt_demux_stats_cleanup (thiz);
+  gst_bt_demux_budget_reset (thiz);
+  gst_bt_piece_cache_clear ((GstBtPieceCache *) thiz->piece_cache);
 }
 
 static GstStateChangeReturn
@@ -1580,8 +3429,43 @@ gst_bt_demux_dispose (GObject * object)
   }
 
   g_mutex_free (thiz->streams_lock);
+  g_mutex_free (thiz->jobs_lock);
+  g_cond_free (thiz->jobs_cond);
+
+  if (thiz->task_pool) {
+    gst_object_unref (thiz->task_pool);
+    thiz->task_pool = NULL;
+  }
+
+  if (thiz->session_settings) {
+    gst_structure_free (thiz->session_settings);
+    thiz->session_settings = NULL;
+  }
+
+  if (thiz->pending_reads) {
+    g_queue_free (thiz->pending_reads);
+    thiz->pending_reads = NULL;
+  }
+
+  if (thiz->blocked_peers) {
+    g_hash_table_destroy (thiz->blocked_peers);
+    thiz->blocked_peers = NULL;
+  }
+
+
+  if (thiz->piece_cache) {
+    gst_bt_piece_cache_free ((GstBtPieceCache *) thiz->piece_cache);
+    thiz->piece_cache = NULL;
+  }
+
+  if (thiz->ram_ring) {
+    gst_bt_ram_ring_unref ((GstBtRamRing *) thiz->ram_ring);
+    thiz->ram_ring = NULL;
+  }
 
   g_free (thiz->temp_location);
+  g_free (thiz->web_seeds);
+  g_free (thiz->peers);
 
   G_OBJECT_CLASS (gst_bt_demux_parent_class)->dispose (object);
 }
@@ -1602,7 +3486,15 @@ gst_bt_demux_set_property (GObject * object, guint prop_id,
       break;
 
     case PROP_TYPEFIND:
+      GST_OBJECT_LOCK (thiz);
       thiz->typefind = g_value_get_boolean (value);
+      GST_OBJECT_UNLOCK (thiz);
+      break;
+
+    case PROP_TYPEFIND_SIZE:
+      GST_OBJECT_LOCK (thiz);
+      thiz->typefind_size = g_value_get_uint (value);
+      GST_OBJECT_UNLOCK (thiz);
       break;
 
     case PROP_TEMP_REMOVE:
@@ -1614,6 +3506,132 @@ gst_bt_demux_set_property (GObject * object, guint prop_id,
       thiz->temp_location = g_strdup (g_value_get_string (value));
       break;
 
+    case PROP_STATS_INTERVAL:
+      GST_OBJECT_LOCK (thiz);
+      thiz->stats_interval = g_value_get_uint (value);
+      GST_OBJECT_UNLOCK (thiz);
+      break;
+
+    case PROP_MAX_QUEUED_BYTES:
+      GST_OBJECT_LOCK (thiz);
+      thiz->max_queued_bytes = g_value_get_uint64 (value);
+      GST_OBJECT_UNLOCK (thiz);
+      break;
+
+    case PROP_TASK_POOL:
+      GST_OBJECT_LOCK (thiz);
+      if (thiz->task_pool)
+        gst_object_unref (thiz->task_pool);
+      thiz->task_pool = (GstTaskPool *) g_value_dup_object (value);
+      GST_OBJECT_UNLOCK (thiz);
+      break;
+
+    case PROP_SESSION_PROFILE:
+      GST_OBJECT_LOCK (thiz);
+      thiz->session_profile = (GstBtSessionProfile) g_value_get_enum (value);
+      GST_OBJECT_UNLOCK (thiz);
+      break;
+
+    case PROP_STORAGE:
+      thiz->storage = (GstBtDemuxStorage) g_value_get_enum (value);
+      break;
+
+    case PROP_RING_SIZE:
+      thiz->ring_size = g_value_get_uint64 (value);
+      break;
+
+    case PROP_URING_QUEUE_DEPTH:
+      thiz->uring_queue_depth = g_value_get_uint (value);
+      break;
+
+    case PROP_URING_DIRECT:
+      thiz->uring_direct = g_value_get_boolean (value);
+      break;
+
+    case PROP_BUFFERING_UPLOAD_LIMIT:
+      GST_OBJECT_LOCK (thiz);
+      thiz->buffering_upload_limit = g_value_get_int (value);
+      GST_OBJECT_UNLOCK (thiz);
+      break;
+
+    case PROP_BUFFERING_UNCHOKE_SLOTS:
+      GST_OBJECT_LOCK (thiz);
+      thiz->buffering_unchoke_slots = g_value_get_int (value);
+      GST_OBJECT_UNLOCK (thiz);
+      break;
+
+    case PROP_STALL_TIMEOUT:
+      GST_OBJECT_LOCK (thiz);
+      thiz->stall_timeout = g_value_get_uint (value);
+      GST_OBJECT_UNLOCK (thiz);
+      break;
+
+    case PROP_ALERT_THREADS:
+      GST_OBJECT_LOCK (thiz);
+      thiz->alert_threads = g_value_get_uint (value);
+      GST_OBJECT_UNLOCK (thiz);
+      break;
+
+    case PROP_LOW_WATERMARK_BYTES:
+      GST_OBJECT_LOCK (thiz);
+      thiz->low_watermark_bytes = g_value_get_uint64 (value);
+      GST_OBJECT_UNLOCK (thiz);
+      break;
+
+    case PROP_HIGH_WATERMARK_BYTES:
+      GST_OBJECT_LOCK (thiz);
+      thiz->high_watermark_bytes = g_value_get_uint64 (value);
+      GST_OBJECT_UNLOCK (thiz);
+      break;
+
+    case PROP_LOW_WATERMARK_TIME:
+      GST_OBJECT_LOCK (thiz);
+      thiz->low_watermark_time = g_value_get_uint64 (value);
+      GST_OBJECT_UNLOCK (thiz);
+      break;
+
+    case PROP_HIGH_WATERMARK_TIME:
+      GST_OBJECT_LOCK (thiz);
+      thiz->high_watermark_time = g_value_get_uint64 (value);
+      GST_OBJECT_UNLOCK (thiz);
+      break;
+
+    case PROP_CACHE_SIZE:
+      GST_OBJECT_LOCK (thiz);
+      thiz->cache_size = g_value_get_uint64 (value);
+      GST_OBJECT_UNLOCK (thiz);
+      gst_bt_piece_cache_set_max_bytes (
+          (GstBtPieceCache *) thiz->piece_cache, g_value_get_uint64 (value));
+      break;
+
+    case PROP_WEB_SEEDS:
+      GST_OBJECT_LOCK (thiz);
+      g_free (thiz->web_seeds);
+      thiz->web_seeds = g_value_dup_string (value);
+      GST_OBJECT_UNLOCK (thiz);
+      break;
+
+    case PROP_WEB_SEEDS_BACKOFF_RATE:
+      GST_OBJECT_LOCK (thiz);
+      thiz->web_seeds_backoff_rate = g_value_get_uint (value);
+      GST_OBJECT_UNLOCK (thiz);
+      break;
+
+    case PROP_PEERS:
+      GST_OBJECT_LOCK (thiz);
+      g_free (thiz->peers);
+      thiz->peers = g_value_dup_string (value);
+      GST_OBJECT_UNLOCK (thiz);
+      break;
+
+    case PROP_SESSION_SETTINGS:
+      GST_OBJECT_LOCK (thiz);
+      if (thiz->session_settings)
+        gst_structure_free (thiz->session_settings);
+      thiz->session_settings = (GstStructure *) g_value_dup_boxed (value);
+      GST_OBJECT_UNLOCK (thiz);
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -1631,7 +3649,7 @@ gst_bt_demux_get_property (GObject * object, guint prop_id, GValue * value,
   thiz = GST_BT_DEMUX (object);
   switch (prop_id) {
     case PROP_N_STREAMS:
-      g_value_set_int (value, g_slist_length (thiz->streams));
+      g_value_set_int (value, thiz->num_files);
       break;
 
     case PROP_SELECTOR_POLICY:
@@ -1639,7 +3657,15 @@ gst_bt_demux_get_property (GObject * object, guint prop_id, GValue * value,
       break;
 
     case PROP_TYPEFIND:
+      GST_OBJECT_LOCK (thiz);
       g_value_set_boolean (value, thiz->typefind);
+      GST_OBJECT_UNLOCK (thiz);
+      break;
+
+    case PROP_TYPEFIND_SIZE:
+      GST_OBJECT_LOCK (thiz);
+      g_value_set_uint (value, thiz->typefind_size);
+      GST_OBJECT_UNLOCK (thiz);
       break;
 
     case PROP_TEMP_REMOVE:
@@ -1650,6 +3676,134 @@ gst_bt_demux_get_property (GObject * object, guint prop_id, GValue * value,
       g_value_set_string (value, thiz->temp_location);
       break;
 
+    case PROP_STATS:
+      g_value_take_boxed (value, gst_bt_demux_get_stats (thiz));
+      break;
+
+    case PROP_STATS_INTERVAL:
+      GST_OBJECT_LOCK (thiz);
+      g_value_set_uint (value, thiz->stats_interval);
+      GST_OBJECT_UNLOCK (thiz);
+      break;
+
+    case PROP_MAX_QUEUED_BYTES:
+      GST_OBJECT_LOCK (thiz);
+      g_value_set_uint64 (value, thiz->max_queued_bytes);
+      GST_OBJECT_UNLOCK (thiz);
+      break;
+
+    case PROP_CURRENT_LEVEL_BYTES:
+      GST_OBJECT_LOCK (thiz);
+      g_value_set_uint64 (value, thiz->queued_bytes);
+      GST_OBJECT_UNLOCK (thiz);
+      break;
+
+    case PROP_TASK_POOL:
+      GST_OBJECT_LOCK (thiz);
+      g_value_set_object (value, thiz->task_pool);
+      GST_OBJECT_UNLOCK (thiz);
+      break;
+
+    case PROP_SESSION_PROFILE:
+      GST_OBJECT_LOCK (thiz);
+      g_value_set_enum (value, thiz->session_profile);
+      GST_OBJECT_UNLOCK (thiz);
+      break;
+
+    case PROP_STORAGE:
+      g_value_set_enum (value, thiz->storage);
+      break;
+
+    case PROP_RING_SIZE:
+      g_value_set_uint64 (value, thiz->ring_size);
+      break;
+
+    case PROP_URING_QUEUE_DEPTH:
+      g_value_set_uint (value, thiz->uring_queue_depth);
+      break;
+
+    case PROP_URING_DIRECT:
+      g_value_set_boolean (value, thiz->uring_direct);
+      break;
+
+    case PROP_BUFFERING_UPLOAD_LIMIT:
+      GST_OBJECT_LOCK (thiz);
+      g_value_set_int (value, thiz->buffering_upload_limit);
+      GST_OBJECT_UNLOCK (thiz);
+      break;
+
+    case PROP_BUFFERING_UNCHOKE_SLOTS:
+      GST_OBJECT_LOCK (thiz);
+      g_value_set_int (value, thiz->buffering_unchoke_slots);
+      GST_OBJECT_UNLOCK (thiz);
+      break;
+
+    case PROP_STALL_TIMEOUT:
+      GST_OBJECT_LOCK (thiz);
+      g_value_set_uint (value, thiz->stall_timeout);
+      GST_OBJECT_UNLOCK (thiz);
+      break;
+
+    case PROP_ALERT_THREADS:
+      GST_OBJECT_LOCK (thiz);
+      g_value_set_uint (value, thiz->alert_threads);
+      GST_OBJECT_UNLOCK (thiz);
+      break;
+
+    case PROP_LOW_WATERMARK_BYTES:
+      GST_OBJECT_LOCK (thiz);
+      g_value_set_uint64 (value, thiz->low_watermark_bytes);
+      GST_OBJECT_UNLOCK (thiz);
+      break;
+
+    case PROP_HIGH_WATERMARK_BYTES:
+      GST_OBJECT_LOCK (thiz);
+      g_value_set_uint64 (value, thiz->high_watermark_bytes);
+      GST_OBJECT_UNLOCK (thiz);
+      break;
+
+    case PROP_LOW_WATERMARK_TIME:
+      GST_OBJECT_LOCK (thiz);
+      g_value_set_uint64 (value, thiz->low_watermark_time);
+      GST_OBJECT_UNLOCK (thiz);
+      break;
+
+    case PROP_HIGH_WATERMARK_TIME:
+      GST_OBJECT_LOCK (thiz);
+      g_value_set_uint64 (value, thiz->high_watermark_time);
+      GST_OBJECT_UNLOCK (thiz);
+      break;
+
+    case PROP_CACHE_SIZE:
+      GST_OBJECT_LOCK (thiz);
+      g_value_set_uint64 (value, thiz->cache_size);
+      GST_OBJECT_UNLOCK (thiz);
+      break;
+
+    case PROP_WEB_SEEDS:
+      GST_OBJECT_LOCK (thiz);
+      g_value_set_string (value, thiz->web_seeds);
+      GST_OBJECT_UNLOCK (thiz);
+      break;
+
+    case PROP_WEB_SEEDS_BACKOFF_RATE:
+      GST_OBJECT_LOCK (thiz);
+      g_value_set_uint (value, thiz->web_seeds_backoff_rate);
+      GST_OBJECT_UNLOCK (thiz);
+      break;
+
+    case PROP_PEERS:
+      GST_OBJECT_LOCK (thiz);
+      g_value_set_string (value, thiz->peers);
+      GST_OBJECT_UNLOCK (thiz);
+      break;
+
+    case PROP_SESSION_SETTINGS:
+      GST_OBJECT_LOCK (thiz);
+      g_value_set_boxed (value, thiz->session_settings);
+      GST_OBJECT_UNLOCK (thiz);
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -1684,6 +3838,11 @@ gst_bt_demux_class_init (GstBtDemuxClass * klass)
       g_param_spec_boolean ("typefind", "Typefind",
           "Run typefind before negotiating", DEFAULT_TYPEFIND,
           (GParamFlags)(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+  g_object_class_install_property (gobject_class, PROP_TYPEFIND_SIZE,
+      g_param_spec_uint ("typefind-size", "Typefind size",
+          "Bytes at the beginning of the stream used to typefind "
+          "(0 = the whole first piece)", 0, G_MAXUINT, DEFAULT_TYPEFIND_SIZE,
+          (GParamFlags)(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
   g_object_class_install_property (gobject_class, PROP_TEMP_LOCATION,
       g_param_spec_string ("temp-location", "Temporary File Location",
           "Location to store temporary files in", NULL,
@@ -1692,6 +3851,133 @@ gst_bt_demux_class_init (GstBtDemuxClass * klass)
       g_param_spec_boolean ("temp-remove", "Remove temporary files",
           "Remove temporary files", DEFAULT_TEMP_REMOVE,
           (GParamFlags)(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+  g_object_class_install_property (gobject_class, PROP_STATS,
+      g_param_spec_boxed ("stats", "Statistics",
+          "Transfer rates, peers, per stream state and piece latencies",
+          GST_TYPE_STRUCTURE,
+          (GParamFlags)(G_PARAM_READABLE | G_PARAM_STATIC_STRINGS)));
+  g_object_class_install_property (gobject_class, PROP_STATS_INTERVAL,
+      g_param_spec_uint ("stats-interval", "Statistics interval",
+          "Interval in ms to post the statistics as an element message "
+          "(0 = disabled)", 0, G_MAXUINT, DEFAULT_STATS_INTERVAL,
+          (GParamFlags)(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+  g_object_class_install_property (gobject_class, PROP_MAX_QUEUED_BYTES,
+      g_param_spec_uint64 ("max-queued-bytes", "Max. queued bytes",
+          "Max. amount of piece data being read or queued for pushing, "
+          "bounded to the stream queues (0 = as much as they hold)", 0,
+          G_MAXUINT64, DEFAULT_MAX_QUEUED_BYTES,
+          (GParamFlags)(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+  g_object_class_install_property (gobject_class, PROP_CURRENT_LEVEL_BYTES,
+      g_param_spec_uint64 ("current-level-bytes", "Current level (bytes)",
+          "Current amount of piece data being read or queued for pushing",
+          0, G_MAXUINT64, 0,
+          (GParamFlags)(G_PARAM_READABLE | G_PARAM_STATIC_STRINGS)));
+  g_object_class_install_property (gobject_class, PROP_TASK_POOL,
+      g_param_spec_object ("task-pool", "Task pool",
+          "Prepared pool shared by every stream to push the pieces, instead "
+          "of a thread per pad, the pads keep their own thread while "
+          "prerolling (must be set in the NULL or READY state)",
+          GST_TYPE_TASK_POOL,
+          (GParamFlags)(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+  g_object_class_install_property (gobject_class, PROP_SESSION_PROFILE,
+      g_param_spec_enum ("session-profile", "Session profile",
+          "Set of libtorrent settings to start the session with",
+          GST_TYPE_BT_SESSION_PROFILE, DEFAULT_SESSION_PROFILE,
+          (GParamFlags)(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+  g_object_class_install_property (gobject_class, PROP_SESSION_SETTINGS,
+      g_param_spec_boxed ("session-settings", "Session settings",
+          "libtorrent settings applied on top of the session profile, "
+          "i.e \"settings, cache-size=(int)1024\"", GST_TYPE_STRUCTURE,
+          (GParamFlags)(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+  g_object_class_install_property (gobject_class, PROP_STORAGE,
+      g_param_spec_enum ("storage", "Storage",
+          "Where to keep the downloaded pieces",
+          gst_bt_demux_storage_get_type (), DEFAULT_STORAGE,
+          (GParamFlags)(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+  g_object_class_install_property (gobject_class, PROP_RING_SIZE,
+      g_param_spec_uint64 ("ring-size", "Ring size",
+          "Bytes of pieces kept around the playhead with the RAM storage, "
+          "the farthest pieces are evicted and downloaded again if needed",
+          0, G_MAXUINT64, DEFAULT_RING_SIZE,
+          (GParamFlags)(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+  g_object_class_install_property (gobject_class, PROP_URING_QUEUE_DEPTH,
+      g_param_spec_uint ("uring-queue-depth", "io_uring queue depth",
+          "Requests in flight with the io_uring storage",
+          1, 4096, DEFAULT_URING_QUEUE_DEPTH,
+          (GParamFlags)(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+  g_object_class_install_property (gobject_class, PROP_URING_DIRECT,
+      g_param_spec_boolean ("uring-direct", "io_uring direct I/O",
+          "Bypass the page cache for the aligned accesses of large pieces "
+          "with the io_uring storage", DEFAULT_URING_DIRECT,
+          (GParamFlags)(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+  g_object_class_install_property (gobject_class, PROP_BUFFERING_UPLOAD_LIMIT,
+      g_param_spec_int ("buffering-upload-limit", "Buffering upload limit",
+          "Upload rate in bytes/s while buffering, the uploads help getting "
+          "pieces from the peers (-1 = do not throttle)",
+          -1, G_MAXINT, DEFAULT_BUFFERING_UPLOAD_LIMIT,
+          (GParamFlags)(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+  g_object_class_install_property (gobject_class, PROP_BUFFERING_UNCHOKE_SLOTS,
+      g_param_spec_int ("buffering-unchoke-slots", "Buffering unchoke slots",
+          "Peers we upload to while buffering (-1 = do not throttle)",
+          -1, G_MAXINT, DEFAULT_BUFFERING_UNCHOKE_SLOTS,
+          (GParamFlags)(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+  g_object_class_install_property (gobject_class, PROP_STALL_TIMEOUT,
+      g_param_spec_uint ("stall-timeout", "Stall timeout",
+          "Milliseconds the playhead piece can take to download before its "
+          "request is escalated (0 = disabled)",
+          0, G_MAXUINT, DEFAULT_STALL_TIMEOUT,
+          (GParamFlags)(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+  g_object_class_install_property (gobject_class, PROP_ALERT_THREADS,
+      g_param_spec_uint ("alert-threads", "Alert threads",
+          "Threads handling the piece completion alerts apart from the "
+          "alert thread, the alerts of a file are always handled by the "
+          "same thread (0 = handle every alert on the alert thread)",
+          0, 64, DEFAULT_ALERT_THREADS,
+          (GParamFlags)(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+  g_object_class_install_property (gobject_class, PROP_LOW_WATERMARK_BYTES,
+      g_param_spec_uint64 ("low-watermark-bytes", "Low watermark bytes",
+          "Start buffering when less bytes are ready to be pushed "
+          "(0 = one piece)", 0, G_MAXUINT64, DEFAULT_LOW_WATERMARK_BYTES,
+          (GParamFlags)(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+  g_object_class_install_property (gobject_class, PROP_HIGH_WATERMARK_BYTES,
+      g_param_spec_uint64 ("high-watermark-bytes", "High watermark bytes",
+          "Stop buffering when these bytes are ready to be pushed "
+          "(0 = buffer-pieces)", 0, G_MAXUINT64, DEFAULT_HIGH_WATERMARK_BYTES,
+          (GParamFlags)(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+  g_object_class_install_property (gobject_class, PROP_LOW_WATERMARK_TIME,
+      g_param_spec_uint64 ("low-watermark-time", "Low watermark time",
+          "Start buffering when less time is ready to be played, estimated "
+          "with the stream throughput (0 = disabled)", 0, G_MAXUINT64,
+          DEFAULT_LOW_WATERMARK_TIME,
+          (GParamFlags)(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+  g_object_class_install_property (gobject_class, PROP_HIGH_WATERMARK_TIME,
+      g_param_spec_uint64 ("high-watermark-time", "High watermark time",
+          "Stop buffering when this time is ready to be played, estimated "
+          "with the stream throughput (0 = disabled)", 0, G_MAXUINT64,
+          DEFAULT_HIGH_WATERMARK_TIME,
+          (GParamFlags)(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+  g_object_class_install_property (gobject_class, PROP_CACHE_SIZE,
+      g_param_spec_uint64 ("cache-size", "Cache size",
+          "Bytes of the last pieces read kept to serve the seeks without "
+          "reading them again (0 = disabled)", 0, G_MAXUINT64,
+          DEFAULT_CACHE_SIZE,
+          (GParamFlags)(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+  g_object_class_install_property (gobject_class, PROP_WEB_SEEDS,
+      g_param_spec_string ("web-seeds", "Web seeds",
+          "Comma separated list of HTTP mirrors of the torrent, used along "
+          "with the ones of the metainfo url-list", DEFAULT_WEB_SEEDS,
+          (GParamFlags)(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+  g_object_class_install_property (gobject_class, PROP_WEB_SEEDS_BACKOFF_RATE,
+      g_param_spec_uint ("web-seeds-backoff-rate", "Web seeds backoff rate",
+          "Bytes per second the swarm has to deliver to stop using the web "
+          "seeds (0 = always use them)", 0, G_MAXUINT,
+          DEFAULT_WEB_SEEDS_BACKOFF_RATE,
+          (GParamFlags)(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+  g_object_class_install_property (gobject_class, PROP_PEERS,
+      g_param_spec_string ("peers", "Peers",
+          "Comma separated list of address:port peers to connect to as soon "
+          "as the torrent is added and to keep connected", DEFAULT_PEERS,
+          (GParamFlags)(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
 
   gst_bt_demux_signals[SIGNAL_STREAMS_CHANGED] =
       g_signal_new ("streams-changed", G_TYPE_FROM_CLASS (klass),
@@ -1704,6 +3990,25 @@ gst_bt_demux_class_init (GstBtDemuxClass * klass)
       G_STRUCT_OFFSET (GstBtDemuxClass, get_stream_tags), NULL, NULL,
       gst_bt_demux_cclosure_marshal_BOXED__INT, GST_TYPE_TAG_LIST, 1,
       G_TYPE_INT);
+  gst_bt_demux_signals[SIGNAL_ADD_PEER] =
+      g_signal_new ("add-peer", G_TYPE_FROM_CLASS (klass),
+      (GSignalFlags) (G_SIGNAL_RUN_LAST | G_SIGNAL_ACTION),
+      G_STRUCT_OFFSET (GstBtDemuxClass, add_peer), NULL, NULL,
+      g_cclosure_marshal_VOID__STRING, G_TYPE_NONE, 1, G_TYPE_STRING);
+  gst_bt_demux_signals[SIGNAL_PREFETCH] =
+      g_signal_new ("prefetch", G_TYPE_FROM_CLASS (klass),
+      (GSignalFlags) (G_SIGNAL_RUN_LAST | G_SIGNAL_ACTION),
+      G_STRUCT_OFFSET (GstBtDemuxClass, prefetch), NULL, NULL,
+      gst_bt_demux_cclosure_marshal_BOOLEAN__INT_INT64_INT64_INT,
+      G_TYPE_BOOLEAN, 4, G_TYPE_INT, G_TYPE_INT64, G_TYPE_INT64, G_TYPE_INT);
+  gst_bt_demux_signals[SIGNAL_OVERRUN] =
+      g_signal_new ("overrun", G_TYPE_FROM_CLASS (klass),
+      G_SIGNAL_RUN_FIRST, G_STRUCT_OFFSET (GstBtDemuxClass, overrun),
+      NULL, NULL, g_cclosure_marshal_VOID__VOID, G_TYPE_NONE, 0);
+  gst_bt_demux_signals[SIGNAL_UNDERRUN] =
+      g_signal_new ("underrun", G_TYPE_FROM_CLASS (klass),
+      G_SIGNAL_RUN_FIRST, G_STRUCT_OFFSET (GstBtDemuxClass, underrun),
+      NULL, NULL, g_cclosure_marshal_VOID__VOID, G_TYPE_NONE, 0);
 
   /* initialize the element class */
   gst_element_class_add_pad_template (element_class,
@@ -1721,6 +4026,8 @@ gst_bt_demux_class_init (GstBtDemuxClass * klass)
 
   /* initialize the demuxer class */
   klass->get_stream_tags = gst_bt_demux_get_stream_tags;
+  klass->add_peer = gst_bt_demux_add_peer;
+  klass->prefetch = gst_bt_demux_prefetch;
 }
  
 static void
@@ -1745,6 +4052,12 @@ gst_bt_demux_init (GstBtDemux * thiz)
   thiz->adapter = gst_adapter_new ();
 
   thiz->streams_lock = g_mutex_new ();
+  thiz->pending_reads = g_queue_new ();
+  thiz->blocked_peers = g_hash_table_new_full (g_str_hash, g_str_equal,
+      g_free, g_free);
+  thiz->piece_cache = gst_bt_piece_cache_new (DEFAULT_CACHE_SIZE);
+  thiz->jobs_lock = g_mutex_new ();
+  thiz->jobs_cond = g_cond_new ();
 
   /* create a new session */
   s = new session ();
@@ -1763,7 +4076,30 @@ gst_bt_demux_init (GstBtDemux * thiz)
   thiz->policy = GST_BT_DEMUX_SELECTOR_POLICY_LARGER;
   thiz->buffer_pieces = DEFAULT_BUFFER_PIECES;
   thiz->typefind = DEFAULT_TYPEFIND;
+  thiz->typefind_size = DEFAULT_TYPEFIND_SIZE;
   thiz->temp_location = g_build_path (G_DIR_SEPARATOR_S, g_get_tmp_dir (), DEFAULT_DIR,
       NULL);
   thiz->temp_remove = DEFAULT_TEMP_REMOVE;
+  thiz->stats_interval = DEFAULT_STATS_INTERVAL;
+  thiz->max_queued_bytes = DEFAULT_MAX_QUEUED_BYTES;
+  thiz->queue_size = PIECE_QUEUE_MIN_SIZE;
+  thiz->session_profile = DEFAULT_SESSION_PROFILE;
+  thiz->storage = DEFAULT_STORAGE;
+  thiz->ring_size = DEFAULT_RING_SIZE;
+  thiz->uring_queue_depth = DEFAULT_URING_QUEUE_DEPTH;
+  thiz->uring_direct = DEFAULT_URING_DIRECT;
+  thiz->buffering_upload_limit = DEFAULT_BUFFERING_UPLOAD_LIMIT;
+  thiz->buffering_unchoke_slots = DEFAULT_BUFFERING_UNCHOKE_SLOTS;
+  thiz->upload_limit_applied = -1;
+  thiz->unchoke_slots_applied = -1;
+  thiz->stall_timeout = DEFAULT_STALL_TIMEOUT;
+  thiz->alert_threads = DEFAULT_ALERT_THREADS;
+  thiz->low_watermark_bytes = DEFAULT_LOW_WATERMARK_BYTES;
+  thiz->high_watermark_bytes = DEFAULT_HIGH_WATERMARK_BYTES;
+  thiz->low_watermark_time = DEFAULT_LOW_WATERMARK_TIME;
+  thiz->high_watermark_time = DEFAULT_HIGH_WATERMARK_TIME;
+  thiz->cache_size = DEFAULT_CACHE_SIZE;
+  thiz->web_seeds = DEFAULT_WEB_SEEDS;
+  thiz->web_seeds_backoff_rate = DEFAULT_WEB_SEEDS_BACKOFF_RATE;
+  thiz->peers = DEFAULT_PEERS;
 }
@@ -25,6 +25,8 @@
 
 #include <gst/gst.h>
 #include <gst/base/gstadapter.h>
+#include "gst_bt_session.hpp"
+#include "gst_bt_scheduler.hpp"
 
 G_BEGIN_DECLS
 
@@ -58,31 +60,64 @@ typedef enum _GstBtDemuxSelectorPolicy {
   GST_BT_DEMUX_SELECTOR_POLICY_LARGER,
 } GstBtDemuxSelectorPolicy;
 
+/* Where the downloaded pieces are kept */
+typedef enum _GstBtDemuxStorage {
+  GST_BT_DEMUX_STORAGE_DISK,
+  GST_BT_DEMUX_STORAGE_RAM,
+  GST_BT_DEMUX_STORAGE_IO_URING,
+} GstBtDemuxStorage;
+
+/* Latency histogram, bucket 0 counts the latencies below 1ms, bucket n the
+ * ones below 2^n ms and the last one everything above
+ */
+#define GST_BT_DEMUX_HISTOGRAM_SIZE 12
+
+typedef struct _GstBtDemuxHistogram
+{
+  guint64 count[GST_BT_DEMUX_HISTOGRAM_SIZE];
+} GstBtDemuxHistogram;
+
 typedef struct _GstBtDemuxStream
 {
   GstPad pad;
-  gint idx;
   gchar *path;
+  /* the pieces to download and push, driven by the scheduler */
+  GstBtSchedulerStream sched;
 
-  gint current_piece;
   gint start_offset;
-  gint start_piece;
   gint end_offset;
-  gint end_piece;
   gint last_piece;
 
   gint64 start_byte;
   gint64 end_byte;
-  gboolean pending_segment;
+  gboolean segment_seek;
+  /* the file offset after the last byte pushed, or of the first one when
+   * going backwards, -1 if none
+   */
+  gint64 last_byte;
 
-  gboolean requested;
+  /* the pad has been added to the element */
+  gboolean exposed;
   gboolean finished;
-  gboolean buffering;
-  gint buffering_level;
-  gint buffering_count;
+
+  /* the playhead piece being watched and how far we escalated it */
+  gint stall_piece;
+  gint stall_level;
 
   GStaticRecMutex *lock;
-  GAsyncQueue *ipc;
+  /* the pieces read waiting to be pushed, a GstBtPieceQueue */
+  gpointer ipc;
+  /* a job on the shared task pool is pushing the queued pieces */
+  gboolean scheduled;
+  /* the pad task is pushing them until the element is playing */
+  gboolean pad_task;
+
+  /* statistics */
+  guint64 pushed;
+  guint64 dropped;
+  guint64 bytes;
+  GstClockTime activated;
+  GstClockTime first_buffer;
 } GstBtDemuxStream;
 
 typedef struct _GstBtDemuxStreamClass {
@@ -91,6 +126,15 @@ typedef struct _GstBtDemuxStreamClass {
 
 GType gst_bt_demux_stream_get_type (void);
 
+/* the metadata of a file, its stream is only created once selected */
+typedef struct _GstBtDemuxFile
+{
+  gint64 offset;
+  gint64 size;
+  const gchar *path;
+  GstBtDemuxStream *stream;
+} GstBtDemuxFile;
+
 typedef struct _GstBtDemux
 {
   GstElement parent;
@@ -99,16 +143,99 @@ typedef struct _GstBtDemux
   GstBtDemuxSelectorPolicy policy;
   GMutex *streams_lock;
   GSList *streams;
+  GstBtDemuxFile *files;
+  gint num_files;
+  GStringChunk *paths;
   gchar *requested_streams;
   gboolean typefind;
+  guint typefind_size;
   gchar *temp_location;
   gboolean temp_remove;
+  GstBtDemuxStorage storage;
+  guint64 ring_size;
+  /* the pieces in memory of the ram storage, a GstBtRamRing */
+  gpointer ram_ring;
+  guint uring_queue_depth;
+  gboolean uring_direct;
 
   gboolean finished;
   gboolean buffering;
   gint buffer_pieces;
 
+  /* buffering watermarks, protected by the object lock */
+  guint64 low_watermark_bytes;
+  guint64 high_watermark_bytes;
+  GstClockTime low_watermark_time;
+  GstClockTime high_watermark_time;
+
+  /* upload policy while buffering, protected by the object lock */
+  gint buffering_upload_limit;
+  gint buffering_unchoke_slots;
+  /* the values set on the torrent, -1 if none */
+  gint upload_limit_applied;
+  gint unchoke_slots_applied;
+
+  /* stall recovery, protected by the object lock */
+  guint stall_timeout;
+  /* the peers blocked until their expiration time and the session filter
+   * before blocking them, a libtorrent::ip_filter
+   */
+  GHashTable *blocked_peers;
+  gpointer ip_filter;
+
+  /* peers always connected, protected by the object lock */
+  gchar *peers;
+
+  /* http mirrors, protected by the object lock */
+  gchar *web_seeds;
+  guint web_seeds_backoff_rate;
+  gchar **web_seed_urls;
+  gboolean web_seeds_active;
+
+  /* alert workers, a single thread pool per worker, protected by the
+   * object lock
+   */
+  guint alert_threads;
+  GThreadPool **alert_pools;
+  guint num_alert_pools;
+
   gpointer session;
+  GstBtSessionProfile session_profile;
+  GstStructure *session_settings;
+  gint piece_length;
+
+  /* memory budget, protected by the object lock */
+  guint64 max_queued_bytes;
+  guint64 queued_bytes;
+  GQueue *pending_reads;
+  gboolean overrun;
+  /* the slots of the piece queue of every stream, fixed once the torrent is
+   * added, the budget never goes beyond them
+   */
+  guint queue_size;
+
+  /* the last pieces read */
+  guint64 cache_size;
+  gpointer piece_cache;
+
+  /* statistics, protected by the object lock */
+  guint stats_interval;
+  GstClockTime last_stats;
+  GstClockTime last_update;
+  gint download_rate;
+  gint upload_rate;
+  gint num_peers;
+  gint num_pieces;
+  GstClockTime *piece_times;
+  GstBtDemuxHistogram download_latency;
+  GstBtDemuxHistogram read_latency;
+  GstBtDemuxHistogram push_latency;
+
+  /* shared pool to push on every stream instead of a task per pad */
+  GstTaskPool *task_pool;
+  GMutex *jobs_lock;
+  GCond *jobs_cond;
+  GList *jobs;
 
   GstTask *task;
 #if HAVE_GST_1
@@ -125,6 +252,15 @@ typedef struct _GstBtDemuxClass
   void (*streams_changed) (GstBtDemux * demux);
   /* get stream tags for a stream */
   GstTagList *(*get_stream_tags) (GstBtDemux * demux, gint stream);
+  /* connect to a peer and keep it connected */
+  void (*add_peer) (GstBtDemux * demux, const gchar * peer);
+  /* download a range of a file in the background */
+  gboolean (*prefetch) (GstBtDemux * demux, gint stream, gint64 start,
+      gint64 length, gint priority);
+  /* the memory budget has been reached and reads are being delayed */
+  void (*overrun) (GstBtDemux * demux);
+  /* the delayed reads have been issued and the budget allows reading again */
+  void (*underrun) (GstBtDemux * demux);
 } GstBtDemuxClass;
 
 GType gst_bt_demux_get_type (void);
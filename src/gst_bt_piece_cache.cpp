@@ -0,0 +1,235 @@
+/* Gst-Bt - BitTorrent related GStreamer elements
+ * Copyright (C) 2015 Jorge Luis Zapata
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A LRU of the pieces read from libtorrent. Demuxers downstream usually probe
+ * the header, the index and the start again, so after a seek the pieces
+ * pushed a moment ago can be taken from here instead of reading them again
+ * from the storage. Every stream can pin a range of pieces, like the range of
+ * a looping segment, so they are the last ones to be evicted
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "gst_bt_piece_cache.hpp"
+
+typedef struct _GstBtPieceCachePin
+{
+  gint start;
+  gint end;
+} GstBtPieceCachePin;
+
+typedef struct _GstBtPieceCacheEntry
+{
+  gint piece;
+  boost::shared_array <char> buffer;
+  gint size;
+} GstBtPieceCacheEntry;
+
+struct _GstBtPieceCache
+{
+  GMutex *lock;
+  /* most recently used first */
+  GQueue *entries;
+  /* piece to its link on the queue */
+  GHashTable *index;
+  guint64 bytes;
+  guint64 max_bytes;
+  /* the pinned range of every stream index */
+  GHashTable *pins;
+};
+
+static void
+gst_bt_piece_cache_remove_link (GstBtPieceCache * thiz, GList * link)
+{
+  GstBtPieceCacheEntry *entry = (GstBtPieceCacheEntry *) link->data;
+
+  g_hash_table_remove (thiz->index, GINT_TO_POINTER (entry->piece));
+  g_queue_delete_link (thiz->entries, link);
+  thiz->bytes -= entry->size;
+  delete entry;
+}
+
+static gboolean
+gst_bt_piece_cache_is_pinned (GstBtPieceCache * thiz, gint piece)
+{
+  GHashTableIter iter;
+  gpointer value;
+
+  g_hash_table_iter_init (&iter, thiz->pins);
+  while (g_hash_table_iter_next (&iter, NULL, &value)) {
+    GstBtPieceCachePin *pin = (GstBtPieceCachePin *) value;
+
+    if (piece >= pin->start && piece <= pin->end)
+      return TRUE;
+  }
+
+  return FALSE;
+}
+
+static void
+gst_bt_piece_cache_trim (GstBtPieceCache * thiz)
+{
+  GList *walk;
+
+  /* evict the least recently used pieces out of the pinned range first */
+  walk = thiz->entries->tail;
+  while (thiz->bytes > thiz->max_bytes && walk) {
+    GstBtPieceCacheEntry *entry = (GstBtPieceCacheEntry *) walk->data;
+    GList *prev = walk->prev;
+
+    if (!gst_bt_piece_cache_is_pinned (thiz, entry->piece))
+      gst_bt_piece_cache_remove_link (thiz, walk);
+    walk = prev;
+  }
+
+  /* the pinned range does not fit */
+  while (thiz->bytes > thiz->max_bytes && thiz->entries->tail)
+    gst_bt_piece_cache_remove_link (thiz, thiz->entries->tail);
+}
+
+GstBtPieceCache *
+gst_bt_piece_cache_new (guint64 max_bytes)
+{
+  GstBtPieceCache *thiz;
+
+  thiz = g_new0 (GstBtPieceCache, 1);
+  thiz->lock = g_mutex_new ();
+  thiz->entries = g_queue_new ();
+  thiz->index = g_hash_table_new (NULL, NULL);
+  thiz->max_bytes = max_bytes;
+  thiz->pins = g_hash_table_new_full (NULL, NULL, NULL, g_free);
+
+  return thiz;
+}
+
+void
+gst_bt_piece_cache_free (GstBtPieceCache * thiz)
+{
+  gst_bt_piece_cache_clear (thiz);
+  g_hash_table_destroy (thiz->index);
+  g_hash_table_destroy (thiz->pins);
+  g_queue_free (thiz->entries);
+  g_mutex_free (thiz->lock);
+  g_free (thiz);
+}
+
+void
+gst_bt_piece_cache_set_max_bytes (GstBtPieceCache * thiz, guint64 max_bytes)
+{
+  g_mutex_lock (thiz->lock);
+  thiz->max_bytes = max_bytes;
+  gst_bt_piece_cache_trim (thiz);
+  g_mutex_unlock (thiz->lock);
+}
+
+void
+gst_bt_piece_cache_add (GstBtPieceCache * thiz, gint piece,
+    boost::shared_array <char> buffer, gint size)
+{
+  GstBtPieceCacheEntry *entry;
+  GList *link;
+
+  g_mutex_lock (thiz->lock);
+  if ((guint64) size > thiz->max_bytes) {
+    g_mutex_unlock (thiz->lock);
+    return;
+  }
+
+  /* replace the old data if any */
+  link = (GList *) g_hash_table_lookup (thiz->index, GINT_TO_POINTER (piece));
+  if (link)
+    gst_bt_piece_cache_remove_link (thiz, link);
+
+  entry = new GstBtPieceCacheEntry ();
+  entry->piece = piece;
+  entry->buffer = buffer;
+  entry->size = size;
+
+  g_queue_push_head (thiz->entries, entry);
+  g_hash_table_insert (thiz->index, GINT_TO_POINTER (piece),
+      thiz->entries->head);
+  thiz->bytes += size;
+  gst_bt_piece_cache_trim (thiz);
+  g_mutex_unlock (thiz->lock);
+}
+
+gboolean
+gst_bt_piece_cache_lookup (GstBtPieceCache * thiz, gint piece,
+    boost::shared_array <char> & buffer, gint * size)
+{
+  GstBtPieceCacheEntry *entry;
+  GList *link;
+
+  g_mutex_lock (thiz->lock);
+  link = (GList *) g_hash_table_lookup (thiz->index, GINT_TO_POINTER (piece));
+  if (!link) {
+    g_mutex_unlock (thiz->lock);
+    return FALSE;
+  }
+
+  /* move it to the front */
+  entry = (GstBtPieceCacheEntry *) link->data;
+  g_queue_unlink (thiz->entries, link);
+  g_queue_push_head_link (thiz->entries, link);
+
+  buffer = entry->buffer;
+  *size = entry->size;
+  g_mutex_unlock (thiz->lock);
+
+  return TRUE;
+}
+
+/* Drop every piece and every pinned range */
+void
+gst_bt_piece_cache_clear (GstBtPieceCache * thiz)
+{
+  g_mutex_lock (thiz->lock);
+  while (thiz->entries->head)
+    gst_bt_piece_cache_remove_link (thiz, thiz->entries->head);
+  g_hash_table_remove_all (thiz->pins);
+  g_mutex_unlock (thiz->lock);
+}
+
+/* Keep the pieces from start to end over the rest, replacing the range
+ * pinned by the stream idx if any
+ */
+void
+gst_bt_piece_cache_pin (GstBtPieceCache * thiz, gint idx, gint start,
+    gint end)
+{
+  GstBtPieceCachePin *pin;
+
+  pin = g_new (GstBtPieceCachePin, 1);
+  pin->start = start;
+  pin->end = end;
+
+  g_mutex_lock (thiz->lock);
+  g_hash_table_replace (thiz->pins, GINT_TO_POINTER (idx), pin);
+  g_mutex_unlock (thiz->lock);
+}
+
+void
+gst_bt_piece_cache_unpin (GstBtPieceCache * thiz, gint idx)
+{
+  g_mutex_lock (thiz->lock);
+  g_hash_table_remove (thiz->pins, GINT_TO_POINTER (idx));
+  g_mutex_unlock (thiz->lock);
+}
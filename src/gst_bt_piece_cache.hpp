@@ -0,0 +1,47 @@
+/* Gst-Bt - BitTorrent related GStreamer elements
+ * Copyright (C) 2015 Jorge Luis Zapata
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GST_BT_PIECE_CACHE_H
+#define GST_BT_PIECE_CACHE_H
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <gst/gst.h>
+#include <boost/shared_array.hpp>
+
+/* The last pieces read, bounded by their size in bytes. The cache only keeps
+ * references to the libtorrent buffers so a hit does not copy anything
+ */
+typedef struct _GstBtPieceCache GstBtPieceCache;
+
+GstBtPieceCache * gst_bt_piece_cache_new (guint64 max_bytes);
+void gst_bt_piece_cache_free (GstBtPieceCache * thiz);
+void gst_bt_piece_cache_set_max_bytes (GstBtPieceCache * thiz,
+    guint64 max_bytes);
+void gst_bt_piece_cache_add (GstBtPieceCache * thiz, gint piece,
+    boost::shared_array <char> buffer, gint size);
+gboolean gst_bt_piece_cache_lookup (GstBtPieceCache * thiz, gint piece,
+    boost::shared_array <char> & buffer, gint * size);
+void gst_bt_piece_cache_clear (GstBtPieceCache * thiz);
+void gst_bt_piece_cache_pin (GstBtPieceCache * thiz, gint idx, gint start,
+    gint end);
+void gst_bt_piece_cache_unpin (GstBtPieceCache * thiz, gint idx);
+
+#endif
@@ -0,0 +1,210 @@
+/* Gst-Bt - BitTorrent related GStreamer elements
+ * Copyright (C) 2015 Jorge Luis Zapata
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The queue between the alert thread and the thread pushing a stream. The
+ * producer fills the slots of a preallocated ring and publishes them moving
+ * the tail, the consumer empties them and moves the head, so queueing a
+ * piece neither locks nor allocates. The lock is only taken to sleep when
+ * the queue is empty and to wake up the sleeping consumer.
+ * The ring never grows, the caller sizes it for every piece it can have in
+ * flight and a push on a full ring fails instead of blocking the producer.
+ * Several threads can produce as long as they are serialized by the caller
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "gst_bt_piece_queue.hpp"
+
+struct _GstBtPieceQueue
+{
+  GstBtPieceQueueItem *items;
+  guint mask;
+  /* only moved by the consumer */
+  volatile gint head;
+  /* only moved by the producer */
+  volatile gint tail;
+  volatile gint waiting;
+  volatile gint closed;
+  GMutex *lock;
+  GCond *cond;
+};
+
+gboolean
+gst_bt_piece_queue_is_empty (GstBtPieceQueue * thiz)
+{
+  return g_atomic_int_get (&thiz->tail) == g_atomic_int_get (&thiz->head);
+}
+
+GstBtPieceQueue *
+gst_bt_piece_queue_new (guint size)
+{
+  GstBtPieceQueue *thiz;
+  guint capacity = 1;
+
+  /* a power of two to wrap with a mask */
+  while (capacity < size)
+    capacity <<= 1;
+
+  thiz = g_new0 (GstBtPieceQueue, 1);
+  thiz->items = new GstBtPieceQueueItem[capacity];
+  thiz->mask = capacity - 1;
+  thiz->lock = g_mutex_new ();
+  thiz->cond = g_cond_new ();
+
+  return thiz;
+}
+
+void
+gst_bt_piece_queue_free (GstBtPieceQueue * thiz)
+{
+  delete[] thiz->items;
+  g_mutex_free (thiz->lock);
+  g_cond_free (thiz->cond);
+  g_free (thiz);
+}
+
+/* Called by the producer, returns FALSE if the piece is dropped because the
+ * queue is closed or full
+ */
+gboolean
+gst_bt_piece_queue_push (GstBtPieceQueue * thiz,
+    boost::shared_array <char> buffer, gint piece, gint size)
+{
+  GstBtPieceQueueItem *slot;
+  gint tail;
+
+  if (g_atomic_int_get (&thiz->closed))
+    return FALSE;
+
+  tail = thiz->tail;
+  if ((guint) (tail - g_atomic_int_get (&thiz->head)) > thiz->mask)
+    return FALSE;
+
+  slot = &thiz->items[tail & thiz->mask];
+  slot->buffer = buffer;
+  slot->piece = piece;
+  slot->size = size;
+  /* publish the slot */
+  g_atomic_int_set (&thiz->tail, tail + 1);
+
+  /* wake up the consumer if it is sleeping */
+  if (g_atomic_int_get (&thiz->waiting)) {
+    g_mutex_lock (thiz->lock);
+    g_cond_signal (thiz->cond);
+    g_mutex_unlock (thiz->lock);
+  }
+
+  return TRUE;
+}
+
+/* Called by the consumer, returns FALSE if empty or closed */
+gboolean
+gst_bt_piece_queue_try_pop (GstBtPieceQueue * thiz, GstBtPieceQueueItem * item)
+{
+  GstBtPieceQueueItem *slot;
+  gint head;
+
+  if (g_atomic_int_get (&thiz->closed))
+    return FALSE;
+
+  head = thiz->head;
+  if (g_atomic_int_get (&thiz->tail) == head)
+    return FALSE;
+
+  slot = &thiz->items[head & thiz->mask];
+  item->buffer = slot->buffer;
+  item->piece = slot->piece;
+  item->size = slot->size;
+  /* do not keep the piece alive until the slot is reused */
+  slot->buffer.reset ();
+  /* release the slot */
+  g_atomic_int_set (&thiz->head, head + 1);
+
+  return TRUE;
+}
+
+/* Called by the consumer, blocks until an item arrives. Returns FALSE once
+ * the queue is closed
+ */
+gboolean
+gst_bt_piece_queue_pop (GstBtPieceQueue * thiz, GstBtPieceQueueItem * item)
+{
+  for (;;) {
+    if (gst_bt_piece_queue_try_pop (thiz, item))
+      return TRUE;
+
+    if (g_atomic_int_get (&thiz->closed))
+      return FALSE;
+
+    g_mutex_lock (thiz->lock);
+    g_atomic_int_set (&thiz->waiting, 1);
+    /* check again, the producer might not have seen us waiting */
+    if (!g_atomic_int_get (&thiz->closed) && gst_bt_piece_queue_is_empty (thiz))
+      g_cond_wait (thiz->cond, thiz->lock);
+    g_atomic_int_set (&thiz->waiting, 0);
+    g_mutex_unlock (thiz->lock);
+  }
+}
+
+guint
+gst_bt_piece_queue_length (GstBtPieceQueue * thiz)
+{
+  return (guint) (g_atomic_int_get (&thiz->tail) -
+      g_atomic_int_get (&thiz->head));
+}
+
+gboolean
+gst_bt_piece_queue_is_closed (GstBtPieceQueue * thiz)
+{
+  return g_atomic_int_get (&thiz->closed);
+}
+
+/* Stop the queue, the consumer wakes up and nothing else is delivered */
+void
+gst_bt_piece_queue_close (GstBtPieceQueue * thiz)
+{
+  g_atomic_int_set (&thiz->closed, 1);
+
+  g_mutex_lock (thiz->lock);
+  g_cond_broadcast (thiz->cond);
+  g_mutex_unlock (thiz->lock);
+}
+
+/* Called once the consumer is stopped, drops the pieces still queued and
+ * accepts new ones. Returns the bytes dropped
+ */
+gint64
+gst_bt_piece_queue_reopen (GstBtPieceQueue * thiz)
+{
+  gint64 dropped = 0;
+
+  while (thiz->head != g_atomic_int_get (&thiz->tail)) {
+    GstBtPieceQueueItem *slot = &thiz->items[thiz->head & thiz->mask];
+
+    dropped += slot->size;
+    slot->buffer.reset ();
+    g_atomic_int_set (&thiz->head, thiz->head + 1);
+  }
+
+  g_atomic_int_set (&thiz->closed, 0);
+
+  return dropped;
+}
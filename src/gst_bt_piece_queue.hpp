@@ -0,0 +1,55 @@
+/* Gst-Bt - BitTorrent related GStreamer elements
+ * Copyright (C) 2015 Jorge Luis Zapata
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GST_BT_PIECE_QUEUE_H
+#define GST_BT_PIECE_QUEUE_H
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <gst/gst.h>
+#include <boost/shared_array.hpp>
+
+/* The pieces read waiting to be pushed on a stream. A single producer and a
+ * single consumer share a preallocated ring without locking
+ */
+typedef struct _GstBtPieceQueue GstBtPieceQueue;
+
+typedef struct _GstBtPieceQueueItem
+{
+  boost::shared_array <char> buffer;
+  gint piece;
+  gint size;
+} GstBtPieceQueueItem;
+
+GstBtPieceQueue * gst_bt_piece_queue_new (guint size);
+void gst_bt_piece_queue_free (GstBtPieceQueue * thiz);
+gboolean gst_bt_piece_queue_push (GstBtPieceQueue * thiz,
+    boost::shared_array <char> buffer, gint piece, gint size);
+gboolean gst_bt_piece_queue_try_pop (GstBtPieceQueue * thiz,
+    GstBtPieceQueueItem * item);
+gboolean gst_bt_piece_queue_pop (GstBtPieceQueue * thiz,
+    GstBtPieceQueueItem * item);
+guint gst_bt_piece_queue_length (GstBtPieceQueue * thiz);
+gboolean gst_bt_piece_queue_is_empty (GstBtPieceQueue * thiz);
+gboolean gst_bt_piece_queue_is_closed (GstBtPieceQueue * thiz);
+void gst_bt_piece_queue_close (GstBtPieceQueue * thiz);
+gint64 gst_bt_piece_queue_reopen (GstBtPieceQueue * thiz);
+
+#endif
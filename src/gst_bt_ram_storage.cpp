@@ -0,0 +1,404 @@
+/* Gst-Bt - BitTorrent related GStreamer elements
+ * Copyright (C) 2015 Jorge Luis Zapata
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A libtorrent storage that never touches the disk. The pieces are kept on a
+ * ring of fixed size so the pieces around the playhead are available for
+ * reading and for uploading to other peers. Once the ring is full the piece
+ * farthest from the playhead is evicted, preferring the complete ones and the
+ * ones already played. Libtorrent still has the evicted pieces, so reading
+ * them fails silently without pausing the torrent, and a torrent plugin marks
+ * them as missing on its next tick so they can be downloaded again
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <gst/gst.h>
+#include <string.h>
+
+#include <set>
+#include <algorithm>
+#include <boost/scoped_array.hpp>
+
+#include "gst_bt_ram_storage.hpp"
+#include "libtorrent/torrent.hpp"
+#include "libtorrent/piece_picker.hpp"
+
+GST_DEBUG_CATEGORY_EXTERN (gst_bt_demux_debug);
+#define GST_CAT_DEFAULT gst_bt_demux_debug
+
+/*----------------------------------------------------------------------------*
+ *                                 The ring                                   *
+ *----------------------------------------------------------------------------*/
+struct _GstBtRamRing
+{
+  gint refcount;
+  gint playhead;
+  GMutex *lock;
+
+  gint ring_pieces;
+  gint num_pieces;
+  gint piece_length;
+  gint64 total_size;
+  boost::scoped_array<char> data;
+  /* the piece on every slot, the slot of every piece and the bytes written
+   * on every slot
+   */
+  std::vector<int> owners;
+  std::vector<int> slots;
+  std::vector<int> written;
+  gint used;
+  /* evicted pieces libtorrent might still have */
+  std::set<int> evicted;
+};
+
+static gint
+gst_bt_ram_ring_piece_size (GstBtRamRing * thiz, gint piece)
+{
+  if (piece == thiz->num_pieces - 1)
+    return (gint) (thiz->total_size - (gint64) piece * thiz->piece_length);
+  return thiz->piece_length;
+}
+
+/* Must be called with the lock held */
+static gboolean
+gst_bt_ram_ring_complete (GstBtRamRing * thiz, gint piece)
+{
+  gint slot;
+
+  if (piece < 0 || piece >= thiz->num_pieces)
+    return FALSE;
+
+  slot = thiz->slots[piece];
+  if (slot < 0)
+    return FALSE;
+
+  return thiz->written[slot] >= gst_bt_ram_ring_piece_size (thiz, piece);
+}
+
+/* How far the piece is from the playhead, the pieces behind it count double
+ * as they have been played already. Must be called with the lock held
+ */
+static gint64
+gst_bt_ram_ring_distance (GstBtRamRing * thiz, gint piece)
+{
+  gint playhead = g_atomic_int_get (&thiz->playhead);
+
+  if (piece < playhead)
+    return ((gint64) playhead - piece) * 2;
+  return (gint64) piece - playhead;
+}
+
+/* Get the slot of a piece, evicting the farthest piece from the playhead if
+ * the ring is full. Must be called with the lock held
+ */
+static gint
+gst_bt_ram_ring_get_slot (GstBtRamRing * thiz, gint piece)
+{
+  gint64 best_distance = -1;
+  gboolean best_complete = FALSE;
+  gint slot;
+  gint i;
+
+  slot = thiz->slots[piece];
+  if (slot >= 0)
+    return slot;
+
+  if (thiz->used < thiz->ring_pieces) {
+    slot = thiz->used++;
+  } else {
+    for (i = 0; i < thiz->ring_pieces; i++) {
+      gint owner = thiz->owners[i];
+      gboolean complete = gst_bt_ram_ring_complete (thiz, owner);
+      gint64 distance = gst_bt_ram_ring_distance (thiz, owner);
+
+      if (complete < best_complete)
+        continue;
+      if (complete == best_complete && distance <= best_distance)
+        continue;
+
+      slot = i;
+      best_complete = complete;
+      best_distance = distance;
+    }
+
+    GST_LOG ("Piece %d evicted by piece %d", thiz->owners[slot], piece);
+    thiz->slots[thiz->owners[slot]] = -1;
+    thiz->evicted.insert (thiz->owners[slot]);
+  }
+
+  thiz->owners[slot] = piece;
+  thiz->slots[piece] = slot;
+  thiz->written[slot] = 0;
+  thiz->evicted.erase (piece);
+
+  return slot;
+}
+
+GstBtRamRing *
+gst_bt_ram_ring_new (gint ring_pieces, gint num_pieces, gint piece_length,
+    gint64 total_size)
+{
+  GstBtRamRing *thiz;
+
+  thiz = new GstBtRamRing;
+  thiz->refcount = 1;
+  thiz->playhead = 0;
+  thiz->lock = g_mutex_new ();
+  thiz->ring_pieces = ring_pieces;
+  thiz->num_pieces = num_pieces;
+  thiz->piece_length = piece_length;
+  thiz->total_size = total_size;
+  thiz->data.reset (new char[(size_t) ring_pieces * piece_length]);
+  thiz->owners.assign (ring_pieces, -1);
+  thiz->slots.assign (num_pieces, -1);
+  thiz->written.assign (ring_pieces, 0);
+  thiz->used = 0;
+
+  GST_DEBUG ("Created a ring of %d pieces of %d bytes", ring_pieces,
+      piece_length);
+
+  return thiz;
+}
+
+GstBtRamRing *
+gst_bt_ram_ring_ref (GstBtRamRing * thiz)
+{
+  g_atomic_int_inc (&thiz->refcount);
+  return thiz;
+}
+
+void
+gst_bt_ram_ring_unref (GstBtRamRing * thiz)
+{
+  if (!g_atomic_int_dec_and_test (&thiz->refcount))
+    return;
+
+  g_mutex_free (thiz->lock);
+  delete thiz;
+}
+
+/* Whether the whole piece is on the ring */
+gboolean
+gst_bt_ram_ring_has_piece (GstBtRamRing * thiz, gint piece)
+{
+  gboolean ret;
+
+  g_mutex_lock (thiz->lock);
+  ret = gst_bt_ram_ring_complete (thiz, piece);
+  g_mutex_unlock (thiz->lock);
+
+  return ret;
+}
+
+/* The pieces around the piece being played are the last to be evicted */
+void
+gst_bt_ram_ring_set_playhead (GstBtRamRing * thiz, gint piece)
+{
+  g_atomic_int_set (&thiz->playhead, piece);
+}
+
+/*----------------------------------------------------------------------------*
+ *                               The storage                                  *
+ *----------------------------------------------------------------------------*/
+class GstBtRamStorage : public libtorrent::storage_interface
+{
+public:
+  GstBtRamStorage (GstBtRamRing * ring) : ring (gst_bt_ram_ring_ref (ring))
+  {
+  }
+
+  ~GstBtRamStorage ()
+  {
+    gst_bt_ram_ring_unref (ring);
+  }
+
+  bool initialize (bool allocate_files)
+  {
+    return false;
+  }
+
+  bool has_any_file ()
+  {
+    return false;
+  }
+
+  int read (char * buf, int slot, int offset, int size)
+  {
+    int idx;
+
+    g_mutex_lock (ring->lock);
+    idx = ring->slots[slot];
+    if (idx < 0) {
+      g_mutex_unlock (ring->lock);
+      /* no error set, libtorrent fails the read without pausing */
+      GST_DEBUG ("Piece %d is not in the ring anymore", slot);
+      return -1;
+    }
+    memcpy (buf, ring->data.get () + (size_t) idx * ring->piece_length +
+        offset, size);
+    g_mutex_unlock (ring->lock);
+
+    return size;
+  }
+
+  int write (const char * buf, int slot, int offset, int size)
+  {
+    int idx;
+
+    g_mutex_lock (ring->lock);
+    idx = gst_bt_ram_ring_get_slot (ring, slot);
+    memcpy (ring->data.get () + (size_t) idx * ring->piece_length + offset,
+        buf, size);
+    ring->written[idx] = MIN (ring->written[idx] + size,
+        gst_bt_ram_ring_piece_size (ring, slot));
+    g_mutex_unlock (ring->lock);
+
+    return size;
+  }
+
+  libtorrent::size_type physical_offset (int slot, int offset)
+  {
+    return (libtorrent::size_type) slot * ring->piece_length + offset;
+  }
+
+  bool move_storage (std::string const & save_path, int flags)
+  {
+    return false;
+  }
+
+  bool verify_resume_data (libtorrent::lazy_entry const & rd,
+      libtorrent::error_code & error)
+  {
+    /* nothing survives us */
+    return false;
+  }
+
+  bool write_resume_data (libtorrent::entry & rd) const
+  {
+    return false;
+  }
+
+  bool move_slot (int src_slot, int dst_slot)
+  {
+    return swap_slots (src_slot, dst_slot);
+  }
+
+  bool swap_slots (int slot1, int slot2)
+  {
+    /* only used on compact allocation */
+    return true;
+  }
+
+  bool swap_slots3 (int slot1, int slot2, int slot3)
+  {
+    return true;
+  }
+
+  bool release_files ()
+  {
+    return false;
+  }
+
+  bool rename_file (int index, std::string const & new_filename)
+  {
+    return false;
+  }
+
+  bool delete_files ()
+  {
+    g_mutex_lock (ring->lock);
+    std::fill (ring->owners.begin (), ring->owners.end (), -1);
+    std::fill (ring->slots.begin (), ring->slots.end (), -1);
+    std::fill (ring->written.begin (), ring->written.end (), 0);
+    ring->used = 0;
+    ring->evicted.clear ();
+    g_mutex_unlock (ring->lock);
+    return false;
+  }
+
+private:
+  GstBtRamRing *ring;
+};
+
+libtorrent::storage_interface *
+gst_bt_ram_storage_new (libtorrent::file_storage const & fs,
+    libtorrent::file_storage const * mapped, std::string const & path,
+    libtorrent::file_pool & fp, std::vector<boost::uint8_t> const & prio,
+    GstBtRamRing * ring)
+{
+  return new GstBtRamStorage (ring);
+}
+
+/*----------------------------------------------------------------------------*
+ *                                The plugin                                  *
+ *----------------------------------------------------------------------------*/
+class GstBtRamPlugin : public libtorrent::torrent_plugin
+{
+public:
+  GstBtRamPlugin (libtorrent::torrent * t, GstBtRamRing * ring)
+      : t (t), ring (gst_bt_ram_ring_ref (ring))
+  {
+  }
+
+  ~GstBtRamPlugin ()
+  {
+    gst_bt_ram_ring_unref (ring);
+  }
+
+  /* runs on the network thread, the only one allowed to touch the picker */
+  void tick ()
+  {
+    std::vector<int> pieces;
+    std::set<int>::iterator it;
+
+    /* a seed has no picker, keep the evicted pieces for a later tick */
+    if (!t->has_picker ())
+      return;
+
+    g_mutex_lock (ring->lock);
+    for (it = ring->evicted.begin (); it != ring->evicted.end ();) {
+      /* still being downloaded, forget it once finished */
+      if (!t->have_piece (*it)) {
+        ++it;
+        continue;
+      }
+      pieces.push_back (*it);
+      ring->evicted.erase (it++);
+    }
+    g_mutex_unlock (ring->lock);
+
+    for (size_t i = 0; i < pieces.size (); i++) {
+      GST_DEBUG ("Forgetting evicted piece %d", pieces[i]);
+      t->picker ().we_dont_have (pieces[i]);
+    }
+  }
+
+private:
+  libtorrent::torrent *t;
+  GstBtRamRing *ring;
+};
+
+boost::shared_ptr<libtorrent::torrent_plugin>
+gst_bt_ram_storage_plugin_new (libtorrent::torrent * t, GstBtRamRing * ring)
+{
+  return boost::shared_ptr<libtorrent::torrent_plugin> (
+      new GstBtRamPlugin (t, ring));
+}
@@ -0,0 +1,58 @@
+/* Gst-Bt - BitTorrent related GStreamer elements
+ * Copyright (C) 2015 Jorge Luis Zapata
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GST_BT_RAM_STORAGE_H
+#define GST_BT_RAM_STORAGE_H
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <gst/gst.h>
+#include "libtorrent/storage.hpp"
+#include "libtorrent/extensions.hpp"
+
+/* The pieces kept in memory, shared by the storage, the torrent plugin that
+ * forgets the evicted pieces and the demuxer, which tells where the playhead
+ * is
+ */
+typedef struct _GstBtRamRing GstBtRamRing;
+
+GstBtRamRing * gst_bt_ram_ring_new (gint ring_pieces, gint num_pieces,
+    gint piece_length, gint64 total_size);
+GstBtRamRing * gst_bt_ram_ring_ref (GstBtRamRing * thiz);
+void gst_bt_ram_ring_unref (GstBtRamRing * thiz);
+gboolean gst_bt_ram_ring_has_piece (GstBtRamRing * thiz, gint piece);
+void gst_bt_ram_ring_set_playhead (GstBtRamRing * thiz, gint piece);
+
+/* Storage keeping ring_pieces pieces in memory, the ones far from the
+ * playhead are evicted first and can not be read anymore
+ */
+libtorrent::storage_interface * gst_bt_ram_storage_new (
+    libtorrent::file_storage const & fs,
+    libtorrent::file_storage const * mapped, std::string const & path,
+    libtorrent::file_pool & fp, std::vector<boost::uint8_t> const & prio,
+    GstBtRamRing * ring);
+
+/* Plugin marking the evicted pieces as missing, so they are downloaded
+ * again if needed
+ */
+boost::shared_ptr<libtorrent::torrent_plugin> gst_bt_ram_storage_plugin_new (
+    libtorrent::torrent * t, GstBtRamRing * ring);
+
+#endif
@@ -0,0 +1,89 @@
+/* Gst-Bt - BitTorrent related GStreamer elements
+ * Copyright (C) 2015 Jorge Luis Zapata
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The piece arithmetic. Every byte position is computed in 64 bits and
+ * only the results that are bounded by the piece length or the number of
+ * pieces are narrowed
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "gst_bt_range.hpp"
+
+/* Map size bytes starting at the torrent byte offset to pieces. An empty
+ * range starts and ends on the piece of offset
+ */
+gboolean
+gst_bt_range_map (gint64 offset, gint64 size, gint piece_length,
+    GstBtRange * range)
+{
+  gint64 last;
+
+  if (piece_length <= 0 || offset < 0 || size < 0)
+    return FALSE;
+
+  range->start_piece = (gint) (offset / piece_length);
+  range->start_offset = (gint) (offset % piece_length);
+
+  if (!size) {
+    range->end_piece = range->start_piece;
+    range->end_offset = range->start_offset;
+    return TRUE;
+  }
+
+  /* the last byte, not the one after, so a range ending on a piece boundary
+   * does not reach the next piece
+   */
+  last = offset + size - 1;
+  range->end_piece = (gint) (last / piece_length);
+  range->end_offset = (gint) (last % piece_length) + 1;
+
+  return TRUE;
+}
+
+/* The bytes [begin, end) of a piece of piece_size bytes that belong to the
+ * range. Returns FALSE if the piece is out of the range
+ */
+gboolean
+gst_bt_range_clip (const GstBtRange * range, gint piece, gint piece_size,
+    gint * begin, gint * end)
+{
+  gint b = 0;
+  gint e = piece_size;
+
+  if (piece < range->start_piece || piece > range->end_piece)
+    return FALSE;
+
+  if (piece == range->start_piece)
+    b = range->start_offset;
+  if (piece == range->end_piece)
+    e = MIN (e, range->end_offset);
+
+  if (b > e)
+    b = e;
+
+  if (begin)
+    *begin = b;
+  if (end)
+    *end = e;
+
+  return TRUE;
+}
@@ -0,0 +1,47 @@
+/* Gst-Bt - BitTorrent related GStreamer elements
+ * Copyright (C) 2015 Jorge Luis Zapata
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GST_BT_RANGE_H
+#define GST_BT_RANGE_H
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <glib.h>
+
+/* A range of bytes of the torrent expressed in pieces. The offsets are
+ * relative to the piece so they always fit, the byte positions are 64 bits
+ * given that the files can be way bigger than 2GiB
+ */
+typedef struct _GstBtRange
+{
+  /* the piece and the offset of the first byte */
+  gint start_piece;
+  gint start_offset;
+  /* the piece and the offset after the last byte */
+  gint end_piece;
+  gint end_offset;
+} GstBtRange;
+
+gboolean gst_bt_range_map (gint64 offset, gint64 size, gint piece_length,
+    GstBtRange * range);
+gboolean gst_bt_range_clip (const GstBtRange * range, gint piece,
+    gint piece_size, gint * begin, gint * end);
+
+#endif
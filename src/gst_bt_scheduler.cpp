@@ -0,0 +1,288 @@
+/* Gst-Bt - BitTorrent related GStreamer elements
+ * Copyright (C) 2015 Jorge Luis Zapata
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The piece scheduler decides which pieces of a stream need to be downloaded
+ * and read, and keeps track of the stream buffering. It does not know about
+ * libtorrent nor the demuxer, it works on a GstBtSchedulerStream and
+ * everything else is done through a GstBtTorrent
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "gst_bt_scheduler.hpp"
+#include "gst_bt_trace.h"
+
+GST_DEBUG_CATEGORY_EXTERN (gst_bt_demux_debug);
+#define GST_CAT_DEFAULT gst_bt_demux_debug
+
+/* Set the segment rate of the stream. The pieces are pushed backwards on
+ * negative rates and, on trick modes, only one every rate pieces is pushed
+ */
+void
+gst_bt_scheduler_set_rate (GstBtSchedulerStream * thiz, gdouble rate,
+    gboolean skip)
+{
+  int stride = 1;
+
+  if (skip && ABS (rate) >= 2.0)
+    stride = (int) ABS (rate);
+
+  thiz->rate = rate;
+  thiz->step = rate < 0.0 ? -stride : stride;
+}
+
+/* The piece to push after piece */
+int
+gst_bt_scheduler_next_piece (GstBtSchedulerStream * thiz, int piece)
+{
+  return piece + thiz->step;
+}
+
+gboolean
+gst_bt_scheduler_piece_in_segment (GstBtSchedulerStream * thiz, int piece)
+{
+  return piece >= thiz->start_piece && piece <= thiz->end_piece;
+}
+
+/* Whether the piece is one of the next max_pieces to push */
+gboolean
+gst_bt_scheduler_piece_in_window (GstBtSchedulerStream * thiz, int piece,
+    int max_pieces)
+{
+  int distance = piece - thiz->current_piece;
+
+  if (!gst_bt_scheduler_piece_in_segment (thiz, piece))
+    return FALSE;
+
+  if (distance % thiz->step)
+    return FALSE;
+
+  distance /= thiz->step;
+  return distance >= 1 && distance <= max_pieces;
+}
+
+gboolean
+gst_bt_scheduler_start_buffering (GstBtSchedulerStream * thiz,
+    GstBtTorrent & t, int max_pieces)
+{
+  int i;
+  int piece = thiz->current_piece;
+
+  /* count how many consecutive pieces need to be downloaded */
+  thiz->buffering_count = 0;
+  for (i = 0; i < max_pieces; i++) {
+    piece = gst_bt_scheduler_next_piece (thiz, piece);
+
+    /* do not overflow */
+    if (!gst_bt_scheduler_piece_in_segment (thiz, piece))
+      break;
+
+    /* already downloaded */
+    if (t.have_piece (piece))
+      continue;
+
+    thiz->buffering_count++;
+  }
+
+  if (thiz->buffering_count) {
+    thiz->buffering = TRUE;
+    thiz->buffering_level = 0;
+    return TRUE;
+  } else {
+    return FALSE;
+  }
+}
+
+void
+gst_bt_scheduler_update_buffering (GstBtSchedulerStream * thiz,
+    GstBtTorrent & t, int max_pieces)
+{
+  int i;
+  int piece = thiz->current_piece;
+  int buffered_pieces = 0;
+
+  /* count how many consecutive pieces have been downloaded */
+  for (i = 0; i < max_pieces; i++) {
+    piece = gst_bt_scheduler_next_piece (thiz, piece);
+
+    /* do not overflow */
+    if (!gst_bt_scheduler_piece_in_segment (thiz, piece))
+      break;
+
+    if (t.have_piece (piece))
+      buffered_pieces++;
+  }
+
+  if (buffered_pieces > thiz->buffering_count)
+    buffered_pieces = thiz->buffering_count;
+
+  thiz->buffering = TRUE;
+  thiz->buffering_level = (buffered_pieces * 100) / thiz->buffering_count;
+  GST_DEBUG ("Buffering level %d (%d/%d) on stream %d",
+      thiz->buffering_level, buffered_pieces, thiz->buffering_count,
+      thiz->idx);
+}
+
+void
+gst_bt_scheduler_add_piece (GstBtSchedulerStream * thiz,
+    GstBtTorrent & t, int piece, int max_pieces)
+{
+  GST_DEBUG ("Adding more pieces at %d, current: %d, max: %d, stream: %d",
+      piece, thiz->current_piece, max_pieces, thiz->idx);
+  for (; gst_bt_scheduler_piece_in_segment (thiz, piece);
+      piece = gst_bt_scheduler_next_piece (thiz, piece)) {
+    int priority;
+
+    if (t.have_piece (piece))
+      continue;
+
+    /* if already scheduled, do nothing */
+    priority = t.piece_priority (piece);
+    if (priority == 7)
+      continue;
+
+    /* max priority */
+    priority = 7;
+
+    t.piece_priority (piece, priority);
+    GST_BT_TRACE (NULL, piece_priority, thiz->idx, piece);
+    GST_DEBUG ("Requesting piece %d, prio: %d, current: %d, stream: %d",
+        piece, priority, thiz->current_piece, thiz->idx);
+    break;
+  }
+}
+
+gboolean
+gst_bt_scheduler_activate (GstBtSchedulerStream * thiz, GstBtTorrent & t,
+    int max_pieces)
+{
+  gboolean ret = FALSE;
+  int first;
+  int i;
+
+  thiz->requested = TRUE;
+  /* start from the segment end when playing backwards */
+  if (thiz->step > 0)
+    thiz->current_piece = thiz->start_piece - thiz->step;
+  else
+    thiz->current_piece = thiz->end_piece - thiz->step;
+  thiz->pending_segment = TRUE;
+  first = gst_bt_scheduler_next_piece (thiz, thiz->current_piece);
+
+  GST_DEBUG ("Activating stream %d, start: %d, end: %d, current: %d, "
+      "step: %d", thiz->idx, thiz->start_piece, thiz->end_piece,
+      thiz->current_piece, thiz->step);
+
+  if (t.have_piece (first)) {
+    /* request the first non-downloaded piece */
+    for (i = 1; i < max_pieces; i++) {
+      gst_bt_scheduler_add_piece (thiz, t, first + (i * thiz->step),
+          max_pieces);
+    }
+  } else {
+    for (i = 0; i < max_pieces; i++) {
+      gst_bt_scheduler_add_piece (thiz, t, first + (i * thiz->step),
+          max_pieces);
+    }
+    /* start the buffering */
+    gst_bt_scheduler_start_buffering (thiz, t, max_pieces);
+    ret = TRUE;
+  }
+
+  return ret;
+}
+
+void
+gst_bt_scheduler_read_piece (GstBtSchedulerStream * thiz, GstBtTorrent & t,
+    int piece)
+{
+  GST_DEBUG ("Reading piece %d, current: %d, stream: %d", piece,
+      thiz->current_piece, thiz->idx);
+  GST_BT_TRACE (NULL, piece_read_requested, thiz->idx, piece);
+  t.read_piece (thiz, piece);
+}
+
+/* A piece of the stream has been downloaded, schedule the next one. Returns
+ * TRUE if the buffering level has changed
+ */
+gboolean
+gst_bt_scheduler_piece_finished (GstBtSchedulerStream * thiz,
+    GstBtTorrent & t, int piece, int max_pieces)
+{
+  gboolean ret = FALSE;
+
+  GST_BT_TRACE (NULL, piece_finished, thiz->idx, piece);
+  /* low the priority again */
+  t.piece_priority (piece, 0);
+
+  /* update the buffering */
+  if (thiz->buffering) {
+    gst_bt_scheduler_update_buffering (thiz, t, max_pieces);
+    ret = TRUE;
+  }
+
+  /* download the next piece */
+  gst_bt_scheduler_add_piece (thiz, t,
+      gst_bt_scheduler_next_piece (thiz, piece), max_pieces);
+
+  return ret;
+}
+
+/* A piece of the stream is being pushed, read the next one if at least
+ * low_pieces are available after it or start buffering up to max_pieces
+ * otherwise. Returns TRUE if the stream started buffering
+ */
+gboolean
+gst_bt_scheduler_piece_pushed (GstBtSchedulerStream * thiz, GstBtTorrent & t,
+    int piece, int max_pieces, int low_pieces)
+{
+  int next = gst_bt_scheduler_next_piece (thiz, piece);
+  int available = 0;
+  int i = next;
+
+  if (!gst_bt_scheduler_piece_in_segment (thiz, next))
+    return FALSE;
+
+  /* count the pieces ready to be pushed, the end of the segment is enough */
+  while (available < low_pieces) {
+    if (!gst_bt_scheduler_piece_in_segment (thiz, i)) {
+      available = low_pieces;
+      break;
+    }
+
+    if (!t.have_piece (i))
+      break;
+
+    available++;
+    i = gst_bt_scheduler_next_piece (thiz, i);
+  }
+
+  if (available >= low_pieces) {
+    gst_bt_scheduler_read_piece (thiz, t, next);
+    return FALSE;
+  }
+
+  GST_DEBUG ("Start buffering next piece %d, %d/%d pieces "
+      "available, stream: %d", next, available, low_pieces, thiz->idx);
+  /* start buffering now that the pieces are below the low watermark */
+  gst_bt_scheduler_start_buffering (thiz, t, max_pieces);
+  return TRUE;
+}
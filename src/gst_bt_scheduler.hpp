@@ -0,0 +1,94 @@
+/* Gst-Bt - BitTorrent related GStreamer elements
+ * Copyright (C) 2015 Jorge Luis Zapata
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GST_BT_SCHEDULER_H
+#define GST_BT_SCHEDULER_H
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <gst/gst.h>
+
+/* The scheduling state of a stream. A plain structure, so the scheduler can
+ * run without any pad or element, like on the offline simulator
+ */
+typedef struct _GstBtSchedulerStream
+{
+  /* the file index */
+  gint idx;
+  gint current_piece;
+  gint start_piece;
+  gint end_piece;
+  /* the segment rate and the pieces advanced on every push, negative when
+   * playing backwards
+   */
+  gdouble rate;
+  gint step;
+  gboolean requested;
+  gboolean pending_segment;
+  gboolean buffering;
+  gint buffering_level;
+  gint buffering_count;
+} GstBtSchedulerStream;
+
+#ifdef __cplusplus
+/* The torrent the piece scheduler works on. The demuxer implements it on top
+ * of a libtorrent handle, but anything able to tell which pieces are
+ * available can drive the scheduler, like a simulated swarm replaying piece
+ * arrivals in virtual time
+ */
+class GstBtTorrent
+{
+public:
+  virtual ~GstBtTorrent () {}
+  /* whether the piece has been downloaded */
+  virtual bool have_piece (int piece) = 0;
+  /* the download priority of a piece, from 0 (skip) to 7 (top) */
+  virtual int piece_priority (int piece) = 0;
+  virtual void piece_priority (int piece, int priority) = 0;
+  /* request the piece data for the stream, it will be delivered
+   * asynchronously
+   */
+  virtual void read_piece (GstBtSchedulerStream * stream, int piece) = 0;
+};
+
+void gst_bt_scheduler_set_rate (GstBtSchedulerStream * thiz, gdouble rate,
+    gboolean skip);
+int gst_bt_scheduler_next_piece (GstBtSchedulerStream * thiz, int piece);
+gboolean gst_bt_scheduler_piece_in_segment (GstBtSchedulerStream * thiz,
+    int piece);
+gboolean gst_bt_scheduler_piece_in_window (GstBtSchedulerStream * thiz,
+    int piece, int max_pieces);
+gboolean gst_bt_scheduler_start_buffering (GstBtSchedulerStream * thiz,
+    GstBtTorrent & t, int max_pieces);
+void gst_bt_scheduler_update_buffering (GstBtSchedulerStream * thiz,
+    GstBtTorrent & t, int max_pieces);
+void gst_bt_scheduler_add_piece (GstBtSchedulerStream * thiz,
+    GstBtTorrent & t, int piece, int max_pieces);
+gboolean gst_bt_scheduler_activate (GstBtSchedulerStream * thiz,
+    GstBtTorrent & t, int max_pieces);
+void gst_bt_scheduler_read_piece (GstBtSchedulerStream * thiz,
+    GstBtTorrent & t, int piece);
+gboolean gst_bt_scheduler_piece_finished (GstBtSchedulerStream * thiz,
+    GstBtTorrent & t, int piece, int max_pieces);
+gboolean gst_bt_scheduler_piece_pushed (GstBtSchedulerStream * thiz,
+    GstBtTorrent & t, int piece, int max_pieces, int low_pieces);
+#endif
+
+#endif
@@ -0,0 +1,477 @@
+/* Gst-Bt - BitTorrent related GStreamer elements
+ * Copyright (C) 2015 Jorge Luis Zapata
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Session helpers shared by every element. The settings are applied on top
+ * of a profile, where every field of the settings structure maps to the
+ * libtorrent setting with the same name, using dashes instead of
+ * underscores, i.e "cache-size" sets session_settings::cache_size. The
+ * fields starting with "dht-" set the dht_settings the same way, i.e
+ * "dht-restrict-routing-ips" sets dht_settings::restrict_routing_ips
+ *
+ * The peers are given as a comma separated list of address:port endpoints,
+ * IPv6 addresses go between brackets, i.e "192.168.1.2:6881,[::1]:6881"
+ *
+ * The DHT routing table is kept on a bencoded state file shared by every
+ * element, so a new session does not need to bootstrap it again. The DHT
+ * routers are given as a comma separated list of host:port endpoints, i.e
+ * "router.bittorrent.com:6881"
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "gst_bt_session.hpp"
+#include <string.h>
+
+#include "libtorrent/session.hpp"
+#include "libtorrent/session_settings.hpp"
+#include "libtorrent/socket.hpp"
+#include "libtorrent/bencode.hpp"
+#include "libtorrent/lazy_entry.hpp"
+#include <iterator>
+
+/* the ports tried when the DHT needs a socket */
+#define DHT_PORT_MIN 6881
+#define DHT_PORT_MAX 6891
+
+GST_DEBUG_CATEGORY_EXTERN (gst_bt_session_debug);
+#define GST_CAT_DEFAULT gst_bt_session_debug
+
+typedef struct _GstBtSessionIntSetting
+{
+  const gchar *name;
+  int libtorrent::session_settings::*field;
+} GstBtSessionIntSetting;
+
+typedef struct _GstBtSessionBoolSetting
+{
+  const gchar *name;
+  bool libtorrent::session_settings::*field;
+} GstBtSessionBoolSetting;
+
+typedef struct _GstBtSessionDhtBoolSetting
+{
+  const gchar *name;
+  bool libtorrent::dht_settings::*field;
+} GstBtSessionDhtBoolSetting;
+
+/* Everything the settings structure can set */
+typedef struct _GstBtSessionSettings
+{
+  libtorrent::session_settings settings;
+  libtorrent::dht_settings dht;
+} GstBtSessionSettings;
+
+static const GstBtSessionIntSetting int_settings[] = {
+  { "cache-size", &libtorrent::session_settings::cache_size },
+  { "cache-expiry", &libtorrent::session_settings::cache_expiry },
+  { "connections-limit", &libtorrent::session_settings::connections_limit },
+  { "connection-speed", &libtorrent::session_settings::connection_speed },
+  { "unchoke-slots-limit",
+      &libtorrent::session_settings::unchoke_slots_limit },
+  { "choking-algorithm", &libtorrent::session_settings::choking_algorithm },
+  { "max-out-request-queue",
+      &libtorrent::session_settings::max_out_request_queue },
+  { "max-allowed-in-request-queue",
+      &libtorrent::session_settings::max_allowed_in_request_queue },
+  { "request-queue-time", &libtorrent::session_settings::request_queue_time },
+  { "max-queued-disk-bytes",
+      &libtorrent::session_settings::max_queued_disk_bytes },
+  { "piece-timeout", &libtorrent::session_settings::piece_timeout },
+  { "whole-pieces-threshold",
+      &libtorrent::session_settings::whole_pieces_threshold },
+  { "torrent-connect-boost",
+      &libtorrent::session_settings::torrent_connect_boost },
+  { "upload-rate-limit", &libtorrent::session_settings::upload_rate_limit },
+  { "download-rate-limit",
+      &libtorrent::session_settings::download_rate_limit },
+  { NULL, NULL },
+};
+
+static const GstBtSessionBoolSetting bool_settings[] = {
+  { "use-read-cache", &libtorrent::session_settings::use_read_cache },
+  { "strict-end-game-mode",
+      &libtorrent::session_settings::strict_end_game_mode },
+  { "prioritize-partial-pieces",
+      &libtorrent::session_settings::prioritize_partial_pieces },
+  { "allow-multiple-connections-per-ip",
+      &libtorrent::session_settings::allow_multiple_connections_per_ip },
+  { NULL, NULL },
+};
+
+static const GstBtSessionDhtBoolSetting dht_bool_settings[] = {
+  { "dht-restrict-routing-ips",
+      &libtorrent::dht_settings::restrict_routing_ips },
+  { "dht-restrict-search-ips",
+      &libtorrent::dht_settings::restrict_search_ips },
+  { NULL, NULL },
+};
+
+GType
+gst_bt_session_profile_get_type (void)
+{
+  static GType gst_bt_session_profile_type = 0;
+  static const GEnumValue session_profile_types[] = {
+    {GST_BT_SESSION_PROFILE_DEFAULT, "libtorrent defaults", "default" },
+    {GST_BT_SESSION_PROFILE_LOW_LATENCY_STREAMING,
+        "Fast start and short request pipelines", "low-latency-streaming" },
+    {GST_BT_SESSION_PROFILE_BULK_DOWNLOAD,
+        "Big caches and many connections", "bulk-download" },
+    {GST_BT_SESSION_PROFILE_LOW_MEMORY_EMBEDDED,
+        "Minimal memory usage", "low-memory-embedded" },
+    {0, NULL, NULL}
+  };
+
+  if (!gst_bt_session_profile_type) {
+    gst_bt_session_profile_type =
+        g_enum_register_static ("GstBtSessionProfile",
+        session_profile_types);
+  }
+  return gst_bt_session_profile_type;
+}
+
+static libtorrent::session_settings
+gst_bt_session_profile_settings (GstBtSessionProfile profile)
+{
+  using namespace libtorrent;
+  session_settings settings;
+
+  switch (profile) {
+    case GST_BT_SESSION_PROFILE_LOW_LATENCY_STREAMING:
+      /* connect quickly to many peers and keep the request pipeline short
+       * so the pieces near the playhead arrive first
+       */
+      settings.connection_speed = 20;
+      settings.torrent_connect_boost = 30;
+      settings.request_queue_time = 1;
+      settings.piece_timeout = 5;
+      settings.whole_pieces_threshold = 5;
+      settings.prioritize_partial_pieces = true;
+      settings.strict_end_game_mode = false;
+      break;
+
+    case GST_BT_SESSION_PROFILE_BULK_DOWNLOAD:
+      settings = high_performance_seed ();
+      break;
+
+    case GST_BT_SESSION_PROFILE_LOW_MEMORY_EMBEDDED:
+      settings = min_memory_usage ();
+      break;
+
+    case GST_BT_SESSION_PROFILE_DEFAULT:
+    default:
+      break;
+  }
+
+  return settings;
+}
+
+static gboolean
+gst_bt_session_set_field (GQuark field_id, const GValue * value,
+    gpointer user_data)
+{
+  using namespace libtorrent;
+  GstBtSessionSettings *all = (GstBtSessionSettings *) user_data;
+  session_settings *settings = &all->settings;
+  const gchar *name = g_quark_to_string (field_id);
+  gint i;
+
+  for (i = 0; int_settings[i].name; i++) {
+    if (strcmp (int_settings[i].name, name))
+      continue;
+
+    if (!G_VALUE_HOLDS_INT (value)) {
+      GST_WARNING ("Setting '%s' must be an integer", name);
+      return TRUE;
+    }
+
+    GST_DEBUG ("Setting '%s' to %d", name, g_value_get_int (value));
+    settings->*(int_settings[i].field) = g_value_get_int (value);
+    return TRUE;
+  }
+
+  for (i = 0; bool_settings[i].name; i++) {
+    if (strcmp (bool_settings[i].name, name))
+      continue;
+
+    if (!G_VALUE_HOLDS_BOOLEAN (value)) {
+      GST_WARNING ("Setting '%s' must be a boolean", name);
+      return TRUE;
+    }
+
+    GST_DEBUG ("Setting '%s' to %d", name, g_value_get_boolean (value));
+    settings->*(bool_settings[i].field) = g_value_get_boolean (value);
+    return TRUE;
+  }
+
+  for (i = 0; dht_bool_settings[i].name; i++) {
+    if (strcmp (dht_bool_settings[i].name, name))
+      continue;
+
+    if (!G_VALUE_HOLDS_BOOLEAN (value)) {
+      GST_WARNING ("Setting '%s' must be a boolean", name);
+      return TRUE;
+    }
+
+    GST_DEBUG ("Setting '%s' to %d", name, g_value_get_boolean (value));
+    all->dht.*(dht_bool_settings[i].field) = g_value_get_boolean (value);
+    return TRUE;
+  }
+
+  GST_WARNING ("Unknown setting '%s'", name);
+  return TRUE;
+}
+
+void
+gst_bt_session_apply_settings (GstObject * obj, gpointer session,
+    GstBtSessionProfile profile, const GstStructure * settings)
+{
+  using namespace libtorrent;
+  GstBtSessionSettings all;
+  session *s = (libtorrent::session *) session;
+
+  GST_DEBUG_OBJECT (obj, "Applying the session profile %d", profile);
+  all.settings = gst_bt_session_profile_settings (profile);
+  if (settings) {
+    gst_structure_foreach (settings, gst_bt_session_set_field, &all);
+  }
+  s->set_settings (all.settings);
+  s->set_dht_settings (all.dht);
+}
+
+/* Split a single host:port endpoint, the host is returned without the
+ * brackets of IPv6 addresses
+ */
+static gboolean
+gst_bt_session_split_endpoint (const gchar * endpoint, gchar ** host,
+    gint * port)
+{
+  const gchar *colon;
+  gchar *end;
+  gint64 number;
+
+  colon = strrchr (endpoint, ':');
+  if (!colon || colon == endpoint)
+    return FALSE;
+
+  number = g_ascii_strtoll (colon + 1, &end, 10);
+  if (*end != '\0' || number <= 0 || number > 65535)
+    return FALSE;
+
+  if (endpoint[0] == '[' && *(colon - 1) == ']')
+    *host = g_strndup (endpoint + 1, colon - endpoint - 2);
+  else
+    *host = g_strndup (endpoint, colon - endpoint);
+  *port = (gint) number;
+
+  return TRUE;
+}
+
+/* Parse a single address:port endpoint */
+static gboolean
+gst_bt_session_parse_peer (const gchar * peer, libtorrent::tcp::endpoint & ep)
+{
+  using namespace libtorrent;
+  error_code ec;
+  address addr;
+  gchar *host;
+  gint port;
+
+  if (!gst_bt_session_split_endpoint (peer, &host, &port))
+    return FALSE;
+
+  addr = address::from_string (host, ec);
+  g_free (host);
+  if (ec)
+    return FALSE;
+
+  ep = tcp::endpoint (addr, (unsigned short) port);
+  return TRUE;
+}
+
+/* Connect every torrent of the session to the peers, return the number of
+ * valid endpoints. Connecting to an already connected peer does nothing
+ */
+gint
+gst_bt_session_connect_peers (GstObject * obj, gpointer session,
+    const gchar * peers)
+{
+  using namespace libtorrent;
+  session *s = (libtorrent::session *) session;
+  std::vector<torrent_handle> torrents;
+  gchar **endpoints;
+  gint ret = 0;
+  gint i;
+
+  if (!peers)
+    return 0;
+
+  torrents = s->get_torrents ();
+  endpoints = g_strsplit (peers, ",", -1);
+  for (i = 0; endpoints[i]; i++) {
+    std::vector<torrent_handle>::iterator it;
+    tcp::endpoint ep;
+
+    g_strstrip (endpoints[i]);
+    if (*endpoints[i] == '\0')
+      continue;
+
+    if (!gst_bt_session_parse_peer (endpoints[i], ep)) {
+      GST_WARNING_OBJECT (obj, "Invalid peer '%s'", endpoints[i]);
+      continue;
+    }
+
+    for (it = torrents.begin (); it != torrents.end (); ++it)
+      it->connect_peer (ep);
+    ret++;
+  }
+  g_strfreev (endpoints);
+
+  return ret;
+}
+
+/* Check if an address is one of the peers */
+gboolean
+gst_bt_session_has_peer (const gchar * peers, const gchar * address)
+{
+  using namespace libtorrent;
+  gchar **endpoints;
+  gboolean ret = FALSE;
+  gint i;
+
+  if (!peers)
+    return FALSE;
+
+  endpoints = g_strsplit (peers, ",", -1);
+  for (i = 0; endpoints[i] && !ret; i++) {
+    tcp::endpoint ep;
+
+    g_strstrip (endpoints[i]);
+    if (gst_bt_session_parse_peer (endpoints[i], ep))
+      ret = ep.address ().to_string () == address;
+  }
+  g_strfreev (endpoints);
+
+  return ret;
+}
+
+/* Start the DHT with the routing table of the state file, if any, and the
+ * routers to bootstrap it. Call it without the object lock, the state file
+ * is read synchronously
+ */
+void
+gst_bt_session_start_dht (GstObject * obj, gpointer session,
+    const gchar * state_file, const gchar * routers)
+{
+  using namespace libtorrent;
+  session *s = (libtorrent::session *) session;
+  gchar *contents;
+  gsize length;
+
+  /* the DHT shares the UDP socket of the listen port */
+  if (!s->is_listening ()) {
+    error_code ec;
+
+    s->listen_on (std::make_pair (DHT_PORT_MIN, DHT_PORT_MAX), ec);
+    if (ec)
+      GST_WARNING_OBJECT (obj, "Failed to listen for the DHT: %s",
+          ec.message ().c_str ());
+  }
+
+  if (state_file && g_file_get_contents (state_file, &contents, &length,
+      NULL)) {
+    lazy_entry e;
+    error_code ec;
+
+    if (lazy_bdecode (contents, contents + length, e, ec) == 0) {
+      GST_DEBUG_OBJECT (obj, "Loading the DHT state from '%s'", state_file);
+      s->load_state (e);
+    } else {
+      GST_WARNING_OBJECT (obj, "Invalid DHT state on '%s': %s", state_file,
+          ec.message ().c_str ());
+    }
+    g_free (contents);
+  }
+
+  if (routers) {
+    gchar **endpoints;
+    gint i;
+
+    endpoints = g_strsplit (routers, ",", -1);
+    for (i = 0; endpoints[i]; i++) {
+      gchar *host;
+      gint port;
+
+      g_strstrip (endpoints[i]);
+      if (*endpoints[i] == '\0')
+        continue;
+
+      if (!gst_bt_session_split_endpoint (endpoints[i], &host, &port)) {
+        GST_WARNING_OBJECT (obj, "Invalid DHT router '%s'", endpoints[i]);
+        continue;
+      }
+
+      GST_DEBUG_OBJECT (obj, "Adding the DHT router %s:%d", host, port);
+      s->add_dht_router (std::make_pair (std::string (host), port));
+      g_free (host);
+    }
+    g_strfreev (endpoints);
+  }
+
+  s->start_dht ();
+}
+
+/* Save the DHT routing table. The file is replaced atomically given that
+ * several elements might be saving it at the same time. Call it without the
+ * object lock
+ */
+void
+gst_bt_session_save_dht (GstObject * obj, gpointer session,
+    const gchar * state_file)
+{
+  using namespace libtorrent;
+  session *s = (libtorrent::session *) session;
+  std::vector<char> buf;
+  GError *err = NULL;
+  gchar *dir;
+  entry e;
+
+  if (!state_file || !*state_file)
+    return;
+
+  s->save_state (e, session::save_dht_state);
+  /* the DHT was not running, do not lose the previous state */
+  if (!e.find_key ("dht state"))
+    return;
+
+  bencode (std::back_inserter (buf), e);
+
+  dir = g_path_get_dirname (state_file);
+  g_mkdir_with_parents (dir, 0755);
+  g_free (dir);
+
+  if (!g_file_set_contents (state_file, &buf[0], buf.size (), &err)) {
+    GST_WARNING_OBJECT (obj, "Can not save the DHT state on '%s': %s",
+        state_file, err->message);
+    g_error_free (err);
+    return;
+  }
+  GST_DEBUG_OBJECT (obj, "DHT state saved on '%s'", state_file);
+}
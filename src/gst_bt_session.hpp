@@ -0,0 +1,54 @@
+/* Gst-Bt - BitTorrent related GStreamer elements
+ * Copyright (C) 2015 Jorge Luis Zapata
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GST_BT_SESSION_H
+#define GST_BT_SESSION_H
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+#define GST_TYPE_BT_SESSION_PROFILE (gst_bt_session_profile_get_type())
+
+/* Named sets of libtorrent settings */
+typedef enum _GstBtSessionProfile {
+  GST_BT_SESSION_PROFILE_DEFAULT,
+  GST_BT_SESSION_PROFILE_LOW_LATENCY_STREAMING,
+  GST_BT_SESSION_PROFILE_BULK_DOWNLOAD,
+  GST_BT_SESSION_PROFILE_LOW_MEMORY_EMBEDDED,
+} GstBtSessionProfile;
+
+GType gst_bt_session_profile_get_type (void);
+
+void gst_bt_session_apply_settings (GstObject * obj, gpointer session,
+    GstBtSessionProfile profile, const GstStructure * settings);
+gint gst_bt_session_connect_peers (GstObject * obj, gpointer session,
+    const gchar * peers);
+gboolean gst_bt_session_has_peer (const gchar * peers, const gchar * address);
+void gst_bt_session_start_dht (GstObject * obj, gpointer session,
+    const gchar * state_file, const gchar * routers);
+void gst_bt_session_save_dht (GstObject * obj, gpointer session,
+    const gchar * state_file);
+
+G_END_DECLS
+
+#endif
@@ -29,6 +29,13 @@
 #include "libtorrent/alert_types.hpp"
 #include "libtorrent/create_torrent.hpp"
 
+#define DEFAULT_SESSION_PROFILE GST_BT_SESSION_PROFILE_DEFAULT
+#define DEFAULT_PEERS NULL
+#define DEFAULT_METADATA_TIMEOUT 0
+#define DEFAULT_DHT_STATE_DIR "gst-bt"
+#define DEFAULT_DHT_STATE_FILE "dht-state"
+#define DEFAULT_DHT_ROUTERS NULL
+
 GST_DEBUG_CATEGORY_EXTERN (gst_bt_src_debug);
 #define GST_CAT_DEFAULT gst_bt_src_debug
 
@@ -120,6 +127,13 @@ gst_bt_src_uri_handler_init (gpointer g_iface, gpointer iface_data)
 enum {
   PROP_0,
   PROP_URI,
+  PROP_SESSION_PROFILE,
+  PROP_SESSION_SETTINGS,
+  PROP_PEERS,
+  PROP_DHT_STATE_FILE,
+  PROP_DHT_ROUTERS,
+  PROP_URIS,
+  PROP_METADATA_TIMEOUT,
 };
 
 #if HAVE_GST_1
@@ -169,6 +183,25 @@ gst_bt_src_set_uri (GstBtSrc * thiz, const gchar * uri)
   thiz->uri = g_strdup (uri);
 }
 
+/* Remove every torrent of the race, the loop finishes once libtorrent has
+ * removed all of them
+ */
+static void
+gst_bt_src_cancel (GstBtSrc * thiz)
+{
+  using namespace libtorrent;
+  session *s;
+  std::vector<torrent_handle> torrents;
+  std::vector<torrent_handle>::iterator it;
+
+  s = (session *)thiz->session;
+  torrents = s->get_torrents ();
+  for (it = torrents.begin (); it != torrents.end (); ++it) {
+    it->pause ();
+    s->remove_torrent (*it);
+  }
+}
+
 /* thread reading messages from libtorrent */
 static gboolean
 gst_bt_src_handle_alert (GstBtSrc * thiz, libtorrent::alert * a)
@@ -182,39 +215,91 @@ gst_bt_src_handle_alert (GstBtSrc * thiz, libtorrent::alert * a)
     case add_torrent_alert::alert_type:
       {
         add_torrent_alert *p = alert_cast<add_torrent_alert>(a);
+        gboolean resolved;
+        gint sources;
 
         if (p->error) {
-          GST_ELEMENT_ERROR (thiz, STREAM, FAILED,
-              ("Error while adding the torrent."),
-              ("libtorrent says %s", p->error.message ().c_str ()));
-          ret = TRUE;
+          GST_WARNING_OBJECT (thiz, "Error while adding the torrent: %s",
+              p->error.message ().c_str ());
+
+          GST_OBJECT_LOCK (thiz);
+          sources = --thiz->sources;
+          resolved = thiz->resolved;
+          GST_OBJECT_UNLOCK (thiz);
+
+          /* the last source failed */
+          if (!sources) {
+            if (!resolved) {
+              GST_ELEMENT_ERROR (thiz, STREAM, FAILED,
+                  ("Error while adding the torrent."),
+                  ("libtorrent says %s", p->error.message ().c_str ()));
+            }
+            ret = TRUE;
+          }
+        } else {
+          gchar *peers;
+
+          GST_OBJECT_LOCK (thiz);
+          resolved = thiz->resolved;
+          peers = g_strdup (thiz->peers);
+          GST_OBJECT_UNLOCK (thiz);
+
+          if (resolved) {
+            /* too late, the race is over */
+            ((session *)thiz->session)->remove_torrent (p->handle);
+          } else {
+            /* fetch the metadata from the known peers first */
+            gst_bt_session_connect_peers (GST_OBJECT (thiz), thiz->session,
+                peers);
+          }
+          g_free (peers);
         }
         break;
       }
 
     case torrent_removed_alert::alert_type:
-      /* a safe cleanup, the torrent has been removed */
-      ret = TRUE;
-      break;
+      {
+        gint sources;
+
+        /* a safe cleanup, every torrent has been removed */
+        GST_OBJECT_LOCK (thiz);
+        sources = --thiz->sources;
+        GST_OBJECT_UNLOCK (thiz);
+        if (!sources)
+          ret = TRUE;
+        break;
+      }
 
     case metadata_received_alert::alert_type:
       {
         GstFlowReturn flow;
         metadata_received_alert *p = alert_cast<metadata_received_alert>(a);
-        session *s;
         torrent_handle h = p->handle;
-        torrent_info ti = h.get_torrent_info ();
         std::vector<char> buffer;
         GstBuffer *buf;
         GstPad *pad;
         guint8 *data;
+        gboolean resolved;
 #if HAVE_GST_1
         GstMapInfo mi;
 #endif
 
-        s = (session *)thiz->session;
-        h.pause ();
-        s->remove_torrent (h);
+        GST_OBJECT_LOCK (thiz);
+        resolved = thiz->resolved;
+        thiz->resolved = TRUE;
+        GST_OBJECT_UNLOCK (thiz);
+
+        /* another source won the race */
+        if (resolved)
+          break;
+
+        torrent_info ti = h.get_torrent_info ();
+        GST_INFO_OBJECT (thiz, "Metadata of '%s' received after %"
+            GST_TIME_FORMAT, ti.name ().c_str (), GST_TIME_ARGS (
+            gst_util_get_timestamp () - thiz->started));
+
+        /* we only need the metadata, cancel every source */
+        gst_bt_src_cancel (thiz);
 
         create_torrent ct(ti);
         entry te = ct.generate();
@@ -258,6 +343,29 @@ gst_bt_src_handle_alert (GstBtSrc * thiz, libtorrent::alert * a)
   return ret;
 }
 
+/* Give up if no source has resolved the metadata in time */
+static void
+gst_bt_src_check_timeout (GstBtSrc * thiz)
+{
+  GstClockTime elapsed;
+  guint timeout;
+
+  GST_OBJECT_LOCK (thiz);
+  timeout = thiz->metadata_timeout;
+  elapsed = gst_util_get_timestamp () - thiz->started;
+  if (thiz->resolved || !timeout || elapsed < timeout * GST_MSECOND) {
+    GST_OBJECT_UNLOCK (thiz);
+    return;
+  }
+  thiz->resolved = TRUE;
+  GST_OBJECT_UNLOCK (thiz);
+
+  GST_ELEMENT_ERROR (thiz, RESOURCE, NOT_FOUND,
+      ("Timeout while resolving the metadata."),
+      ("No metadata received after %u ms", timeout));
+  gst_bt_src_cancel (thiz);
+}
+
 static void
 gst_bt_src_loop (gpointer user_data)
 {
@@ -269,7 +377,8 @@ gst_bt_src_loop (gpointer user_data)
     session *s;
     s = (session *)thiz->session;
 
-    if (s->wait_for_alert (libtorrent::seconds(10)) != NULL) {
+    /* wake up often enough to honour the metadata timeout */
+    if (s->wait_for_alert (libtorrent::seconds(1)) != NULL) {
       std::deque<alert*> alerts;
       s->pop_alerts(&alerts);
 
@@ -283,6 +392,9 @@ gst_bt_src_loop (gpointer user_data)
       }
       alerts.clear();
     }
+
+    if (!thiz->finished)
+      gst_bt_src_check_timeout (thiz);
   }
   gst_task_stop (thiz->task);
 }
@@ -290,21 +402,16 @@ gst_bt_src_loop (gpointer user_data)
 static void
 gst_bt_src_task_cleanup (GstBtSrc * thiz)
 {
-  using namespace libtorrent;
-  session *s;
-  std::vector<torrent_handle> torrents;
-
-  s = (session *)thiz->session;
-  torrents = s->get_torrents ();
-
-  if (torrents.size () < 1) {
+  GST_OBJECT_LOCK (thiz);
+  /* the sources still being added are removed as soon as they are */
+  thiz->resolved = TRUE;
+  if (!thiz->sources) {
     /* nothing added, stop the task directly */
     thiz->finished = TRUE;
-  } else {
-    torrent_handle h;
-    h = torrents[0];
-    s->remove_torrent (h);
   }
+  GST_OBJECT_UNLOCK (thiz);
+
+  gst_bt_src_cancel (thiz);
 
   /* given that the pads are removed on the parent class at the paused
    * to ready state, we need to exit the task and wait for it
@@ -330,31 +437,117 @@ gst_bt_src_task_setup (GstBtSrc * thiz)
   gst_task_start (thiz->task);
 }
 
-static gboolean
-gst_bt_src_setup (GstBtSrc * thiz)
+/* Parse a magnet, the ones of the same torrent are merged so the race is
+ * between different torrents only
+ */
+static void
+gst_bt_src_add_source (GstBtSrc * thiz, const gchar * uri,
+    std::vector<libtorrent::add_torrent_params> & sources)
 {
   using namespace libtorrent;
-  session *session;
+  std::vector<add_torrent_params>::iterator it;
   add_torrent_params tp;
   error_code ec;
 
-  if (!thiz->uri)
+  parse_magnet_uri (uri, tp, ec);
+  if (ec) {
+    GST_WARNING_OBJECT (thiz, "Invalid magnet '%s': %s", uri,
+        ec.message ().c_str ());
+    return;
+  }
+
+  for (it = sources.begin (); it != sources.end (); ++it) {
+    if (it->info_hash == tp.info_hash) {
+      it->trackers.insert (it->trackers.end (), tp.trackers.begin (),
+          tp.trackers.end ());
+      return;
+    }
+  }
+  sources.push_back (tp);
+}
+
+static gboolean
+gst_bt_src_setup (GstBtSrc * thiz)
+{
+  using namespace libtorrent;
+  session *session;
+  std::vector<add_torrent_params> sources;
+  std::vector<add_torrent_params>::iterator it;
+  GstBtSessionProfile profile;
+  GstStructure *settings;
+  gchar *state_file;
+  gchar *routers;
+  gint i;
+
+  GST_OBJECT_LOCK (thiz);
+  if (thiz->uri)
+    gst_bt_src_add_source (thiz, thiz->uri, sources);
+  for (i = 0; thiz->uris && thiz->uris[i]; i++)
+    gst_bt_src_add_source (thiz, thiz->uris[i], sources);
+
+  if (sources.empty ()) {
+    gboolean has_uri = thiz->uri || (thiz->uris && thiz->uris[0]);
+
+    GST_OBJECT_UNLOCK (thiz);
+    if (has_uri) {
+      GST_ELEMENT_ERROR (thiz, RESOURCE, NOT_FOUND,
+          ("No valid magnet URI."), (NULL));
+    } else {
+      GST_ELEMENT_ERROR (thiz, RESOURCE, NOT_FOUND,
+          ("No magnet URI set."), (NULL));
+    }
     return FALSE;
+  }
 
+  profile = thiz->session_profile;
+  settings = thiz->session_settings ?
+      gst_structure_copy (thiz->session_settings) : NULL;
+  state_file = g_strdup (thiz->dht_state_file);
+  routers = g_strdup (thiz->dht_routers);
+
+  thiz->sources = sources.size ();
+  thiz->resolved = FALSE;
+  thiz->started = gst_util_get_timestamp ();
+  GST_OBJECT_UNLOCK (thiz);
+
+  gst_bt_session_apply_settings (GST_OBJECT (thiz), thiz->session, profile,
+      settings);
+  if (settings)
+    gst_structure_free (settings);
+
+  /* the metadata is found faster with a warm routing table */
+  gst_bt_session_start_dht (GST_OBJECT (thiz), thiz->session, state_file,
+      routers);
+  g_free (state_file);
+  g_free (routers);
+
+  thiz->finished = FALSE;
   gst_bt_src_task_setup (thiz);
 
-  /* set the magnet */
+  /* race every source, the first metadata received wins */
+  GST_INFO_OBJECT (thiz, "Resolving the metadata from %d sources",
+      (gint) sources.size ());
   session = (libtorrent::session *)thiz->session;
-  parse_magnet_uri (thiz->uri, tp, ec);
-  session->async_add_torrent (tp);
-  /* TODO check the error */
-  return FALSE;
+  for (it = sources.begin (); it != sources.end (); ++it)
+    session->async_add_torrent (*it);
+
+  return TRUE;
 }
 
 static void
 gst_bt_src_cleanup (GstBtSrc * thiz)
 {
+  gchar *state_file;
+
   gst_bt_src_task_cleanup (thiz);
+
+  /* keep the routing table for the next sessions */
+  GST_OBJECT_LOCK (thiz);
+  state_file = g_strdup (thiz->dht_state_file);
+  GST_OBJECT_UNLOCK (thiz);
+
+  gst_bt_session_save_dht (GST_OBJECT (thiz), thiz->session, state_file);
+  g_free (state_file);
 }
 
 static GstStateChangeReturn
@@ -367,7 +560,8 @@ gst_bt_src_change_state (GstElement * element, GstStateChange transition)
 
   switch (transition) {
     case GST_STATE_CHANGE_READY_TO_PAUSED:
-      gst_bt_src_setup (thiz);
+      if (!gst_bt_src_setup (thiz))
+        return GST_STATE_CHANGE_FAILURE;
       break;
 
     default:
@@ -412,6 +606,15 @@ gst_bt_src_dispose (GObject * object)
   }
 
   g_free (thiz->uri);
+  g_free (thiz->peers);
+  g_free (thiz->dht_state_file);
+  g_free (thiz->dht_routers);
+  g_strfreev (thiz->uris);
+
+  if (thiz->session_settings) {
+    gst_structure_free (thiz->session_settings);
+    thiz->session_settings = NULL;
+  }
 
   G_OBJECT_CLASS (gst_bt_src_parent_class)->dispose (object);
 }
@@ -431,6 +634,54 @@ gst_bt_src_set_property (GObject * object, guint prop_id,
       gst_bt_src_set_uri (thiz, g_value_get_string (value));
       break;
 
+    case PROP_SESSION_PROFILE:
+      GST_OBJECT_LOCK (thiz);
+      thiz->session_profile = (GstBtSessionProfile) g_value_get_enum (value);
+      GST_OBJECT_UNLOCK (thiz);
+      break;
+
+    case PROP_SESSION_SETTINGS:
+      GST_OBJECT_LOCK (thiz);
+      if (thiz->session_settings)
+        gst_structure_free (thiz->session_settings);
+      thiz->session_settings = (GstStructure *) g_value_dup_boxed (value);
+      GST_OBJECT_UNLOCK (thiz);
+      break;
+
+    case PROP_PEERS:
+      GST_OBJECT_LOCK (thiz);
+      g_free (thiz->peers);
+      thiz->peers = g_value_dup_string (value);
+      GST_OBJECT_UNLOCK (thiz);
+      break;
+
+    case PROP_DHT_STATE_FILE:
+      GST_OBJECT_LOCK (thiz);
+      g_free (thiz->dht_state_file);
+      thiz->dht_state_file = g_value_dup_string (value);
+      GST_OBJECT_UNLOCK (thiz);
+      break;
+
+    case PROP_DHT_ROUTERS:
+      GST_OBJECT_LOCK (thiz);
+      g_free (thiz->dht_routers);
+      thiz->dht_routers = g_value_dup_string (value);
+      GST_OBJECT_UNLOCK (thiz);
+      break;
+
+    case PROP_URIS:
+      GST_OBJECT_LOCK (thiz);
+      g_strfreev (thiz->uris);
+      thiz->uris = (gchar **) g_value_dup_boxed (value);
+      GST_OBJECT_UNLOCK (thiz);
+      break;
+
+    case PROP_METADATA_TIMEOUT:
+      GST_OBJECT_LOCK (thiz);
+      thiz->metadata_timeout = g_value_get_uint (value);
+      GST_OBJECT_UNLOCK (thiz);
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -451,6 +702,48 @@ gst_bt_src_get_property (GObject * object, guint prop_id, GValue * value,
       g_value_set_string (value, thiz->uri);
       break;
 
+    case PROP_SESSION_PROFILE:
+      GST_OBJECT_LOCK (thiz);
+      g_value_set_enum (value, thiz->session_profile);
+      GST_OBJECT_UNLOCK (thiz);
+      break;
+
+    case PROP_SESSION_SETTINGS:
+      GST_OBJECT_LOCK (thiz);
+      g_value_set_boxed (value, thiz->session_settings);
+      GST_OBJECT_UNLOCK (thiz);
+      break;
+
+    case PROP_PEERS:
+      GST_OBJECT_LOCK (thiz);
+      g_value_set_string (value, thiz->peers);
+      GST_OBJECT_UNLOCK (thiz);
+      break;
+
+    case PROP_DHT_STATE_FILE:
+      GST_OBJECT_LOCK (thiz);
+      g_value_set_string (value, thiz->dht_state_file);
+      GST_OBJECT_UNLOCK (thiz);
+      break;
+
+    case PROP_DHT_ROUTERS:
+      GST_OBJECT_LOCK (thiz);
+      g_value_set_string (value, thiz->dht_routers);
+      GST_OBJECT_UNLOCK (thiz);
+      break;
+
+    case PROP_URIS:
+      GST_OBJECT_LOCK (thiz);
+      g_value_set_boxed (value, thiz->uris);
+      GST_OBJECT_UNLOCK (thiz);
+      break;
+
+    case PROP_METADATA_TIMEOUT:
+      GST_OBJECT_LOCK (thiz);
+      g_value_set_uint (value, thiz->metadata_timeout);
+      GST_OBJECT_UNLOCK (thiz);
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -462,6 +755,7 @@ gst_bt_src_class_init (GstBtSrcClass * klass)
 {
   GObjectClass *gobject_class;
   GstElementClass *element_class;
+  gchar *dht_state_file;
 
   gobject_class = (GObjectClass *) klass;
   element_class = (GstElementClass *) klass;
@@ -476,6 +770,45 @@ gst_bt_src_class_init (GstBtSrcClass * klass)
       g_param_spec_string ("uri", "Magnet file URI",
           "URI of the magnet file", NULL,
           (GParamFlags)(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+  g_object_class_install_property (gobject_class, PROP_SESSION_PROFILE,
+      g_param_spec_enum ("session-profile", "Session profile",
+          "Set of libtorrent settings to start the session with",
+          GST_TYPE_BT_SESSION_PROFILE, DEFAULT_SESSION_PROFILE,
+          (GParamFlags)(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+  g_object_class_install_property (gobject_class, PROP_SESSION_SETTINGS,
+      g_param_spec_boxed ("session-settings", "Session settings",
+          "libtorrent settings applied on top of the session profile, "
+          "i.e \"settings, cache-size=(int)1024\"", GST_TYPE_STRUCTURE,
+          (GParamFlags)(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+  g_object_class_install_property (gobject_class, PROP_PEERS,
+      g_param_spec_string ("peers", "Peers",
+          "Comma separated list of address:port peers to connect to as soon "
+          "as the torrent is added", DEFAULT_PEERS,
+          (GParamFlags)(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+  /* the same default every instance starts with */
+  dht_state_file = g_build_filename (g_get_user_cache_dir (),
+      DEFAULT_DHT_STATE_DIR, DEFAULT_DHT_STATE_FILE, NULL);
+  g_object_class_install_property (gobject_class, PROP_DHT_STATE_FILE,
+      g_param_spec_string ("dht-state-file", "DHT state file",
+          "File to load the DHT routing table from and save it to, shared "
+          "by every instance (NULL = do not persist it)", dht_state_file,
+          (GParamFlags)(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+  g_free (dht_state_file);
+  g_object_class_install_property (gobject_class, PROP_DHT_ROUTERS,
+      g_param_spec_string ("dht-routers", "DHT routers",
+          "Comma separated list of host:port nodes to bootstrap the DHT "
+          "from", DEFAULT_DHT_ROUTERS,
+          (GParamFlags)(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+  g_object_class_install_property (gobject_class, PROP_URIS,
+      g_param_spec_boxed ("uris", "Magnet URIs",
+          "Equivalent magnet URIs resolved at the same time along with the "
+          "uri, the first one to get the metadata wins", G_TYPE_STRV,
+          (GParamFlags)(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+  g_object_class_install_property (gobject_class, PROP_METADATA_TIMEOUT,
+      g_param_spec_uint ("metadata-timeout", "Metadata timeout",
+          "Milliseconds to wait for the metadata before failing "
+          "(0 = wait forever)", 0, G_MAXUINT, DEFAULT_METADATA_TIMEOUT,
+          (GParamFlags)(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
 
   /* initialize the element class */
   gst_element_class_add_pad_template (element_class,
@@ -512,4 +845,12 @@ gst_bt_src_init (GstBtSrc * thiz)
 #else
   g_static_rec_mutex_init (&thiz->task_lock);
 #endif
+
+  /* default properties */
+  thiz->session_profile = DEFAULT_SESSION_PROFILE;
+  thiz->peers = DEFAULT_PEERS;
+  thiz->metadata_timeout = DEFAULT_METADATA_TIMEOUT;
+  thiz->dht_state_file = g_build_filename (g_get_user_cache_dir (),
+      DEFAULT_DHT_STATE_DIR, DEFAULT_DHT_STATE_FILE, NULL);
+  thiz->dht_routers = g_strdup (DEFAULT_DHT_ROUTERS);
 }
@@ -24,6 +24,7 @@
 #endif
 
 #include <gst/gst.h>
+#include "gst_bt_session.hpp"
 
 G_BEGIN_DECLS
 
@@ -42,10 +43,22 @@ typedef struct _GstBtSrc
 {
   GstElement parent;
   gpointer session;
+  GstBtSessionProfile session_profile;
+  GstStructure *session_settings;
   gchar *uri;
+  gchar **uris;
+  guint metadata_timeout;
+  gchar *peers;
+  gchar *dht_state_file;
+  gchar *dht_routers;
 
   gboolean finished;
 
+  /* the metadata race, protected by the object lock */
+  gint sources;
+  gboolean resolved;
+  GstClockTime started;
+
   GstTask *task;
 #if HAVE_GST_1
   GRecMutex task_lock;
@@ -0,0 +1,80 @@
+/* Gst-Bt - BitTorrent related GStreamer elements
+ * Copyright (C) 2015 Jorge Luis Zapata
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "gst_bt_trace.h"
+
+#if GST_BT_TRACER
+/* The tracer does not hook into the core, the trace points log its record
+ * directly, it only exists to create the record once enabled
+ */
+typedef struct _GstBtTracer
+{
+  GstTracer parent;
+} GstBtTracer;
+
+typedef struct _GstBtTracerClass
+{
+  GstTracerClass parent_class;
+} GstBtTracerClass;
+
+GstTracerRecord *gst_bt_trace_record = NULL;
+
+G_DEFINE_TYPE (GstBtTracer, gst_bt_tracer, GST_TYPE_TRACER);
+
+static void
+gst_bt_tracer_class_init (GstBtTracerClass * klass)
+{
+  gst_bt_trace_record = gst_tracer_record_new ("bt-piece.class",
+      "point", GST_TYPE_STRUCTURE, gst_structure_new ("value",
+          "type", G_TYPE_GTYPE, G_TYPE_STRING,
+          "description", G_TYPE_STRING, "Point of the piece lifecycle",
+          NULL),
+      "stream", GST_TYPE_STRUCTURE, gst_structure_new ("value",
+          "type", G_TYPE_GTYPE, G_TYPE_INT,
+          "description", G_TYPE_STRING, "Index of the file",
+          NULL),
+      "piece", GST_TYPE_STRUCTURE, gst_structure_new ("value",
+          "type", G_TYPE_GTYPE, G_TYPE_INT,
+          "description", G_TYPE_STRING, "Index of the piece",
+          NULL),
+      "ts", GST_TYPE_STRUCTURE, gst_structure_new ("value",
+          "type", G_TYPE_GTYPE, G_TYPE_UINT64,
+          "description", G_TYPE_STRING, "Monotonic time of the point",
+          NULL),
+      NULL);
+}
+
+static void
+gst_bt_tracer_init (GstBtTracer * thiz)
+{
+}
+#endif
+
+gboolean
+gst_bt_trace_init (GstPlugin * plugin)
+{
+#if GST_BT_TRACER
+  if (!gst_tracer_register (plugin, "bttrace", gst_bt_tracer_get_type ()))
+    return FALSE;
+#endif
+  return TRUE;
+}
@@ -0,0 +1,93 @@
+/* Gst-Bt - BitTorrent related GStreamer elements
+ * Copyright (C) 2015 Jorge Luis Zapata
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GST_BT_TRACE_H
+#define GST_BT_TRACE_H
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <gst/gst.h>
+
+#if HAVE_USDT
+#include <sys/sdt.h>
+#endif
+
+/* Trace points of the piece lifecycle. Every point is identified by its name,
+ * the stream (file index) and the piece index. They are logged on the
+ * "bttrace" debug category with a monotonic timestamp and, when compiled
+ * with --enable-usdt, fired as USDT probes of the gst_bt provider too.
+ * With GStreamer 1.8 or newer the plugin also registers the "bttrace"
+ * tracer, once enabled with GST_TRACERS=bttrace every point is logged as a
+ * "bt-piece" record next to the records of the core tracers.
+ *
+ * The points are:
+ * piece_priority: the piece priority has been raised for streaming
+ * piece_finished: the piece has been downloaded and checked
+ * piece_hash_failed: the piece failed its hash check and is requested again
+ * piece_stalled: the playhead piece is late and its download is escalated
+ * piece_read_requested: a read of the piece has been requested
+ * piece_read: the piece data has been read from the storage
+ * piece_queued: the piece has been queued for the stream thread
+ * piece_popped: the stream thread has taken the piece
+ * piece_pushed: the piece has been pushed downstream
+ */
+GST_DEBUG_CATEGORY_EXTERN (gst_bt_trace_debug);
+
+/* plugins can register tracers since 1.8 */
+#if HAVE_GST_1 && GST_CHECK_VERSION (1, 8, 0)
+#define GST_BT_TRACER 1
+#endif
+
+G_BEGIN_DECLS
+
+gboolean gst_bt_trace_init (GstPlugin * plugin);
+
+#if GST_BT_TRACER
+/* only created once the tracer is enabled */
+extern GstTracerRecord *gst_bt_trace_record;
+
+#define GST_BT_TRACE_RECORD(point, stream, piece) G_STMT_START { \
+    if (G_UNLIKELY (gst_bt_trace_record)) \
+      gst_tracer_record_log (gst_bt_trace_record, #point, (gint) (stream), \
+          (gint) (piece), (guint64) gst_util_get_timestamp ()); \
+} G_STMT_END
+#else
+#define GST_BT_TRACE_RECORD(point, stream, piece)
+#endif
+
+G_END_DECLS
+
+#if HAVE_USDT
+#define GST_BT_TRACE_PROBE(point, stream, piece) \
+    DTRACE_PROBE2 (gst_bt, point, stream, piece)
+#else
+#define GST_BT_TRACE_PROBE(point, stream, piece)
+#endif
+
+#define GST_BT_TRACE(obj, point, stream, piece) G_STMT_START { \
+    GST_BT_TRACE_PROBE (point, stream, piece); \
+    GST_BT_TRACE_RECORD (point, stream, piece); \
+    GST_CAT_LOG_OBJECT (gst_bt_trace_debug, obj, \
+        #point " stream=%d piece=%d ts=%" G_GUINT64_FORMAT, \
+        (gint) (stream), (gint) (piece), \
+        (guint64) gst_util_get_timestamp ()); \
+} G_STMT_END
+
+#endif
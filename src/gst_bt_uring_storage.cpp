@@ -0,0 +1,692 @@
+/* Gst-Bt - BitTorrent related GStreamer elements
+ * Copyright (C) 2015 Jorge Luis Zapata
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A libtorrent storage doing the file I/O through io_uring. The writes are
+ * copied and queued without waiting, they are submitted in batches and
+ * completed in the background, so the disk thread can go on with the next
+ * block. The reads are split in the file slices they cover, all of them are
+ * submitted at once and the call waits for them, after any queued write on
+ * the same range. Short transfers are resubmitted for the remaining bytes,
+ * the pad files are never touched and read as zeros, and a failed write is
+ * reported on the next call to the storage
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#if HAVE_IO_URING
+
+#include <gst/gst.h>
+#include <glib/gstdio.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <liburing.h>
+
+#include <list>
+#include <vector>
+#include <boost/shared_array.hpp>
+
+#include "gst_bt_uring_storage.hpp"
+#include "libtorrent/error_code.hpp"
+
+GST_DEBUG_CATEGORY_EXTERN (gst_bt_demux_debug);
+#define GST_CAT_DEFAULT gst_bt_demux_debug
+
+/* the pieces from this size on use O_DIRECT when enabled */
+#define DIRECT_PIECE_LENGTH (1024 * 1024)
+#define DIRECT_ALIGNMENT 4096
+/* submit the queued writes once any of these is reached */
+#define BATCH_ENTRIES 8
+#define BATCH_BYTES (1024 * 1024)
+
+/* A transfer of a file slice, resubmitted until every byte is done */
+typedef struct _GstBtUringRequest
+{
+  bool write;
+  int fd;
+  int file_index;
+  libtorrent::size_type offset;
+  size_t left;
+  std::vector<struct iovec> iov;
+  /* the copy of the written data */
+  boost::shared_array<char> data;
+  bool done;
+  int error;
+} GstBtUringRequest;
+
+class GstBtUringStorage : public libtorrent::storage_interface
+{
+public:
+  GstBtUringStorage (libtorrent::file_storage const & fs,
+      std::string const & path, int queue_depth, bool direct)
+      : fs (fs), save_path (path), queue_depth (queue_depth),
+      unsubmitted (0), unsubmitted_bytes (0), deferred_error (0),
+      fds (fs.num_files (), -1), direct_fds (fs.num_files (), -1)
+  {
+    int ret;
+
+    this->direct = direct && fs.piece_length () >= DIRECT_PIECE_LENGTH;
+    lock = g_mutex_new ();
+    ret = io_uring_queue_init (queue_depth, &ring, 0);
+    initialized = (ret == 0);
+    if (!initialized)
+      GST_ERROR ("Failed to setup io_uring: %s", g_strerror (-ret));
+  }
+
+  ~GstBtUringStorage ()
+  {
+    if (initialized) {
+      flush ();
+      io_uring_queue_exit (&ring);
+    }
+    close_files ();
+    g_mutex_free (lock);
+  }
+
+  bool initialize (bool allocate_files)
+  {
+    if (!initialized) {
+      set_error (save_path, libtorrent::error_code (ENOSYS,
+          libtorrent::get_posix_category ()));
+      return true;
+    }
+    return false;
+  }
+
+  bool has_any_file ()
+  {
+    int i;
+
+    for (i = 0; i < fs.num_files (); i++) {
+      std::string p = file_path (i);
+
+      if (fs.at (i).pad_file)
+        continue;
+      if (g_file_test (p.c_str (), G_FILE_TEST_EXISTS))
+        return true;
+    }
+    return false;
+  }
+
+  int readv (libtorrent::file::iovec_t const * bufs, int slot, int offset,
+      int num_bufs, int flags)
+  {
+    return read_slices (bufs, slot, offset, num_bufs);
+  }
+
+  int writev (libtorrent::file::iovec_t const * bufs, int slot, int offset,
+      int num_bufs, int flags)
+  {
+    return write_slices (bufs, slot, offset, num_bufs);
+  }
+
+  int read (char * buf, int slot, int offset, int size)
+  {
+    libtorrent::file::iovec_t b = { buf, (size_t) size };
+
+    return read_slices (&b, slot, offset, 1);
+  }
+
+  int write (const char * buf, int slot, int offset, int size)
+  {
+    libtorrent::file::iovec_t b = { (void *) buf, (size_t) size };
+
+    return write_slices (&b, slot, offset, 1);
+  }
+
+  libtorrent::size_type physical_offset (int slot, int offset)
+  {
+    return (libtorrent::size_type) slot * fs.piece_length () + offset;
+  }
+
+  bool move_storage (std::string const & path, int flags)
+  {
+    /* the demuxer never moves its temporary files */
+    set_error (path, libtorrent::error_code (ENOTSUP,
+        libtorrent::get_posix_category ()));
+    return true;
+  }
+
+  bool verify_resume_data (libtorrent::lazy_entry const & rd,
+      libtorrent::error_code & error)
+  {
+    return false;
+  }
+
+  bool write_resume_data (libtorrent::entry & rd) const
+  {
+    return false;
+  }
+
+  bool move_slot (int src_slot, int dst_slot)
+  {
+    /* only used on compact allocation */
+    return true;
+  }
+
+  bool swap_slots (int slot1, int slot2)
+  {
+    return true;
+  }
+
+  bool swap_slots3 (int slot1, int slot2, int slot3)
+  {
+    return true;
+  }
+
+  bool release_files ()
+  {
+    bool ret;
+
+    g_mutex_lock (lock);
+    flush ();
+    close_files ();
+    ret = check_deferred_error ();
+    g_mutex_unlock (lock);
+    return ret;
+  }
+
+  bool rename_file (int index, std::string const & new_filename)
+  {
+    /* the files are named as in the torrent */
+    set_error (new_filename, libtorrent::error_code (ENOTSUP,
+        libtorrent::get_posix_category ()));
+    return true;
+  }
+
+  bool delete_files ()
+  {
+    int i;
+
+    g_mutex_lock (lock);
+    flush ();
+    deferred_error = 0;
+    close_files ();
+    for (i = 0; i < fs.num_files (); i++) {
+      std::string p = file_path (i);
+
+      if (fs.at (i).pad_file)
+        continue;
+      g_remove (p.c_str ());
+    }
+    g_mutex_unlock (lock);
+    return false;
+  }
+
+private:
+  std::string file_path (int index)
+  {
+    gchar *p;
+    std::string ret;
+
+    p = g_build_filename (save_path.c_str (), fs.at (index).path.c_str (),
+        NULL);
+    ret = p;
+    g_free (p);
+    return ret;
+  }
+
+  int open_file (int index, bool use_direct)
+  {
+    std::vector<int> & v = use_direct ? direct_fds : fds;
+    std::string p;
+    gchar *dir;
+    int oflags = O_RDWR | O_CREAT;
+
+    if (v[index] >= 0)
+      return v[index];
+
+    p = file_path (index);
+    dir = g_path_get_dirname (p.c_str ());
+    g_mkdir_with_parents (dir, 0755);
+    g_free (dir);
+
+#ifdef O_DIRECT
+    if (use_direct)
+      oflags |= O_DIRECT;
+#endif
+    v[index] = open (p.c_str (), oflags, 0644);
+    if (v[index] < 0) {
+      set_error (p, libtorrent::error_code (errno,
+          libtorrent::get_posix_category ()));
+    }
+    return v[index];
+  }
+
+  void close_files ()
+  {
+    size_t i;
+
+    for (i = 0; i < fds.size (); i++) {
+      if (fds[i] >= 0)
+        close (fds[i]);
+      fds[i] = -1;
+      if (direct_fds[i] >= 0)
+        close (direct_fds[i]);
+      direct_fds[i] = -1;
+    }
+  }
+
+  /* whether every buffer and the file range can be used with O_DIRECT */
+  bool aligned (std::vector<struct iovec> const & iov,
+      libtorrent::size_type file_offset)
+  {
+    size_t i;
+
+    if (file_offset % DIRECT_ALIGNMENT)
+      return false;
+
+    for (i = 0; i < iov.size (); i++) {
+      if ((guintptr) iov[i].iov_base % DIRECT_ALIGNMENT)
+        return false;
+      if (iov[i].iov_len % DIRECT_ALIGNMENT)
+        return false;
+    }
+    return true;
+  }
+
+  /* report a failed background write, returns true if there was one */
+  bool check_deferred_error ()
+  {
+    if (!deferred_error)
+      return false;
+
+    set_error (deferred_file, libtorrent::error_code (deferred_error,
+        libtorrent::get_posix_category ()));
+    deferred_error = 0;
+    return true;
+  }
+
+  void prepare (GstBtUringRequest * req)
+  {
+    struct io_uring_sqe *sqe;
+
+    sqe = io_uring_get_sqe (&ring);
+    if (req->write)
+      io_uring_prep_writev (sqe, req->fd, &req->iov[0], req->iov.size (),
+          req->offset);
+    else
+      io_uring_prep_readv (sqe, req->fd, &req->iov[0], req->iov.size (),
+          req->offset);
+    io_uring_sqe_set_data (sqe, req);
+    unsubmitted++;
+    unsubmitted_bytes += req->left;
+  }
+
+  void submit (bool force)
+  {
+    if (!unsubmitted)
+      return;
+    if (!force && unsubmitted < BATCH_ENTRIES &&
+        unsubmitted_bytes < BATCH_BYTES)
+      return;
+
+    io_uring_submit (&ring);
+    unsubmitted = 0;
+    unsubmitted_bytes = 0;
+  }
+
+  /* skip the bytes already transferred */
+  static void advance (GstBtUringRequest * req, size_t bytes)
+  {
+    std::vector<struct iovec>::iterator it = req->iov.begin ();
+
+    req->offset += bytes;
+    req->left -= bytes;
+    while (bytes && it != req->iov.end ()) {
+      if (bytes < it->iov_len) {
+        it->iov_base = (char *) it->iov_base + bytes;
+        it->iov_len -= bytes;
+        break;
+      }
+      bytes -= it->iov_len;
+      ++it;
+    }
+    req->iov.erase (req->iov.begin (), it);
+  }
+
+  /* wait for one completion, resubmitting it if it was short */
+  void reap_one ()
+  {
+    struct io_uring_cqe *cqe;
+    GstBtUringRequest *req;
+    int res;
+    int err;
+
+    submit (true);
+    err = io_uring_wait_cqe (&ring, &cqe);
+    if (err < 0) {
+      if (err == -EINTR)
+        return;
+      /* nothing will complete anymore, fail everything in flight */
+      GST_ERROR ("Failed to wait for io_uring: %s", g_strerror (-err));
+      while (!inflight.empty ())
+        finish (inflight.front (), -err);
+      return;
+    }
+
+    req = (GstBtUringRequest *) io_uring_cqe_get_data (cqe);
+    res = cqe->res;
+    io_uring_cqe_seen (&ring, cqe);
+
+    if (res == -EINTR || res == -EAGAIN) {
+      prepare (req);
+      return;
+    }
+
+    if (res < 0) {
+      finish (req, -res);
+      return;
+    }
+
+    /* nothing more to read */
+    if (res == 0) {
+      finish (req, EIO);
+      return;
+    }
+
+    if ((size_t) res < req->left) {
+      GST_LOG ("Short %s of %d bytes, %" G_GSIZE_FORMAT " left",
+          req->write ? "write" : "read", res, req->left - res);
+      advance (req, res);
+      prepare (req);
+      return;
+    }
+
+    finish (req, 0);
+  }
+
+  void finish (GstBtUringRequest * req, int error)
+  {
+    inflight.remove (req);
+    req->error = error;
+    req->done = true;
+
+    if (!req->write)
+      return;
+
+    /* the writes are not waited for */
+    if (error && !deferred_error) {
+      deferred_error = error;
+      deferred_file = file_path (req->file_index);
+    }
+    delete req;
+  }
+
+  /* queue a request, waiting for room if every entry is in use */
+  void queue (GstBtUringRequest * req)
+  {
+    while ((int) inflight.size () >= queue_depth)
+      reap_one ();
+
+    inflight.push_back (req);
+    prepare (req);
+  }
+
+  /* wait for the requests in flight on a file range */
+  void wait_overlapping (int file_index, libtorrent::size_type offset,
+      libtorrent::size_type size)
+  {
+    for (;;) {
+      std::list<GstBtUringRequest *>::iterator it;
+      bool found = false;
+
+      for (it = inflight.begin (); it != inflight.end (); ++it) {
+        GstBtUringRequest *req = *it;
+
+        if (req->file_index != file_index)
+          continue;
+        if (req->offset >= offset + size ||
+            req->offset + (libtorrent::size_type) req->left <= offset)
+          continue;
+        found = true;
+        break;
+      }
+
+      if (!found)
+        return;
+      reap_one ();
+    }
+  }
+
+  void flush ()
+  {
+    while (!inflight.empty ())
+      reap_one ();
+  }
+
+  /* collect the part of the buffers a slice covers */
+  static void collect (libtorrent::file::iovec_t const * bufs, int num_bufs,
+      int & buf, size_t & buf_offset, libtorrent::size_type size,
+      std::vector<struct iovec> & iov)
+  {
+    while (size > 0 && buf < num_bufs) {
+      struct iovec v;
+
+      v.iov_base = (char *) bufs[buf].iov_base + buf_offset;
+      v.iov_len = bufs[buf].iov_len - buf_offset;
+      if ((libtorrent::size_type) v.iov_len > size)
+        v.iov_len = size;
+
+      iov.push_back (v);
+      size -= v.iov_len;
+      buf_offset += v.iov_len;
+      if (buf_offset == bufs[buf].iov_len) {
+        buf++;
+        buf_offset = 0;
+      }
+    }
+  }
+
+  int read_slices (libtorrent::file::iovec_t const * bufs, int slot,
+      int offset, int num_bufs)
+  {
+    std::vector<libtorrent::file_slice> slices;
+    std::vector<GstBtUringRequest *> requests;
+    int size = 0;
+    int buf = 0;
+    size_t buf_offset = 0;
+    int error = 0;
+    size_t i;
+
+    for (i = 0; i < (size_t) num_bufs; i++)
+      size += bufs[i].iov_len;
+
+    slices = fs.map_block (slot, offset, size);
+
+    g_mutex_lock (lock);
+    if (check_deferred_error ()) {
+      g_mutex_unlock (lock);
+      return -1;
+    }
+
+    for (i = 0; i < slices.size (); i++) {
+      GstBtUringRequest *req;
+      std::vector<struct iovec> iov;
+      size_t j;
+      int fd;
+
+      collect (bufs, num_bufs, buf, buf_offset, slices[i].size, iov);
+
+      /* never on disk */
+      if (fs.at (slices[i].file_index).pad_file) {
+        for (j = 0; j < iov.size (); j++)
+          memset (iov[j].iov_base, 0, iov[j].iov_len);
+        continue;
+      }
+
+      fd = open_file (slices[i].file_index, direct &&
+          aligned (iov, slices[i].offset));
+      if (fd < 0) {
+        error = -1;
+        break;
+      }
+
+      /* the data might still be on its way to the file */
+      wait_overlapping (slices[i].file_index, slices[i].offset,
+          slices[i].size);
+
+      req = new GstBtUringRequest;
+      req->write = false;
+      req->fd = fd;
+      req->file_index = slices[i].file_index;
+      req->offset = slices[i].offset;
+      req->left = slices[i].size;
+      req->iov = iov;
+      req->done = false;
+      req->error = 0;
+      requests.push_back (req);
+      queue (req);
+    }
+
+    /* wait for every read, even on error the buffers are in use */
+    for (i = 0; i < requests.size (); i++) {
+      GstBtUringRequest *req = requests[i];
+
+      while (!req->done)
+        reap_one ();
+
+      if (req->error && !error) {
+        set_error (file_path (req->file_index), libtorrent::error_code (
+            req->error, libtorrent::get_posix_category ()));
+        error = -1;
+      }
+      delete req;
+    }
+    g_mutex_unlock (lock);
+
+    return error ? -1 : size;
+  }
+
+  int write_slices (libtorrent::file::iovec_t const * bufs, int slot,
+      int offset, int num_bufs)
+  {
+    std::vector<libtorrent::file_slice> slices;
+    boost::shared_array<char> data;
+    libtorrent::file::iovec_t copy;
+    char *ptr;
+    void *mem = NULL;
+    int size = 0;
+    int buf = 0;
+    size_t buf_offset = 0;
+    size_t i;
+
+    for (i = 0; i < (size_t) num_bufs; i++)
+      size += bufs[i].iov_len;
+
+    /* the caller owns the buffers, copy them to complete in the
+     * background, aligned for O_DIRECT
+     */
+    if (posix_memalign (&mem, DIRECT_ALIGNMENT, size ? size : 1)) {
+      set_error (save_path, libtorrent::error_code (ENOMEM,
+          libtorrent::get_posix_category ()));
+      return -1;
+    }
+    data = boost::shared_array<char> ((char *) mem, free);
+    ptr = data.get ();
+    for (i = 0; i < (size_t) num_bufs; i++) {
+      memcpy (ptr, bufs[i].iov_base, bufs[i].iov_len);
+      ptr += bufs[i].iov_len;
+    }
+    copy.iov_base = data.get ();
+    copy.iov_len = size;
+
+    slices = fs.map_block (slot, offset, size);
+
+    g_mutex_lock (lock);
+    if (check_deferred_error ()) {
+      g_mutex_unlock (lock);
+      return -1;
+    }
+
+    for (i = 0; i < slices.size (); i++) {
+      GstBtUringRequest *req;
+      std::vector<struct iovec> iov;
+      int fd;
+
+      collect (&copy, 1, buf, buf_offset, slices[i].size, iov);
+
+      /* never on disk */
+      if (fs.at (slices[i].file_index).pad_file)
+        continue;
+
+      fd = open_file (slices[i].file_index, direct &&
+          aligned (iov, slices[i].offset));
+      if (fd < 0) {
+        g_mutex_unlock (lock);
+        return -1;
+      }
+
+      /* keep the writes on the same range in order */
+      wait_overlapping (slices[i].file_index, slices[i].offset,
+          slices[i].size);
+
+      req = new GstBtUringRequest;
+      req->write = true;
+      req->fd = fd;
+      req->file_index = slices[i].file_index;
+      req->offset = slices[i].offset;
+      req->left = slices[i].size;
+      req->iov = iov;
+      req->data = data;
+      req->done = false;
+      req->error = 0;
+      queue (req);
+    }
+    submit (false);
+    g_mutex_unlock (lock);
+
+    return size;
+  }
+
+  libtorrent::file_storage const & fs;
+  std::string save_path;
+  int queue_depth;
+  bool direct;
+  bool initialized;
+  struct io_uring ring;
+  /* the requests submitted or queued for submission */
+  std::list<GstBtUringRequest *> inflight;
+  int unsubmitted;
+  size_t unsubmitted_bytes;
+  /* the first failed write not reported yet */
+  int deferred_error;
+  std::string deferred_file;
+  std::vector<int> fds;
+  std::vector<int> direct_fds;
+  GMutex *lock;
+};
+
+libtorrent::storage_interface *
+gst_bt_uring_storage_new (libtorrent::file_storage const & fs,
+    libtorrent::file_storage const * mapped, std::string const & path,
+    libtorrent::file_pool & fp, std::vector<boost::uint8_t> const & prio,
+    int queue_depth, bool direct)
+{
+  return new GstBtUringStorage (mapped ? *mapped : fs, path, queue_depth,
+      direct);
+}
+
+#endif
@@ -0,0 +1,42 @@
+/* Gst-Bt - BitTorrent related GStreamer elements
+ * Copyright (C) 2015 Jorge Luis Zapata
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GST_BT_URING_STORAGE_H
+#define GST_BT_URING_STORAGE_H
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#if HAVE_IO_URING
+
+#include "libtorrent/storage.hpp"
+
+/* Storage on files under path, doing the file I/O through io_uring with up to
+ * queue_depth requests in flight. If direct is set, the aligned accesses of
+ * pieces of 1MiB or more bypass the page cache
+ */
+libtorrent::storage_interface * gst_bt_uring_storage_new (
+    libtorrent::file_storage const & fs,
+    libtorrent::file_storage const * mapped, std::string const & path,
+    libtorrent::file_pool & fp, std::vector<boost::uint8_t> const & prio,
+    int queue_depth, bool direct);
+
+#endif
+
+#endif
@@ -0,0 +1,108 @@
+# The plugin is taken from the build tree with its own registry
+TESTS_ENVIRONMENT = \
+GST_PLUGIN_PATH=$(top_builddir)/src/.libs \
+GST_REGISTRY=$(top_builddir)/test/registry.bin
+
+CLEANFILES += test/registry.bin
+
+check_PROGRAMS += test/gst_bt_bench
+
+TESTS += test/gst_bt_bench
+
+test_gst_bt_bench_SOURCES = \
+test/gst_bt_test.cpp \
+test/gst_bt_test.hpp \
+test/gst_bt_bench.cpp
+
+test_gst_bt_bench_CXXFLAGS = \
+-I$(top_srcdir)/src \
+$(GST_BT_CFLAGS)
+
+test_gst_bt_bench_LDADD = \
+$(GST_BT_LIBS)
+
+check_PROGRAMS += test/gst_bt_sim
+
+TESTS += test/gst_bt_sim
+
+test_gst_bt_sim_SOURCES = \
+test/gst_bt_sim.cpp \
+src/gst_bt_scheduler.cpp \
+src/gst_bt_scheduler.hpp \
+src/gst_bt_trace.c \
+src/gst_bt_trace.h
+
+test_gst_bt_sim_CFLAGS = \
+-I$(top_srcdir)/src \
+$(GST_BT_CFLAGS)
+
+test_gst_bt_sim_CXXFLAGS = \
+-I$(top_srcdir)/src \
+$(GST_BT_CFLAGS)
+
+test_gst_bt_sim_LDADD = \
+$(GST_BT_LIBS)
+
+check_PROGRAMS += test/gst_bt_range_test
+
+TESTS += test/gst_bt_range_test
+
+test_gst_bt_range_test_SOURCES = \
+test/gst_bt_range_test.cpp \
+src/gst_bt_range.cpp \
+src/gst_bt_range.hpp
+
+test_gst_bt_range_test_CXXFLAGS = \
+-I$(top_srcdir)/src \
+$(GST_BT_CFLAGS)
+
+test_gst_bt_range_test_LDADD = \
+$(GST_BT_LIBS)
+
+check_PROGRAMS += test/gst_bt_web_seed_test
+
+TESTS += test/gst_bt_web_seed_test
+
+test_gst_bt_web_seed_test_SOURCES = \
+test/gst_bt_test.cpp \
+test/gst_bt_test.hpp \
+test/gst_bt_web_seed_test.cpp
+
+test_gst_bt_web_seed_test_CXXFLAGS = \
+-I$(top_srcdir)/src \
+$(GST_BT_CFLAGS)
+
+test_gst_bt_web_seed_test_LDADD = \
+$(GST_BT_LIBS)
+
+check_PROGRAMS += test/gst_bt_piece_queue_test
+
+TESTS += test/gst_bt_piece_queue_test
+
+test_gst_bt_piece_queue_test_SOURCES = \
+test/gst_bt_piece_queue_test.cpp \
+src/gst_bt_piece_queue.cpp \
+src/gst_bt_piece_queue.hpp
+
+test_gst_bt_piece_queue_test_CXXFLAGS = \
+-I$(top_srcdir)/src \
+$(GST_BT_CFLAGS)
+
+test_gst_bt_piece_queue_test_LDADD = \
+$(GST_BT_LIBS)
+
+check_PROGRAMS += test/gst_bt_dht_test
+
+TESTS += test/gst_bt_dht_test
+
+test_gst_bt_dht_test_SOURCES = \
+test/gst_bt_test.cpp \
+test/gst_bt_test.hpp \
+test/gst_bt_dht_test.cpp
+
+test_gst_bt_dht_test_CXXFLAGS = \
+-I$(top_srcdir)/src \
+$(GST_BT_CFLAGS)
+
+test_gst_bt_dht_test_LDADD = \
+$(GST_BT_LIBS)
@@ -0,0 +1,202 @@
+/* Gst-Bt - BitTorrent related GStreamer elements
+ * Copyright (C) 2015 Jorge Luis Zapata
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Streams a synthetic torrent from a local swarm through btdemux into a
+ * fakesink, seeking once in the middle, and reports the time to the first
+ * buffer, the throughput, the seek latency and the CPU time per MiB. It
+ * fails if the stream does not reach EOS with every expected byte
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "gst_bt_test.hpp"
+
+#define DEFAULT_SEEDERS 2
+#define DEFAULT_PIECE_LENGTH (64 * 1024)
+#define DEFAULT_SIZE (16 * 1024 * 1024)
+#define DEFAULT_FILES 1
+/* compare the storages doing file I/O */
+#if HAVE_IO_URING
+#define DEFAULT_STORAGE "disk,io-uring"
+#else
+#define DEFAULT_STORAGE "disk"
+#endif
+#define DEFAULT_TIMEOUT 120
+
+static gint seeders = DEFAULT_SEEDERS;
+static gint piece_length = DEFAULT_PIECE_LENGTH;
+static gint64 size = DEFAULT_SIZE;
+static gint files = DEFAULT_FILES;
+static gboolean no_seek = FALSE;
+static gchar *storages = NULL;
+static gint timeout = DEFAULT_TIMEOUT;
+
+static GOptionEntry entries[] = {
+  { "seeders", 0, 0, G_OPTION_ARG_INT, &seeders,
+      "Number of seeders on the loopback", "N" },
+  { "piece-length", 0, 0, G_OPTION_ARG_INT, &piece_length,
+      "Piece length of the torrent", "BYTES" },
+  { "size", 0, 0, G_OPTION_ARG_INT64, &size,
+      "Size of the content", "BYTES" },
+  { "files", 0, 0, G_OPTION_ARG_INT, &files,
+      "Number of files the content is split on", "N" },
+  { "no-seek", 0, 0, G_OPTION_ARG_NONE, &no_seek,
+      "Play the stream from the start to the end", NULL },
+  { "storage", 0, 0, G_OPTION_ARG_STRING, &storages,
+      "Comma separated btdemux storages to compare", "STORAGES" },
+  { "timeout", 0, 0, G_OPTION_ARG_INT, &timeout,
+      "Seconds to wait for every run", "SECONDS" },
+  { NULL }
+};
+
+static gboolean
+gst_bt_bench_run (GstBtTestContent * content, const gchar * storage)
+{
+  GstElement *pipeline;
+  GstElement *demux;
+  GstStructure *settings;
+  GstBtTestResult result;
+  gchar *location;
+  gchar *description;
+  gchar *name;
+  gint64 seek_at = -1;
+  gint64 seek_to = 0;
+  guint64 expected;
+  gboolean ret;
+
+  location = g_build_filename (content->dir, storage, NULL);
+  description = g_strdup_printf ("filesrc location=\"%s\" ! "
+      "btdemux name=demux temp-location=\"%s\" ! fakesink name=sink",
+      content->torrent, location);
+  pipeline = gst_bt_test_pipeline_new (description);
+  g_free (description);
+  g_free (location);
+  if (!pipeline)
+    return FALSE;
+
+  demux = gst_bin_get_by_name (GST_BIN (pipeline), "demux");
+  gst_util_set_object_arg (G_OBJECT (demux), "storage", storage);
+  /* every seeder shares the loopback address */
+  settings = gst_structure_new ("settings",
+      "allow-multiple-connections-per-ip", G_TYPE_BOOLEAN, TRUE, NULL);
+  g_object_set (demux, "session-settings", settings, NULL);
+  gst_structure_free (settings);
+  gst_object_unref (demux);
+
+  /* jump from the middle to the last quarter */
+  expected = content->largest;
+  if (!no_seek) {
+    seek_at = content->largest / 2;
+    seek_to = content->largest * 3 / 4;
+    expected = seek_at + content->largest - seek_to;
+  }
+
+  ret = gst_bt_test_run (pipeline, seek_at, seek_to, timeout * GST_SECOND,
+      &result);
+  gst_object_unref (pipeline);
+
+  name = g_strdup_printf ("%d seeders, %s storage", seeders, storage);
+  gst_bt_test_result_print (name, &result);
+  g_free (name);
+
+  if (ret && result.bytes < expected) {
+    g_printerr ("Expected at least %" G_GUINT64_FORMAT " bytes\n", expected);
+    ret = FALSE;
+  }
+
+  return ret;
+}
+
+int
+main (int argc, char **argv)
+{
+  GOptionContext *ctx;
+  GError *err = NULL;
+  GstElementFactory *factory;
+  GstBtTestSwarm *swarm;
+  GstBtTestContent *content;
+  gint64 *sizes;
+  gchar *tracker;
+  gchar **names;
+  gboolean ret = TRUE;
+  gint i;
+
+  if (!g_thread_supported ())
+    g_thread_init (NULL);
+
+  ctx = g_option_context_new ("- btdemux benchmark on a local swarm");
+  g_option_context_add_main_entries (ctx, entries, NULL);
+  g_option_context_add_group (ctx, gst_init_get_option_group ());
+  if (!g_option_context_parse (ctx, &argc, &argv, &err)) {
+    g_printerr ("%s\n", err->message);
+    g_error_free (err);
+    return 1;
+  }
+  g_option_context_free (ctx);
+
+  if (seeders < 1 || files < 1 || piece_length < 16 * 1024 || size < files) {
+    g_printerr ("Invalid options\n");
+    return 1;
+  }
+
+  factory = gst_element_factory_find ("btdemux");
+  if (!factory) {
+    g_printerr ("btdemux not found, check GST_PLUGIN_PATH\n");
+    return 1;
+  }
+  gst_object_unref (factory);
+
+  swarm = gst_bt_test_swarm_new (seeders);
+  if (!swarm)
+    return 1;
+
+  sizes = g_new (gint64, files);
+  for (i = 0; i < files; i++)
+    sizes[i] = size / files;
+
+  tracker = gst_bt_test_swarm_get_tracker (swarm);
+  content = gst_bt_test_content_new (sizes, files, piece_length, tracker,
+      NULL);
+  g_free (tracker);
+  g_free (sizes);
+  if (!content) {
+    gst_bt_test_swarm_free (swarm);
+    return 1;
+  }
+
+  if (!gst_bt_test_swarm_seed (swarm, content)) {
+    gst_bt_test_content_free (content);
+    gst_bt_test_swarm_free (swarm);
+    return 1;
+  }
+
+  names = g_strsplit (storages ? storages : DEFAULT_STORAGE, ",", -1);
+  for (i = 0; names[i]; i++) {
+    if (!gst_bt_bench_run (content, names[i]))
+      ret = FALSE;
+  }
+  g_strfreev (names);
+
+  gst_bt_test_content_free (content);
+  gst_bt_test_swarm_free (swarm);
+
+  return ret ? 0 : 1;
+}
@@ -0,0 +1,167 @@
+/* Gst-Bt - BitTorrent related GStreamer elements
+ * Copyright (C) 2015 Jorge Luis Zapata
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Resolves a magnet without any tracker through DHT nodes on the loopback
+ * seeding its torrent. The cold run only knows the nodes from the
+ * dht-routers property and saves the routing table on the dht-state-file,
+ * the warm run starts from that file alone. The time to the metadata of
+ * both is reported and the test fails if any of them does not reach EOS
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "gst_bt_test.hpp"
+
+#define DEFAULT_NODES 4
+#define DEFAULT_PIECE_LENGTH (64 * 1024)
+#define DEFAULT_SIZE (1024 * 1024)
+#define DEFAULT_TIMEOUT 60
+
+static gint nodes = DEFAULT_NODES;
+static gint timeout = DEFAULT_TIMEOUT;
+
+static GOptionEntry entries[] = {
+  { "nodes", 0, 0, G_OPTION_ARG_INT, &nodes,
+      "DHT nodes seeding the torrent", "N" },
+  { "timeout", 0, 0, G_OPTION_ARG_INT, &timeout,
+      "Seconds to wait for the metadata", "SECONDS" },
+  { NULL }
+};
+
+static gboolean
+gst_bt_dht_test_run (const gchar * name, const gchar * magnet,
+    const gchar * state_file, const gchar * routers)
+{
+  GstBtTestResult result;
+  GstStructure *settings;
+  GstElement *pipeline;
+  GstElement *src;
+  gchar *description;
+  gboolean ret;
+
+  description = g_strdup_printf ("btsrc name=src uri=\"%s\" ! "
+      "fakesink name=sink", magnet);
+  pipeline = gst_bt_test_pipeline_new (description);
+  g_free (description);
+  if (!pipeline)
+    return FALSE;
+
+  /* every node shares the loopback address */
+  settings = gst_structure_new ("settings",
+      "dht-restrict-routing-ips", G_TYPE_BOOLEAN, FALSE,
+      "dht-restrict-search-ips", G_TYPE_BOOLEAN, FALSE,
+      "allow-multiple-connections-per-ip", G_TYPE_BOOLEAN, TRUE, NULL);
+  src = gst_bin_get_by_name (GST_BIN (pipeline), "src");
+  g_object_set (src, "session-settings", settings, "dht-state-file",
+      state_file, "dht-routers", routers, NULL);
+  gst_object_unref (src);
+  gst_structure_free (settings);
+
+  ret = gst_bt_test_run (pipeline, -1, 0, timeout * GST_SECOND, &result);
+  gst_object_unref (pipeline);
+
+  gst_bt_test_result_print (name, &result);
+  if (!result.eos) {
+    g_printerr ("The %s run did not get the metadata\n", name);
+    ret = FALSE;
+  }
+
+  return ret;
+}
+
+int
+main (int argc, char **argv)
+{
+  GOptionContext *ctx;
+  GError *err = NULL;
+  GstElementFactory *factory;
+  GstBtTestContent *content;
+  GstBtTestDht *dht;
+  gint64 size = DEFAULT_SIZE;
+  gchar *magnet;
+  gchar *routers;
+  gchar *state_file;
+  gboolean ret;
+
+  if (!g_thread_supported ())
+    g_thread_init (NULL);
+
+  ctx = g_option_context_new ("- btsrc resolving a magnet over the DHT");
+  g_option_context_add_main_entries (ctx, entries, NULL);
+  g_option_context_add_group (ctx, gst_init_get_option_group ());
+  if (!g_option_context_parse (ctx, &argc, &argv, &err)) {
+    g_printerr ("%s\n", err->message);
+    g_error_free (err);
+    return 1;
+  }
+  g_option_context_free (ctx);
+
+  if (nodes < 2) {
+    g_printerr ("Invalid options\n");
+    return 1;
+  }
+
+  factory = gst_element_factory_find ("btsrc");
+  if (!factory) {
+    g_printerr ("btsrc not found, check GST_PLUGIN_PATH\n");
+    return 1;
+  }
+  gst_object_unref (factory);
+
+  /* no tracker, the peers are only found on the DHT */
+  content = gst_bt_test_content_new (&size, 1, DEFAULT_PIECE_LENGTH, NULL,
+      NULL);
+  if (!content)
+    return 1;
+
+  dht = gst_bt_test_dht_new (nodes);
+  if (!dht) {
+    gst_bt_test_content_free (content);
+    return 1;
+  }
+
+  magnet = gst_bt_test_content_get_magnet (content);
+  if (!magnet || !gst_bt_test_dht_seed (dht, content)) {
+    g_free (magnet);
+    gst_bt_test_dht_free (dht);
+    gst_bt_test_content_free (content);
+    return 1;
+  }
+
+  routers = gst_bt_test_dht_get_routers (dht);
+  state_file = g_build_filename (content->dir, "dht-state", NULL);
+
+  ret = gst_bt_dht_test_run ("cold", magnet, state_file, routers);
+  if (ret && !g_file_test (state_file, G_FILE_TEST_EXISTS)) {
+    g_printerr ("The routing table was not saved\n");
+    ret = FALSE;
+  }
+  if (ret)
+    ret = gst_bt_dht_test_run ("warm", magnet, state_file, NULL);
+
+  g_free (state_file);
+  g_free (routers);
+  g_free (magnet);
+  gst_bt_test_dht_free (dht);
+  gst_bt_test_content_free (content);
+
+  return ret ? 0 : 1;
+}
@@ -0,0 +1,281 @@
+/* Gst-Bt - BitTorrent related GStreamer elements
+ * Copyright (C) 2015 Jorge Luis Zapata
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Checks the piece queue between a producer and a consumer thread: every
+ * piece arrives once and in order, a full ring refuses pieces without losing
+ * the queued ones, a consumer sleeping on an empty queue wakes up when
+ * closed and a reopened queue starts empty and reports the bytes it dropped
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "gst_bt_piece_queue.hpp"
+
+#define DEFAULT_PIECES 200000
+#define DEFAULT_QUEUE_SIZE 4
+
+static gint pieces = DEFAULT_PIECES;
+static gint queue_size = DEFAULT_QUEUE_SIZE;
+
+static GOptionEntry entries[] = {
+  { "pieces", 0, 0, G_OPTION_ARG_INT, &pieces,
+      "Pieces to send through the queue", "N" },
+  { "queue-size", 0, 0, G_OPTION_ARG_INT, &queue_size,
+      "Slots of the ring", "N" },
+  { NULL }
+};
+
+static gboolean
+gst_bt_piece_queue_test_push (GstBtPieceQueue * queue, gint piece)
+{
+  boost::shared_array <char> buffer (new char[1]);
+
+  buffer[0] = (char) (piece & 0x7f);
+  return gst_bt_piece_queue_push (queue, buffer, piece, piece % 1000);
+}
+
+static gboolean
+gst_bt_piece_queue_test_check (const GstBtPieceQueueItem * item, gint piece)
+{
+  if (item->piece != piece || item->size != piece % 1000 ||
+      item->buffer[0] != (char) (piece & 0x7f)) {
+    g_printerr ("Got piece %d of size %d, expected %d\n", item->piece,
+        item->size, piece);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+static gpointer
+gst_bt_piece_queue_test_producer (gpointer user_data)
+{
+  GstBtPieceQueue *queue = (GstBtPieceQueue *) user_data;
+  gint i;
+
+  for (i = 0; i < pieces; i++) {
+    /* the ring is full, wait for the consumer like the budget does */
+    while (!gst_bt_piece_queue_test_push (queue, i))
+      g_usleep (100);
+    /* let the consumer empty the queue and sleep from time to time */
+    if (i % 4096 == 0)
+      g_usleep (1000);
+  }
+
+  return NULL;
+}
+
+static gpointer
+gst_bt_piece_queue_test_consumer (gpointer user_data)
+{
+  GstBtPieceQueue *queue = (GstBtPieceQueue *) user_data;
+  GstBtPieceQueueItem item;
+
+  return GINT_TO_POINTER (gst_bt_piece_queue_pop (queue, &item));
+}
+
+/* Every piece once and in order, with a consumer slower than the producer
+ * now and then so the ring fills
+ */
+static gboolean
+gst_bt_piece_queue_test_order (void)
+{
+  GstBtPieceQueue *queue;
+  GThread *producer;
+  gboolean ret = TRUE;
+  gint i;
+
+  queue = gst_bt_piece_queue_new (queue_size);
+  producer = g_thread_create (gst_bt_piece_queue_test_producer, queue, TRUE,
+      NULL);
+
+  for (i = 0; i < pieces && ret; i++) {
+    GstBtPieceQueueItem item;
+
+    if (i % 1000 == 0)
+      g_usleep (500);
+
+    if (!gst_bt_piece_queue_pop (queue, &item)) {
+      g_printerr ("The queue closed by itself at piece %d\n", i);
+      ret = FALSE;
+      break;
+    }
+    ret = gst_bt_piece_queue_test_check (&item, i);
+  }
+
+  g_thread_join (producer);
+  if (ret && gst_bt_piece_queue_length (queue)) {
+    g_printerr ("%u pieces left on the queue\n",
+        gst_bt_piece_queue_length (queue));
+    ret = FALSE;
+  }
+  gst_bt_piece_queue_free (queue);
+
+  return ret;
+}
+
+/* A full ring refuses the piece and keeps the queued ones in order */
+static gboolean
+gst_bt_piece_queue_test_full (void)
+{
+  GstBtPieceQueue *queue;
+  GstBtPieceQueueItem item;
+  gboolean ret = TRUE;
+  gint queued;
+  gint i;
+
+  queue = gst_bt_piece_queue_new (queue_size);
+  queued = 0;
+  while (gst_bt_piece_queue_test_push (queue, queued))
+    queued++;
+
+  if (queued < queue_size) {
+    g_printerr ("The ring is full at %d pieces, expected %d\n", queued,
+        queue_size);
+    ret = FALSE;
+  }
+
+  /* a slot released takes one more piece */
+  for (i = 0; ret && i <= queued; i++) {
+    if (!gst_bt_piece_queue_try_pop (queue, &item) ||
+        !gst_bt_piece_queue_test_check (&item, i)) {
+      g_printerr ("Lost piece %d on a full ring\n", i);
+      ret = FALSE;
+    }
+    if (i == 0 && !gst_bt_piece_queue_test_push (queue, queued)) {
+      g_printerr ("The ring is full after a pop\n");
+      ret = FALSE;
+    }
+  }
+  gst_bt_piece_queue_free (queue);
+
+  return ret;
+}
+
+/* A consumer sleeping on the empty queue wakes up once closed */
+static gboolean
+gst_bt_piece_queue_test_close (void)
+{
+  GstBtPieceQueue *queue;
+  GThread *consumer;
+  gboolean popped;
+
+  queue = gst_bt_piece_queue_new (queue_size);
+  consumer = g_thread_create (gst_bt_piece_queue_test_consumer, queue, TRUE,
+      NULL);
+  g_usleep (10000);
+  gst_bt_piece_queue_close (queue);
+  popped = GPOINTER_TO_INT (g_thread_join (consumer));
+  gst_bt_piece_queue_free (queue);
+
+  if (popped) {
+    g_printerr ("Popped a piece from an empty queue\n");
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+/* Nothing is delivered once closed and a reopened queue starts empty */
+static gboolean
+gst_bt_piece_queue_test_reopen (void)
+{
+  GstBtPieceQueue *queue;
+  GstBtPieceQueueItem item;
+  gboolean ret = TRUE;
+  gint64 queued = 0;
+  gint64 dropped;
+  gint i;
+
+  queue = gst_bt_piece_queue_new (queue_size);
+  /* fill the ring */
+  for (i = 0; gst_bt_piece_queue_test_push (queue, i); i++)
+    queued += i % 1000;
+
+  gst_bt_piece_queue_close (queue);
+  if (gst_bt_piece_queue_push (queue, boost::shared_array <char> (
+      new char[1]), 0, 0)) {
+    g_printerr ("Pushed a piece on a closed queue\n");
+    ret = FALSE;
+  }
+  if (gst_bt_piece_queue_try_pop (queue, &item)) {
+    g_printerr ("Popped a piece from a closed queue\n");
+    ret = FALSE;
+  }
+
+  dropped = gst_bt_piece_queue_reopen (queue);
+  if (ret && dropped != queued) {
+    g_printerr ("Dropped %" G_GINT64_FORMAT " bytes, expected %"
+        G_GINT64_FORMAT "\n", dropped, queued);
+    ret = FALSE;
+  }
+  if (ret && !gst_bt_piece_queue_is_empty (queue)) {
+    g_printerr ("%u pieces left on the reopened queue\n",
+        gst_bt_piece_queue_length (queue));
+    ret = FALSE;
+  }
+
+  gst_bt_piece_queue_test_push (queue, 42);
+  if (ret && (!gst_bt_piece_queue_try_pop (queue, &item) ||
+      !gst_bt_piece_queue_test_check (&item, 42))) {
+    g_printerr ("The reopened queue does not deliver\n");
+    ret = FALSE;
+  }
+  gst_bt_piece_queue_free (queue);
+
+  return ret;
+}
+
+int
+main (int argc, char **argv)
+{
+  GOptionContext *ctx;
+  GError *err = NULL;
+  gboolean ret = TRUE;
+
+  if (!g_thread_supported ())
+    g_thread_init (NULL);
+
+  ctx = g_option_context_new ("- piece queue checks");
+  g_option_context_add_main_entries (ctx, entries, NULL);
+  if (!g_option_context_parse (ctx, &argc, &argv, &err)) {
+    g_printerr ("%s\n", err->message);
+    g_error_free (err);
+    return 1;
+  }
+  g_option_context_free (ctx);
+
+  if (pieces < 1 || queue_size < 1) {
+    g_printerr ("Invalid options\n");
+    return 1;
+  }
+
+  if (!gst_bt_piece_queue_test_order ())
+    ret = FALSE;
+  if (!gst_bt_piece_queue_test_full ())
+    ret = FALSE;
+  if (!gst_bt_piece_queue_test_close ())
+    ret = FALSE;
+  if (!gst_bt_piece_queue_test_reopen ())
+    ret = FALSE;
+
+  return ret ? 0 : 1;
+}
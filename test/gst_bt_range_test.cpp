@@ -0,0 +1,150 @@
+/* Gst-Bt - BitTorrent related GStreamer elements
+ * Copyright (C) 2015 Jorge Luis Zapata
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Checks the piece arithmetic against tables of byte ranges and the pieces
+ * they must map to, the piece boundaries and the offsets past 4GiB included
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "gst_bt_range.hpp"
+
+#define GIB (G_GINT64_CONSTANT (1) << 30)
+
+typedef struct _GstBtRangeMapCase
+{
+  const gchar *name;
+  gint64 offset;
+  gint64 size;
+  gint piece_length;
+  gboolean ret;
+  GstBtRange range;
+} GstBtRangeMapCase;
+
+typedef struct _GstBtRangeClipCase
+{
+  const gchar *name;
+  GstBtRange range;
+  gint piece;
+  gint piece_size;
+  gboolean ret;
+  gint begin;
+  gint end;
+} GstBtRangeClipCase;
+
+static const GstBtRangeMapCase map_cases[] = {
+  { "first piece", 0, 64, 64, TRUE, { 0, 0, 0, 64 } },
+  { "across pieces", 0, 100, 64, TRUE, { 0, 0, 1, 36 } },
+  { "inside a piece", 10, 20, 64, TRUE, { 0, 10, 0, 30 } },
+  { "ending on a boundary", 64, 64, 64, TRUE, { 1, 0, 1, 64 } },
+  { "starting on the last byte", 63, 2, 64, TRUE, { 0, 63, 1, 1 } },
+  { "empty", 100, 0, 64, TRUE, { 1, 36, 1, 36 } },
+  { "past 4GiB", 5 * GIB, 1024 * 1024, 256 * 1024, TRUE,
+      { 20480, 0, 20483, 256 * 1024 } },
+  { "across 4GiB", 4 * GIB - 10, 20, 1024 * 1024, TRUE,
+      { 4095, 1024 * 1024 - 10, 4096, 10 } },
+  { "no piece length", 0, 64, 0, FALSE, { 0, 0, 0, 0 } },
+  { "negative offset", -1, 64, 64, FALSE, { 0, 0, 0, 0 } },
+  { "negative size", 0, -1, 64, FALSE, { 0, 0, 0, 0 } },
+};
+
+static const GstBtRangeClipCase clip_cases[] = {
+  { "before the range", { 1, 10, 3, 20 }, 0, 64, FALSE, 0, 0 },
+  { "first piece", { 1, 10, 3, 20 }, 1, 64, TRUE, 10, 64 },
+  { "middle piece", { 1, 10, 3, 20 }, 2, 64, TRUE, 0, 64 },
+  { "last piece", { 1, 10, 3, 20 }, 3, 64, TRUE, 0, 20 },
+  { "after the range", { 1, 10, 3, 20 }, 4, 64, FALSE, 0, 0 },
+  { "single piece", { 2, 10, 2, 30 }, 2, 64, TRUE, 10, 30 },
+  { "short last piece", { 0, 0, 1, 64 }, 1, 40, TRUE, 0, 40 },
+  { "start past a short piece", { 1, 50, 2, 10 }, 1, 40, TRUE, 40, 40 },
+};
+
+static gboolean
+gst_bt_range_equal (const GstBtRange * a, const GstBtRange * b)
+{
+  return a->start_piece == b->start_piece &&
+      a->start_offset == b->start_offset &&
+      a->end_piece == b->end_piece && a->end_offset == b->end_offset;
+}
+
+static gint
+check_map (void)
+{
+  gint failed = 0;
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (map_cases); i++) {
+    const GstBtRangeMapCase *c = &map_cases[i];
+    GstBtRange range = { -1, -1, -1, -1 };
+    gboolean ret;
+
+    ret = gst_bt_range_map (c->offset, c->size, c->piece_length, &range);
+    if (ret != c->ret || (ret && !gst_bt_range_equal (&range, &c->range))) {
+      g_printerr ("map '%s': got %d (%d:%d - %d:%d), expected %d "
+          "(%d:%d - %d:%d)\n", c->name, ret, range.start_piece,
+          range.start_offset, range.end_piece, range.end_offset, c->ret,
+          c->range.start_piece, c->range.start_offset, c->range.end_piece,
+          c->range.end_offset);
+      failed++;
+    }
+  }
+
+  return failed;
+}
+
+static gint
+check_clip (void)
+{
+  gint failed = 0;
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (clip_cases); i++) {
+    const GstBtRangeClipCase *c = &clip_cases[i];
+    gint begin = -1, end = -1;
+    gboolean ret;
+
+    ret = gst_bt_range_clip (&c->range, c->piece, c->piece_size, &begin,
+        &end);
+    if (ret != c->ret || (ret && (begin != c->begin || end != c->end))) {
+      g_printerr ("clip '%s': got %d [%d, %d), expected %d [%d, %d)\n",
+          c->name, ret, begin, end, c->ret, c->begin, c->end);
+      failed++;
+    }
+  }
+
+  return failed;
+}
+
+int
+main (int argc, char **argv)
+{
+  gint failed;
+
+  failed = check_map () + check_clip ();
+  if (failed) {
+    g_printerr ("%d range cases failed\n", failed);
+    return 1;
+  }
+
+  g_print ("%u range cases passed\n", (guint) (G_N_ELEMENTS (map_cases) +
+      G_N_ELEMENTS (clip_cases)));
+  return 0;
+}
@@ -0,0 +1,620 @@
+/* Gst-Bt - BitTorrent related GStreamer elements
+ * Copyright (C) 2015 Jorge Luis Zapata
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Runs the piece scheduler offline, in virtual time, against a simulated
+ * swarm and a player consuming at a fixed bitrate, or as fast as a
+ * consumption trace tells, one line with the milliseconds the player took
+ * to consume every pushed piece. Every watermark policy is played on the
+ * same swarm and the startup time, the seek latency, the stalls and the
+ * bytes downloaded but never pushed are reported.
+ *
+ * The swarm downloads one wanted piece at a time, the highest priority
+ * first and in order from the playhead. Every download takes the time of
+ * the piece length at the given bandwidth, with some random jitter, or the
+ * times of a trace file, one line with the milliseconds per downloaded
+ * piece, like the difference between the piece_priority and piece_finished
+ * points of the bttrace debug category. It fails if any policy does not
+ * push every piece in order up to the end
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include "gst_bt_scheduler.hpp"
+
+GST_DEBUG_CATEGORY (gst_bt_demux_debug);
+GST_DEBUG_CATEGORY (gst_bt_trace_debug);
+
+#define DEFAULT_PIECES 512
+#define DEFAULT_PIECE_LENGTH (256 * 1024)
+#define DEFAULT_BANDWIDTH 1024
+#define DEFAULT_JITTER 0.5
+#define DEFAULT_BITRATE 512
+#define DEFAULT_READ_LATENCY 2
+#define DEFAULT_QUEUE 2
+#define DEFAULT_POLICIES "3:1,5:2,8:3,12:4"
+#define DEFAULT_SEED 0
+#define DEFAULT_DURATION 3600
+
+static gint num_pieces = DEFAULT_PIECES;
+static gint piece_length = DEFAULT_PIECE_LENGTH;
+static gint bandwidth = DEFAULT_BANDWIDTH;
+static gdouble jitter = DEFAULT_JITTER;
+static gint bitrate = DEFAULT_BITRATE;
+static gint read_latency = DEFAULT_READ_LATENCY;
+static gint queue = DEFAULT_QUEUE;
+static gchar *trace = NULL;
+static gchar *consumption = NULL;
+static gchar *policies = NULL;
+static gchar **seeks = NULL;
+static gboolean no_seek = FALSE;
+static gint seed = DEFAULT_SEED;
+static gint duration = DEFAULT_DURATION;
+
+static GOptionEntry entries[] = {
+  { "pieces", 0, 0, G_OPTION_ARG_INT, &num_pieces,
+      "Number of pieces of the stream", "N" },
+  { "piece-length", 0, 0, G_OPTION_ARG_INT, &piece_length,
+      "Piece length of the torrent", "BYTES" },
+  { "bandwidth", 0, 0, G_OPTION_ARG_INT, &bandwidth,
+      "Download rate of the swarm", "KIB/S" },
+  { "jitter", 0, 0, G_OPTION_ARG_DOUBLE, &jitter,
+      "Random variation of every download time, from 0 to 1", "RATIO" },
+  { "bitrate", 0, 0, G_OPTION_ARG_INT, &bitrate,
+      "Rate the player consumes the stream", "KIB/S" },
+  { "read-latency", 0, 0, G_OPTION_ARG_INT, &read_latency,
+      "Time to read a downloaded piece", "MS" },
+  { "queue", 0, 0, G_OPTION_ARG_INT, &queue,
+      "Pieces the player can hold before blocking the push", "N" },
+  { "trace", 0, 0, G_OPTION_ARG_FILENAME, &trace,
+      "File with the download time of every piece", "FILE" },
+  { "consumption", 0, 0, G_OPTION_ARG_FILENAME, &consumption,
+      "File with the time the player takes to consume every piece, "
+      "instead of the bitrate", "FILE" },
+  { "policies", 0, 0, G_OPTION_ARG_STRING, &policies,
+      "Comma separated high:low watermarks in pieces to compare",
+      "POLICIES" },
+  { "seek", 0, 0, G_OPTION_ARG_STRING_ARRAY, &seeks,
+      "Jump to piece TO once piece FROM is pushed, can be repeated",
+      "FROM:TO" },
+  { "no-seek", 0, 0, G_OPTION_ARG_NONE, &no_seek,
+      "Play the stream from the start to the end", NULL },
+  { "seed", 0, 0, G_OPTION_ARG_INT, &seed,
+      "Seed of the download jitter", "N" },
+  { "duration", 0, 0, G_OPTION_ARG_INT, &duration,
+      "Virtual seconds to wait for every run", "SECONDS" },
+  { NULL }
+};
+
+typedef struct _GstBtSimSeek
+{
+  gint from;
+  gint to;
+} GstBtSimSeek;
+
+typedef struct _GstBtSimRead
+{
+  gint piece;
+  gint64 ready;
+  guint generation;
+} GstBtSimRead;
+
+typedef struct _GstBtSimResult
+{
+  gint64 startup;
+  gint64 seek_latency;
+  guint seeks;
+  guint stalls;
+  gint64 stall_time;
+  guint64 wasted;
+  gint64 end;
+  gboolean finished;
+} GstBtSimResult;
+
+typedef struct _GstBtSim
+{
+  GstBtSchedulerStream stream;
+  gint high;
+  gint low;
+
+  /* the swarm */
+  gboolean *have;
+  gint *priorities;
+  gboolean *pushed;
+  GRand *rand;
+  gint64 *times;
+  guint num_times;
+  guint next_time;
+  gint downloading;
+  gint64 download_end;
+
+  /* the reads waiting to be pushed */
+  GQueue *reads;
+  guint generation;
+
+  /* the player */
+  gint64 *consume_times;
+  guint num_consume_times;
+  gdouble consumed;
+  gdouble queued;
+  gboolean playing;
+  gboolean stalled;
+  gboolean eos;
+  gint64 seek_time;
+  GstBtSimSeek *seeks;
+  guint num_seeks;
+  guint next_seek;
+
+  gint64 now;
+  GstBtSimResult *result;
+} GstBtSim;
+
+/*----------------------------------------------------------------------------*
+ *                            The torrent interface                           *
+ *----------------------------------------------------------------------------*/
+class GstBtSimTorrent : public GstBtTorrent
+{
+public:
+  GstBtSimTorrent (GstBtSim * sim) : sim (sim) {}
+
+  bool have_piece (int piece)
+  {
+    if (piece < 0 || piece >= num_pieces)
+      return false;
+    return sim->have[piece];
+  }
+
+  int piece_priority (int piece)
+  {
+    return sim->priorities[piece];
+  }
+
+  void piece_priority (int piece, int priority)
+  {
+    sim->priorities[piece] = priority;
+  }
+
+  void read_piece (GstBtSchedulerStream * stream, int piece)
+  {
+    GstBtSimRead *read;
+
+    read = g_new (GstBtSimRead, 1);
+    read->piece = piece;
+    read->ready = sim->now + read_latency;
+    read->generation = sim->generation;
+    g_queue_push_tail (sim->reads, read);
+  }
+
+private:
+  GstBtSim *sim;
+};
+
+/*----------------------------------------------------------------------------*
+ *                              The simulation                                *
+ *----------------------------------------------------------------------------*/
+/* Same as the demuxer once the buffering level changes, read the next piece
+ * once every piece has been downloaded
+ */
+static void
+gst_bt_sim_send_buffering (GstBtSim * thiz, GstBtTorrent & t)
+{
+  GstBtSchedulerStream *stream = &thiz->stream;
+
+  if (!stream->requested || !stream->buffering)
+    return;
+
+  if (stream->buffering_level < 100)
+    return;
+
+  stream->buffering = FALSE;
+  stream->buffering_level = 0;
+  gst_bt_scheduler_read_piece (stream, t,
+      gst_bt_scheduler_next_piece (stream, stream->current_piece));
+}
+
+static void
+gst_bt_sim_activate (GstBtSim * thiz, GstBtTorrent & t)
+{
+  GstBtSchedulerStream *stream = &thiz->stream;
+
+  if (gst_bt_scheduler_activate (stream, t, thiz->high)) {
+    gst_bt_sim_send_buffering (thiz, t);
+  } else {
+    gst_bt_scheduler_read_piece (stream, t,
+        gst_bt_scheduler_next_piece (stream, stream->current_piece));
+  }
+  thiz->seek_time = thiz->now;
+}
+
+static void
+gst_bt_sim_seek (GstBtSim * thiz, GstBtTorrent & t, gint piece)
+{
+  GstBtSchedulerStream *stream = &thiz->stream;
+
+  /* flush the reads and the player */
+  thiz->generation++;
+  thiz->queued = 0;
+  thiz->playing = FALSE;
+  thiz->stalled = FALSE;
+  thiz->result->seeks++;
+
+  stream->start_piece = piece;
+  stream->buffering = FALSE;
+  stream->buffering_level = 0;
+  gst_bt_scheduler_set_rate (stream, 1.0, FALSE);
+  gst_bt_sim_activate (thiz, t);
+}
+
+static gint
+gst_bt_sim_pick_piece (GstBtSim * thiz)
+{
+  gint best = -1;
+  gint i;
+
+  /* the highest priority first, in order from the playhead */
+  for (i = 0; i < num_pieces; i++) {
+    gint piece = (thiz->stream.current_piece + 1 + i) % num_pieces;
+
+    if (piece < 0)
+      piece += num_pieces;
+    if (thiz->have[piece] || !thiz->priorities[piece])
+      continue;
+    if (best < 0 || thiz->priorities[piece] > thiz->priorities[best])
+      best = piece;
+  }
+
+  return best;
+}
+
+static gint64
+gst_bt_sim_download_time (GstBtSim * thiz)
+{
+  gdouble ms;
+
+  if (thiz->num_times)
+    return thiz->times[thiz->next_time++ % thiz->num_times];
+
+  ms = (gdouble) piece_length * 1000 / (bandwidth * 1024.0);
+  if (jitter > 0)
+    ms *= 1.0 + g_rand_double_range (thiz->rand, -jitter, jitter);
+
+  return MAX ((gint64) ms, 1);
+}
+
+static void
+gst_bt_sim_download (GstBtSim * thiz, GstBtTorrent & t)
+{
+  GstBtSchedulerStream *stream = &thiz->stream;
+  gint piece;
+
+  if (thiz->downloading < 0) {
+    thiz->downloading = gst_bt_sim_pick_piece (thiz);
+    if (thiz->downloading < 0)
+      return;
+    thiz->download_end = thiz->now + gst_bt_sim_download_time (thiz);
+  }
+
+  if (thiz->now < thiz->download_end)
+    return;
+
+  piece = thiz->downloading;
+  thiz->downloading = -1;
+  thiz->have[piece] = TRUE;
+
+  if (!stream->requested || !gst_bt_scheduler_piece_in_segment (stream, piece))
+    return;
+
+  if (gst_bt_scheduler_piece_finished (stream, t, piece, thiz->high))
+    gst_bt_sim_send_buffering (thiz, t);
+}
+
+static void
+gst_bt_sim_push (GstBtSim * thiz, GstBtTorrent & t)
+{
+  GstBtSchedulerStream *stream = &thiz->stream;
+  GstBtSimRead *read;
+  gint next;
+
+  read = (GstBtSimRead *) g_queue_peek_head (thiz->reads);
+  if (!read || read->ready > thiz->now)
+    return;
+
+  /* the push blocks while the player is full */
+  if (thiz->queued + piece_length > (gdouble) queue * piece_length)
+    return;
+
+  g_queue_pop_head (thiz->reads);
+  next = gst_bt_scheduler_next_piece (stream, stream->current_piece);
+  /* flushed by a seek or not expected */
+  if (read->generation != thiz->generation || read->piece != next) {
+    g_free (read);
+    return;
+  }
+
+  if (!thiz->playing) {
+    if (thiz->result->startup < 0)
+      thiz->result->startup = thiz->now - thiz->seek_time;
+    else
+      thiz->result->seek_latency += thiz->now - thiz->seek_time;
+    thiz->playing = TRUE;
+  }
+
+  if (gst_bt_scheduler_piece_pushed (stream, t, read->piece, thiz->high,
+      thiz->low))
+    gst_bt_sim_send_buffering (thiz, t);
+
+  stream->current_piece = read->piece;
+  thiz->pushed[read->piece] = TRUE;
+  thiz->queued += piece_length;
+  if (read->piece == stream->end_piece)
+    thiz->eos = TRUE;
+
+  /* jump once the playhead reaches the seek */
+  if (thiz->next_seek < thiz->num_seeks &&
+      thiz->seeks[thiz->next_seek].from == read->piece) {
+    gint to = thiz->seeks[thiz->next_seek++].to;
+
+    g_free (read);
+    gst_bt_sim_seek (thiz, t, to);
+    return;
+  }
+  g_free (read);
+}
+
+/* The bytes the player consumes this ms, the trace is replayed from the
+ * start in a loop
+ */
+static gdouble
+gst_bt_sim_consume_rate (GstBtSim * thiz)
+{
+  guint piece;
+
+  if (!thiz->num_consume_times)
+    return bitrate * 1024.0 / 1000;
+
+  piece = (guint) (thiz->consumed / piece_length);
+  return (gdouble) piece_length /
+      thiz->consume_times[piece % thiz->num_consume_times];
+}
+
+static void
+gst_bt_sim_play (GstBtSim * thiz)
+{
+  gdouble rate;
+
+  if (!thiz->playing)
+    return;
+
+  rate = MIN (gst_bt_sim_consume_rate (thiz), thiz->queued);
+  thiz->consumed += rate;
+  thiz->queued -= rate;
+  if (thiz->queued > 0) {
+    thiz->stalled = FALSE;
+    return;
+  }
+
+  thiz->queued = 0;
+  if (thiz->eos)
+    return;
+
+  if (!thiz->stalled) {
+    thiz->result->stalls++;
+    thiz->stalled = TRUE;
+  }
+  thiz->result->stall_time++;
+}
+
+static void
+gst_bt_sim_run (gint high, gint low, GstBtSimSeek * seeks, guint num_seeks,
+    gint64 * times, guint num_times, gint64 * consume_times,
+    guint num_consume_times, GstBtSimResult * result)
+{
+  GstBtSim thiz;
+  GstBtSimTorrent t (&thiz);
+  gint64 end = (gint64) duration * 1000;
+  gint i;
+
+  memset (result, 0, sizeof (GstBtSimResult));
+  result->startup = -1;
+
+  memset (&thiz, 0, sizeof (GstBtSim));
+  thiz.high = high;
+  thiz.low = low;
+  thiz.have = g_new0 (gboolean, num_pieces);
+  thiz.priorities = g_new0 (gint, num_pieces);
+  thiz.pushed = g_new0 (gboolean, num_pieces);
+  thiz.rand = g_rand_new_with_seed (seed);
+  thiz.times = times;
+  thiz.num_times = num_times;
+  thiz.consume_times = consume_times;
+  thiz.num_consume_times = num_consume_times;
+  thiz.downloading = -1;
+  thiz.reads = g_queue_new ();
+  thiz.seeks = seeks;
+  thiz.num_seeks = num_seeks;
+  thiz.result = result;
+
+  thiz.stream.start_piece = 0;
+  thiz.stream.end_piece = num_pieces - 1;
+  gst_bt_scheduler_set_rate (&thiz.stream, 1.0, FALSE);
+  gst_bt_sim_activate (&thiz, t);
+
+  for (thiz.now = 0; thiz.now < end; thiz.now++) {
+    gst_bt_sim_download (&thiz, t);
+    gst_bt_sim_push (&thiz, t);
+    gst_bt_sim_play (&thiz);
+
+    if (thiz.eos && thiz.queued <= 0)
+      break;
+  }
+
+  result->end = thiz.now;
+  result->finished = thiz.eos && thiz.queued <= 0;
+  for (i = 0; i < num_pieces; i++) {
+    if (thiz.have[i] && !thiz.pushed[i])
+      result->wasted += piece_length;
+  }
+
+  g_queue_foreach (thiz.reads, (GFunc) g_free, NULL);
+  g_queue_free (thiz.reads);
+  g_rand_free (thiz.rand);
+  g_free (thiz.pushed);
+  g_free (thiz.priorities);
+  g_free (thiz.have);
+}
+
+static gboolean
+gst_bt_sim_load_trace (const gchar * location, gint64 ** times,
+    guint * num_times)
+{
+  GError *err = NULL;
+  GArray *array;
+  gchar *contents;
+  gchar **lines;
+  gint i;
+
+  if (!g_file_get_contents (location, &contents, NULL, &err)) {
+    g_printerr ("%s\n", err->message);
+    g_error_free (err);
+    return FALSE;
+  }
+
+  array = g_array_new (FALSE, FALSE, sizeof (gint64));
+  lines = g_strsplit (contents, "\n", -1);
+  for (i = 0; lines[i]; i++) {
+    gchar *line = g_strstrip (lines[i]);
+    gint64 ms;
+
+    if (!*line || *line == '#')
+      continue;
+
+    ms = g_ascii_strtoll (line, NULL, 10);
+    ms = MAX (ms, 1);
+    g_array_append_val (array, ms);
+  }
+  g_strfreev (lines);
+  g_free (contents);
+
+  *num_times = array->len;
+  *times = (gint64 *) g_array_free (array, FALSE);
+  if (!*num_times) {
+    g_printerr ("No times on %s\n", location);
+    g_free (*times);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+int
+main (int argc, char **argv)
+{
+  GOptionContext *ctx;
+  GError *err = NULL;
+  GstBtSimSeek *sim_seeks;
+  guint num_seeks;
+  gint64 *times = NULL;
+  guint num_times = 0;
+  gint64 *consume_times = NULL;
+  guint num_consume_times = 0;
+  gchar **names;
+  gboolean ret = TRUE;
+  guint i;
+
+  ctx = g_option_context_new ("- btdemux piece scheduler simulator");
+  g_option_context_add_main_entries (ctx, entries, NULL);
+  g_option_context_add_group (ctx, gst_init_get_option_group ());
+  if (!g_option_context_parse (ctx, &argc, &argv, &err)) {
+    g_printerr ("%s\n", err->message);
+    g_error_free (err);
+    return 1;
+  }
+  g_option_context_free (ctx);
+
+  GST_DEBUG_CATEGORY_INIT (gst_bt_demux_debug, "btdemux", 0,
+      "BitTorrent demuxer");
+  GST_DEBUG_CATEGORY_INIT (gst_bt_trace_debug, "bttrace", 0,
+      "BitTorrent piece lifecycle");
+
+  if (num_pieces < 2 || piece_length < 1 || bandwidth < 1 || bitrate < 1 ||
+      queue < 1 || read_latency < 0 || jitter < 0 || jitter >= 1) {
+    g_printerr ("Invalid options\n");
+    return 1;
+  }
+
+  if (trace && !gst_bt_sim_load_trace (trace, &times, &num_times))
+    return 1;
+  if (consumption && !gst_bt_sim_load_trace (consumption, &consume_times,
+      &num_consume_times))
+    return 1;
+
+  /* jump from the middle to the last quarter by default */
+  num_seeks = seeks ? g_strv_length (seeks) : 1;
+  sim_seeks = g_new0 (GstBtSimSeek, num_seeks);
+  if (no_seek) {
+    num_seeks = 0;
+  } else if (!seeks) {
+    sim_seeks[0].from = num_pieces / 2;
+    sim_seeks[0].to = num_pieces * 3 / 4;
+  }
+  for (i = 0; seeks && i < num_seeks; i++) {
+    if (sscanf (seeks[i], "%d:%d", &sim_seeks[i].from,
+        &sim_seeks[i].to) != 2 || sim_seeks[i].to < 0 ||
+        sim_seeks[i].to >= num_pieces) {
+      g_printerr ("Invalid seek '%s'\n", seeks[i]);
+      return 1;
+    }
+  }
+
+  names = g_strsplit (policies ? policies : DEFAULT_POLICIES, ",", -1);
+  for (i = 0; names[i]; i++) {
+    GstBtSimResult result;
+    gint high, low;
+
+    if (sscanf (names[i], "%d:%d", &high, &low) != 2 || high < 1 ||
+        low < 0 || low > high) {
+      g_printerr ("Invalid policy '%s'\n", names[i]);
+      ret = FALSE;
+      continue;
+    }
+
+    gst_bt_sim_run (high, low, sim_seeks, num_seeks, times, num_times,
+        consume_times, num_consume_times, &result);
+    g_print ("policy %d:%d: startup %" G_GINT64_FORMAT " ms, seek %"
+        G_GINT64_FORMAT " ms, %u stalls (%" G_GINT64_FORMAT " ms), wasted %"
+        G_GUINT64_FORMAT " KiB, ended at %" G_GINT64_FORMAT " ms\n",
+        high, low, result.startup,
+        result.seeks ? result.seek_latency / result.seeks : 0,
+        result.stalls, result.stall_time, result.wasted / 1024, result.end);
+
+    if (!result.finished) {
+      g_printerr ("Policy %d:%d did not reach the end\n", high, low);
+      ret = FALSE;
+    }
+  }
+  g_strfreev (names);
+  g_free (sim_seeks);
+  g_free (times);
+  g_free (consume_times);
+
+  return ret ? 0 : 1;
+}
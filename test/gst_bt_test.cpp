@@ -0,0 +1,889 @@
+/* Gst-Bt - BitTorrent related GStreamer elements
+ * Copyright (C) 2015 Jorge Luis Zapata
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The harness shared by the tests. Everything runs on the loopback: the
+ * content is generated on a temporary directory, its torrent is created
+ * with libtorrent, a set of libtorrent sessions seed it and a tracker
+ * stand-in announces them. The pipelines under test end on a fakesink
+ * named "sink" where the pushed buffers are accounted
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "gst_bt_test.hpp"
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <glib/gstdio.h>
+
+#include "libtorrent/session.hpp"
+#include "libtorrent/create_torrent.hpp"
+#include "libtorrent/torrent_info.hpp"
+#include "libtorrent/bencode.hpp"
+#include "libtorrent/magnet_uri.hpp"
+#include "libtorrent/session_settings.hpp"
+#include <iterator>
+#include <vector>
+
+#define GST_BT_TEST_REQUEST_SIZE 8192
+/* ms to wait for the DHT nodes to know each other */
+#define GST_BT_TEST_DHT_TIMEOUT 10000
+
+struct _GstBtTestHttp
+{
+  int fd;
+  gint port;
+  GThread *thread;
+  volatile gint stop;
+  GstBtTestHttpFunc func;
+  gpointer user_data;
+};
+
+struct _GstBtTestSwarm
+{
+  std::vector<libtorrent::session *> seeders;
+  /* the compact peers list announced */
+  GString *peers;
+  GstBtTestHttp *tracker;
+};
+
+struct _GstBtTestDht
+{
+  std::vector<libtorrent::session *> nodes;
+};
+
+typedef struct _GstBtTestState
+{
+  GMutex *lock;
+  guint64 bytes;
+  GstClockTime start;
+  GstClockTime first;
+  GstClockTime last;
+  GstClockTime seek;
+  GstClockTime seek_first;
+} GstBtTestState;
+
+/*----------------------------------------------------------------------------*
+ *                               The content                                  *
+ *----------------------------------------------------------------------------*/
+static void
+gst_bt_test_remove (const gchar * path)
+{
+  GDir *dir;
+
+  dir = g_dir_open (path, 0, NULL);
+  if (dir) {
+    const gchar *name;
+
+    while ((name = g_dir_read_name (dir))) {
+      gchar *child;
+
+      child = g_build_filename (path, name, NULL);
+      gst_bt_test_remove (child);
+      g_free (child);
+    }
+    g_dir_close (dir);
+  }
+  g_remove (path);
+}
+
+static gboolean
+gst_bt_test_write_file (const gchar * path, gint64 size)
+{
+  FILE *f;
+  guint8 buf[64 * 1024];
+  gint64 offset = 0;
+
+  f = g_fopen (path, "wb");
+  if (!f)
+    return FALSE;
+
+  while (offset < size) {
+    gsize len = MIN ((gint64) sizeof (buf), size - offset);
+    gsize i;
+
+    for (i = 0; i < len; i++)
+      buf[i] = gst_bt_test_content_byte (offset + i);
+
+    if (fwrite (buf, 1, len, f) != len) {
+      fclose (f);
+      return FALSE;
+    }
+    offset += len;
+  }
+  fclose (f);
+
+  return TRUE;
+}
+
+/* The same pattern on every file, so a byte can be checked only knowing its
+ * offset on the file
+ */
+guint8
+gst_bt_test_content_byte (gint64 offset)
+{
+  return (guint8) ((offset >> 9) ^ (offset * 7));
+}
+
+GstBtTestContent *
+gst_bt_test_content_new (const gint64 * sizes, gint num_files,
+    gint piece_length, const gchar * tracker, const gchar * url_seed)
+{
+  using namespace libtorrent;
+  GstBtTestContent *thiz;
+  file_storage fs;
+  std::vector<char> buf;
+  error_code ec;
+  gchar *root;
+  gint i;
+
+  thiz = g_new0 (GstBtTestContent, 1);
+  thiz->dir = g_dir_make_tmp ("gst-bt-test-XXXXXX", NULL);
+  if (!thiz->dir) {
+    g_free (thiz);
+    return NULL;
+  }
+
+  thiz->name = g_strdup (num_files > 1 ? "content" : "content.bin");
+  thiz->piece_length = piece_length;
+  thiz->num_files = num_files;
+
+  root = g_build_filename (thiz->dir, thiz->name, NULL);
+  if (num_files > 1)
+    g_mkdir (root, 0755);
+
+  for (i = 0; i < num_files; i++) {
+    gchar *path;
+    gboolean written;
+
+    if (num_files > 1) {
+      gchar *name;
+
+      name = g_strdup_printf ("file-%d.bin", i);
+      path = g_build_filename (root, name, NULL);
+      g_free (name);
+    } else {
+      path = g_strdup (root);
+    }
+
+    written = gst_bt_test_write_file (path, sizes[i]);
+    g_free (path);
+    if (!written)
+      goto error;
+
+    thiz->size += sizes[i];
+    thiz->largest = MAX (thiz->largest, sizes[i]);
+  }
+
+  add_files (fs, root);
+  g_free (root);
+  root = NULL;
+
+  {
+    create_torrent t (fs, piece_length);
+
+    if (tracker)
+      t.add_tracker (tracker);
+    if (url_seed)
+      t.add_url_seed (url_seed);
+    t.set_creator ("gst-bt tests");
+
+    set_piece_hashes (t, thiz->dir, ec);
+    if (ec) {
+      g_printerr ("Failed hashing the content: %s\n", ec.message ().c_str ());
+      goto error;
+    }
+
+    bencode (std::back_inserter (buf), t.generate ());
+  }
+
+  thiz->torrent = g_build_filename (thiz->dir, "content.torrent", NULL);
+  if (!g_file_set_contents (thiz->torrent, &buf[0], buf.size (), NULL))
+    goto error;
+
+  return thiz;
+
+error:
+  g_free (root);
+  gst_bt_test_content_free (thiz);
+  return NULL;
+}
+
+gchar *
+gst_bt_test_content_get_magnet (GstBtTestContent * thiz)
+{
+  using namespace libtorrent;
+  error_code ec;
+  torrent_info ti (std::string (thiz->torrent), ec);
+
+  if (ec) {
+    g_printerr ("Failed loading the torrent: %s\n", ec.message ().c_str ());
+    return NULL;
+  }
+
+  return g_strdup (make_magnet_uri (ti).c_str ());
+}
+
+void
+gst_bt_test_content_free (GstBtTestContent * thiz)
+{
+  gst_bt_test_remove (thiz->dir);
+  g_free (thiz->dir);
+  g_free (thiz->name);
+  g_free (thiz->torrent);
+  g_free (thiz);
+}
+
+/*----------------------------------------------------------------------------*
+ *                             The HTTP server                                *
+ *----------------------------------------------------------------------------*/
+static gboolean
+gst_bt_test_http_write (int fd, const gchar * data, gsize size)
+{
+  while (size) {
+    ssize_t written;
+
+    written = write (fd, data, size);
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      return FALSE;
+    }
+    data += written;
+    size -= written;
+  }
+
+  return TRUE;
+}
+
+static const gchar *
+gst_bt_test_http_reason (gint status)
+{
+  switch (status) {
+    case 200:
+      return "OK";
+    case 206:
+      return "Partial Content";
+    case 416:
+      return "Range Not Satisfiable";
+    default:
+      return "Not Found";
+  }
+}
+
+static void
+gst_bt_test_http_serve (GstBtTestHttp * thiz, int fd)
+{
+  gchar request[GST_BT_TEST_REQUEST_SIZE];
+  gsize len = 0;
+  gchar **lines;
+  gchar **first;
+  gchar *range = NULL;
+  GString *headers, *body, *response;
+  gint status;
+  gint i;
+
+  /* read the whole header */
+  while (len < sizeof (request) - 1) {
+    ssize_t r;
+
+    r = read (fd, request + len, sizeof (request) - 1 - len);
+    if (r <= 0) {
+      if (r < 0 && errno == EINTR)
+        continue;
+      return;
+    }
+    len += r;
+    request[len] = '\0';
+    if (strstr (request, "\r\n\r\n"))
+      break;
+  }
+
+  lines = g_strsplit (request, "\r\n", -1);
+  first = g_strsplit (lines[0], " ", 3);
+  if (g_strv_length (first) < 2 || strcmp (first[0], "GET")) {
+    g_strfreev (first);
+    g_strfreev (lines);
+    return;
+  }
+
+  for (i = 1; lines[i] && *lines[i]; i++) {
+    if (!g_ascii_strncasecmp (lines[i], "Range:", 6)) {
+      range = g_strstrip (g_strdup (lines[i] + 6));
+      break;
+    }
+  }
+
+  headers = g_string_new (NULL);
+  body = g_string_new (NULL);
+  status = thiz->func (first[1], range, headers, body, thiz->user_data);
+
+  response = g_string_new (NULL);
+  g_string_append_printf (response, "HTTP/1.1 %d %s\r\n"
+      "Content-Length: %" G_GSIZE_FORMAT "\r\n"
+      "Connection: close\r\n"
+      "%s\r\n", status, gst_bt_test_http_reason (status), body->len,
+      headers->str);
+  g_string_append_len (response, body->str, body->len);
+  gst_bt_test_http_write (fd, response->str, response->len);
+
+  g_string_free (response, TRUE);
+  g_string_free (headers, TRUE);
+  g_string_free (body, TRUE);
+  g_free (range);
+  g_strfreev (first);
+  g_strfreev (lines);
+}
+
+static gpointer
+gst_bt_test_http_loop (gpointer user_data)
+{
+  GstBtTestHttp *thiz = (GstBtTestHttp *) user_data;
+
+  for (;;) {
+    int client;
+
+    client = accept (thiz->fd, NULL, NULL);
+    if (client < 0) {
+      if (!g_atomic_int_get (&thiz->stop) && errno == EINTR)
+        continue;
+      break;
+    }
+
+    gst_bt_test_http_serve (thiz, client);
+    close (client);
+  }
+
+  return NULL;
+}
+
+GstBtTestHttp *
+gst_bt_test_http_new (GstBtTestHttpFunc func, gpointer user_data)
+{
+  GstBtTestHttp *thiz;
+  struct sockaddr_in addr;
+  socklen_t addr_len = sizeof (addr);
+
+  thiz = g_new0 (GstBtTestHttp, 1);
+  thiz->func = func;
+  thiz->user_data = user_data;
+
+  thiz->fd = socket (AF_INET, SOCK_STREAM, 0);
+  if (thiz->fd < 0)
+    goto error;
+
+  /* let the system pick the port */
+  memset (&addr, 0, sizeof (addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  addr.sin_port = 0;
+  if (bind (thiz->fd, (struct sockaddr *) &addr, sizeof (addr)) < 0)
+    goto error;
+  if (listen (thiz->fd, 16) < 0)
+    goto error;
+  if (getsockname (thiz->fd, (struct sockaddr *) &addr, &addr_len) < 0)
+    goto error;
+  thiz->port = ntohs (addr.sin_port);
+
+  thiz->thread = g_thread_create (gst_bt_test_http_loop, thiz, TRUE, NULL);
+  if (!thiz->thread)
+    goto error;
+
+  return thiz;
+
+error:
+  if (thiz->fd >= 0)
+    close (thiz->fd);
+  g_free (thiz);
+  return NULL;
+}
+
+gint
+gst_bt_test_http_get_port (GstBtTestHttp * thiz)
+{
+  return thiz->port;
+}
+
+void
+gst_bt_test_http_free (GstBtTestHttp * thiz)
+{
+  /* wake up the accept */
+  g_atomic_int_set (&thiz->stop, 1);
+  shutdown (thiz->fd, SHUT_RDWR);
+  g_thread_join (thiz->thread);
+  close (thiz->fd);
+  g_free (thiz);
+}
+
+/*----------------------------------------------------------------------------*
+ *                                The swarm                                   *
+ *----------------------------------------------------------------------------*/
+static gint
+gst_bt_test_swarm_announce (const gchar * path, const gchar * range,
+    GString * headers, GString * body, gpointer user_data)
+{
+  GstBtTestSwarm *thiz = (GstBtTestSwarm *) user_data;
+
+  if (!g_str_has_prefix (path, "/announce"))
+    return 404;
+
+  /* every seeder, whoever asks */
+  g_string_append_printf (body, "d8:intervali60e5:peers%" G_GSIZE_FORMAT ":",
+      thiz->peers->len);
+  g_string_append_len (body, thiz->peers->str, thiz->peers->len);
+  g_string_append_c (body, 'e');
+
+  return 200;
+}
+
+GstBtTestSwarm *
+gst_bt_test_swarm_new (gint num_seeders)
+{
+  using namespace libtorrent;
+  GstBtTestSwarm *thiz;
+  gint base;
+  gint i;
+
+  thiz = new GstBtTestSwarm ();
+  thiz->peers = g_string_new (NULL);
+
+  /* spread the ports of concurrent runs */
+  base = 20000 + (getpid () % 400) * 100;
+
+  for (i = 0; i < num_seeders; i++) {
+    session *s;
+    session_settings settings;
+    error_code ec;
+    gint port;
+
+    s = new session (fingerprint ("GT", 0, 0, 0, 0),
+        session::add_default_plugins, alert::error_notification);
+    thiz->seeders.push_back (s);
+
+    s->listen_on (std::make_pair (base, base + 99), ec, "127.0.0.1");
+    if (ec) {
+      g_printerr ("Seeder %d failed to listen: %s\n", i,
+          ec.message ().c_str ());
+      gst_bt_test_swarm_free (thiz);
+      return NULL;
+    }
+
+    /* every peer shares the loopback address */
+    settings = s->settings ();
+    settings.allow_multiple_connections_per_ip = true;
+    s->set_settings (settings);
+
+    port = s->listen_port ();
+    g_string_append_c (thiz->peers, 127);
+    g_string_append_c (thiz->peers, 0);
+    g_string_append_c (thiz->peers, 0);
+    g_string_append_c (thiz->peers, 1);
+    g_string_append_c (thiz->peers, (gchar) ((port >> 8) & 0xff));
+    g_string_append_c (thiz->peers, (gchar) (port & 0xff));
+  }
+
+  thiz->tracker = gst_bt_test_http_new (gst_bt_test_swarm_announce, thiz);
+  if (!thiz->tracker) {
+    gst_bt_test_swarm_free (thiz);
+    return NULL;
+  }
+
+  return thiz;
+}
+
+gchar *
+gst_bt_test_swarm_get_tracker (GstBtTestSwarm * thiz)
+{
+  return g_strdup_printf ("http://127.0.0.1:%d/announce",
+      gst_bt_test_http_get_port (thiz->tracker));
+}
+
+gboolean
+gst_bt_test_swarm_seed (GstBtTestSwarm * thiz, GstBtTestContent * content)
+{
+  using namespace libtorrent;
+  std::vector<session *>::iterator it;
+
+  for (it = thiz->seeders.begin (); it != thiz->seeders.end (); ++it) {
+    add_torrent_params p;
+    error_code ec;
+
+    p.ti = new torrent_info (std::string (content->torrent), ec);
+    if (ec) {
+      g_printerr ("Failed loading the torrent: %s\n", ec.message ().c_str ());
+      return FALSE;
+    }
+    p.save_path = content->dir;
+    /* the content is generated, no need to check it */
+    p.flags = add_torrent_params::flag_seed_mode;
+
+    (*it)->add_torrent (p, ec);
+    if (ec) {
+      g_printerr ("Failed seeding the torrent: %s\n", ec.message ().c_str ());
+      return FALSE;
+    }
+  }
+
+  return TRUE;
+}
+
+void
+gst_bt_test_swarm_free (GstBtTestSwarm * thiz)
+{
+  std::vector<libtorrent::session *>::iterator it;
+
+  if (thiz->tracker)
+    gst_bt_test_http_free (thiz->tracker);
+
+  for (it = thiz->seeders.begin (); it != thiz->seeders.end (); ++it)
+    delete *it;
+
+  g_string_free (thiz->peers, TRUE);
+  delete thiz;
+}
+
+/*----------------------------------------------------------------------------*
+ *                                 The DHT                                    *
+ *----------------------------------------------------------------------------*/
+GstBtTestDht *
+gst_bt_test_dht_new (gint num_nodes)
+{
+  using namespace libtorrent;
+  GstBtTestDht *thiz;
+  std::vector<session *>::iterator it;
+  gint waited;
+  gint base;
+  gint i;
+
+  thiz = new GstBtTestDht ();
+
+  /* spread the ports of concurrent runs, away from the swarm ones */
+  base = 61000 + (getpid () % 200) * 20;
+
+  for (i = 0; i < num_nodes; i++) {
+    session *s;
+    session_settings settings;
+    dht_settings dht;
+    error_code ec;
+
+    s = new session (fingerprint ("GT", 0, 0, 0, 0),
+        session::add_default_plugins, alert::error_notification);
+    thiz->nodes.push_back (s);
+
+    s->listen_on (std::make_pair (base, base + 19), ec, "127.0.0.1");
+    if (ec) {
+      g_printerr ("DHT node %d failed to listen: %s\n", i,
+          ec.message ().c_str ());
+      gst_bt_test_dht_free (thiz);
+      return NULL;
+    }
+
+    /* every node shares the loopback address */
+    settings = s->settings ();
+    settings.allow_multiple_connections_per_ip = true;
+    s->set_settings (settings);
+
+    dht = s->get_dht_settings ();
+    dht.restrict_routing_ips = false;
+    dht.restrict_search_ips = false;
+    s->set_dht_settings (dht);
+    s->start_dht ();
+  }
+
+  /* every node knows the first one and the first one knows them all */
+  for (i = 1; i < num_nodes; i++) {
+    thiz->nodes[i]->add_dht_node (std::make_pair (std::string ("127.0.0.1"),
+        (int) thiz->nodes[0]->listen_port ()));
+    thiz->nodes[0]->add_dht_node (std::make_pair (std::string ("127.0.0.1"),
+        (int) thiz->nodes[i]->listen_port ()));
+  }
+
+  for (waited = 0; waited < GST_BT_TEST_DHT_TIMEOUT; waited += 100) {
+    for (it = thiz->nodes.begin (); it != thiz->nodes.end (); ++it) {
+      if (!(*it)->status ().dht_nodes)
+        break;
+    }
+    if (it == thiz->nodes.end ())
+      return thiz;
+
+    g_usleep (100 * 1000);
+  }
+
+  g_printerr ("The DHT nodes did not find each other\n");
+  gst_bt_test_dht_free (thiz);
+  return NULL;
+}
+
+/* the nodes to bootstrap from, as the dht-routers property takes them */
+gchar *
+gst_bt_test_dht_get_routers (GstBtTestDht * thiz)
+{
+  std::vector<libtorrent::session *>::iterator it;
+  GString *routers;
+
+  routers = g_string_new (NULL);
+  for (it = thiz->nodes.begin (); it != thiz->nodes.end (); ++it) {
+    if (routers->len)
+      g_string_append_c (routers, ',');
+    g_string_append_printf (routers, "127.0.0.1:%d", (*it)->listen_port ());
+  }
+
+  return g_string_free (routers, FALSE);
+}
+
+/* Seed the content on every node and announce it on the DHT */
+gboolean
+gst_bt_test_dht_seed (GstBtTestDht * thiz, GstBtTestContent * content)
+{
+  using namespace libtorrent;
+  std::vector<session *>::iterator it;
+
+  for (it = thiz->nodes.begin (); it != thiz->nodes.end (); ++it) {
+    add_torrent_params p;
+    torrent_handle h;
+    error_code ec;
+
+    p.ti = new torrent_info (std::string (content->torrent), ec);
+    if (ec) {
+      g_printerr ("Failed loading the torrent: %s\n", ec.message ().c_str ());
+      return FALSE;
+    }
+    p.save_path = content->dir;
+    p.flags = add_torrent_params::flag_seed_mode;
+
+    h = (*it)->add_torrent (p, ec);
+    if (ec) {
+      g_printerr ("Failed seeding the torrent: %s\n", ec.message ().c_str ());
+      return FALSE;
+    }
+    h.force_dht_announce ();
+  }
+
+  return TRUE;
+}
+
+void
+gst_bt_test_dht_free (GstBtTestDht * thiz)
+{
+  std::vector<libtorrent::session *>::iterator it;
+
+  for (it = thiz->nodes.begin (); it != thiz->nodes.end (); ++it)
+    delete *it;
+
+  delete thiz;
+}
+
+/*----------------------------------------------------------------------------*
+ *                              The pipelines                                 *
+ *----------------------------------------------------------------------------*/
+static void
+gst_bt_test_handoff (GstElement * sink, GstBuffer * buffer, GstPad * pad,
+    gpointer user_data)
+{
+  GstBtTestState *state = (GstBtTestState *) user_data;
+  GstClockTime now;
+  gsize size;
+
+#if HAVE_GST_1
+  size = gst_buffer_get_size (buffer);
+#else
+  size = GST_BUFFER_SIZE (buffer);
+#endif
+
+  now = gst_util_get_timestamp ();
+  g_mutex_lock (state->lock);
+  if (!GST_CLOCK_TIME_IS_VALID (state->first))
+    state->first = now;
+  if (GST_CLOCK_TIME_IS_VALID (state->seek) &&
+      !GST_CLOCK_TIME_IS_VALID (state->seek_first))
+    state->seek_first = now;
+  state->last = now;
+  state->bytes += size;
+  g_mutex_unlock (state->lock);
+}
+
+GstElement *
+gst_bt_test_pipeline_new (const gchar * description)
+{
+  GstElement *pipeline;
+  GError *err = NULL;
+
+  pipeline = gst_parse_launch (description, &err);
+  if (err) {
+    g_printerr ("Failed to create '%s': %s\n", description, err->message);
+    g_error_free (err);
+    if (pipeline)
+      gst_object_unref (pipeline);
+    return NULL;
+  }
+
+  return pipeline;
+}
+
+/* Play the pipeline until EOS, seeking to seek_to once seek_at bytes have
+ * been pushed when seek_at is not negative
+ */
+gboolean
+gst_bt_test_run (GstElement * pipeline, gint64 seek_at, gint64 seek_to,
+    GstClockTime timeout, GstBtTestResult * result)
+{
+  GstBtTestState state;
+  GstElement *sink;
+  GstBus *bus;
+  struct rusage start_usage, end_usage;
+  gboolean seeked = FALSE;
+  gboolean ret = FALSE;
+  gdouble cpu;
+
+  memset (result, 0, sizeof (GstBtTestResult));
+  result->ttfb = GST_CLOCK_TIME_NONE;
+  result->seek_latency = GST_CLOCK_TIME_NONE;
+
+  sink = gst_bin_get_by_name (GST_BIN (pipeline), "sink");
+  if (!sink) {
+    g_printerr ("The pipeline has no element named 'sink'\n");
+    return FALSE;
+  }
+
+  state.lock = g_mutex_new ();
+  state.bytes = 0;
+  state.first = GST_CLOCK_TIME_NONE;
+  state.last = GST_CLOCK_TIME_NONE;
+  state.seek = GST_CLOCK_TIME_NONE;
+  state.seek_first = GST_CLOCK_TIME_NONE;
+
+  g_object_set (sink, "signal-handoffs", TRUE, "sync", FALSE, NULL);
+  g_signal_connect (sink, "handoff", G_CALLBACK (gst_bt_test_handoff),
+      &state);
+
+  bus = gst_element_get_bus (pipeline);
+  getrusage (RUSAGE_SELF, &start_usage);
+  state.start = gst_util_get_timestamp ();
+
+  if (gst_element_set_state (pipeline, GST_STATE_PLAYING) ==
+      GST_STATE_CHANGE_FAILURE) {
+    g_printerr ("Failed to start the pipeline\n");
+    goto done;
+  }
+
+  for (;;) {
+    GstMessage *msg;
+    guint64 bytes;
+
+    msg = gst_bus_timed_pop_filtered (bus, 50 * GST_MSECOND,
+        (GstMessageType) (GST_MESSAGE_EOS | GST_MESSAGE_ERROR));
+    if (msg) {
+      if (GST_MESSAGE_TYPE (msg) == GST_MESSAGE_ERROR) {
+        GError *err = NULL;
+        gchar *debug = NULL;
+
+        gst_message_parse_error (msg, &err, &debug);
+        g_printerr ("Error: %s (%s)\n", err->message, debug ? debug : "");
+        g_error_free (err);
+        g_free (debug);
+      } else {
+        result->eos = TRUE;
+        ret = TRUE;
+      }
+      gst_message_unref (msg);
+      break;
+    }
+
+    if (gst_util_get_timestamp () - state.start > timeout) {
+      g_printerr ("Timeout after %" G_GUINT64_FORMAT " bytes\n", state.bytes);
+      break;
+    }
+
+    g_mutex_lock (state.lock);
+    bytes = state.bytes;
+    g_mutex_unlock (state.lock);
+
+    if (seek_at >= 0 && !seeked && bytes >= (guint64) seek_at) {
+      GstClockTime seek = gst_util_get_timestamp ();
+
+      seeked = TRUE;
+      if (!gst_element_seek_simple (pipeline, GST_FORMAT_BYTES,
+          GST_SEEK_FLAG_FLUSH, seek_to)) {
+        g_printerr ("Failed to seek to %" G_GINT64_FORMAT "\n", seek_to);
+        break;
+      }
+      /* the flush is done, the next buffer belongs to the seek */
+      g_mutex_lock (state.lock);
+      state.seek = seek;
+      state.seek_first = GST_CLOCK_TIME_NONE;
+      g_mutex_unlock (state.lock);
+    }
+  }
+
+done:
+  getrusage (RUSAGE_SELF, &end_usage);
+  gst_element_set_state (pipeline, GST_STATE_NULL);
+  g_signal_handlers_disconnect_by_func (sink, (gpointer) gst_bt_test_handoff,
+      &state);
+  gst_object_unref (sink);
+  gst_object_unref (bus);
+
+  result->bytes = state.bytes;
+  if (GST_CLOCK_TIME_IS_VALID (state.first)) {
+    result->ttfb = state.first - state.start;
+    result->duration = state.last - state.first;
+  }
+  if (GST_CLOCK_TIME_IS_VALID (state.seek_first))
+    result->seek_latency = state.seek_first - state.seek;
+
+  cpu = (end_usage.ru_utime.tv_sec - start_usage.ru_utime.tv_sec) * 1000.0 +
+      (end_usage.ru_utime.tv_usec - start_usage.ru_utime.tv_usec) / 1000.0 +
+      (end_usage.ru_stime.tv_sec - start_usage.ru_stime.tv_sec) * 1000.0 +
+      (end_usage.ru_stime.tv_usec - start_usage.ru_stime.tv_usec) / 1000.0;
+  if (state.bytes)
+    result->cpu_per_mb = cpu / ((gdouble) state.bytes / (1024 * 1024));
+
+  g_mutex_free (state.lock);
+
+  return ret;
+}
+
+void
+gst_bt_test_result_print (const gchar * name, const GstBtTestResult * result)
+{
+  gdouble throughput = 0;
+
+  if (result->duration)
+    throughput = ((gdouble) result->bytes / (1024 * 1024)) /
+        ((gdouble) result->duration / GST_SECOND);
+
+  g_print ("%s: %s, %" G_GUINT64_FORMAT " bytes\n", name,
+      result->eos ? "eos" : "failed", result->bytes);
+  if (GST_CLOCK_TIME_IS_VALID (result->ttfb))
+    g_print ("  time to first buffer: %.1f ms\n",
+        (gdouble) result->ttfb / GST_MSECOND);
+  g_print ("  throughput: %.2f MiB/s\n", throughput);
+  if (GST_CLOCK_TIME_IS_VALID (result->seek_latency))
+    g_print ("  seek latency: %.1f ms\n",
+        (gdouble) result->seek_latency / GST_MSECOND);
+  g_print ("  cpu: %.2f ms/MiB\n", result->cpu_per_mb);
+}
@@ -0,0 +1,98 @@
+/* Gst-Bt - BitTorrent related GStreamer elements
+ * Copyright (C) 2015 Jorge Luis Zapata
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GST_BT_TEST_H
+#define GST_BT_TEST_H
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <gst/gst.h>
+
+/* Synthetic content on a temporary directory and its torrent */
+typedef struct _GstBtTestContent
+{
+  gchar *dir;
+  gchar *name;
+  gchar *torrent;
+  gint piece_length;
+  gint num_files;
+  /* the size of the largest file, the one btdemux streams by default */
+  gint64 largest;
+  gint64 size;
+} GstBtTestContent;
+
+/* A single threaded HTTP server on the loopback. The function fills the
+ * body and the extra headers of the response and returns its status
+ */
+typedef struct _GstBtTestHttp GstBtTestHttp;
+typedef gint (*GstBtTestHttpFunc) (const gchar * path, const gchar * range,
+    GString * headers, GString * body, gpointer user_data);
+
+/* Seeders on the loopback and a tracker stand-in announcing them */
+typedef struct _GstBtTestSwarm GstBtTestSwarm;
+
+/* DHT nodes on the loopback bootstrapped off each other */
+typedef struct _GstBtTestDht GstBtTestDht;
+
+typedef struct _GstBtTestResult
+{
+  gboolean eos;
+  guint64 bytes;
+  /* from PLAYING to the first buffer */
+  GstClockTime ttfb;
+  /* from the seek to the first buffer after it */
+  GstClockTime seek_latency;
+  /* from the first buffer to the last one */
+  GstClockTime duration;
+  /* process CPU time per pushed MiB, the seeders included */
+  gdouble cpu_per_mb;
+} GstBtTestResult;
+
+GstBtTestContent * gst_bt_test_content_new (const gint64 * sizes,
+    gint num_files, gint piece_length, const gchar * tracker,
+    const gchar * url_seed);
+void gst_bt_test_content_free (GstBtTestContent * thiz);
+gchar * gst_bt_test_content_get_magnet (GstBtTestContent * thiz);
+guint8 gst_bt_test_content_byte (gint64 offset);
+
+GstBtTestHttp * gst_bt_test_http_new (GstBtTestHttpFunc func,
+    gpointer user_data);
+gint gst_bt_test_http_get_port (GstBtTestHttp * thiz);
+void gst_bt_test_http_free (GstBtTestHttp * thiz);
+
+GstBtTestSwarm * gst_bt_test_swarm_new (gint num_seeders);
+gchar * gst_bt_test_swarm_get_tracker (GstBtTestSwarm * thiz);
+gboolean gst_bt_test_swarm_seed (GstBtTestSwarm * thiz,
+    GstBtTestContent * content);
+void gst_bt_test_swarm_free (GstBtTestSwarm * thiz);
+
+GstBtTestDht * gst_bt_test_dht_new (gint num_nodes);
+gchar * gst_bt_test_dht_get_routers (GstBtTestDht * thiz);
+gboolean gst_bt_test_dht_seed (GstBtTestDht * thiz,
+    GstBtTestContent * content);
+void gst_bt_test_dht_free (GstBtTestDht * thiz);
+
+GstElement * gst_bt_test_pipeline_new (const gchar * description);
+gboolean gst_bt_test_run (GstElement * pipeline, gint64 seek_at,
+    gint64 seek_to, GstClockTime timeout, GstBtTestResult * result);
+void gst_bt_test_result_print (const gchar * name,
+    const GstBtTestResult * result);
+
+#endif
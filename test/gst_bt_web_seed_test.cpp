@@ -0,0 +1,200 @@
+/* Gst-Bt - BitTorrent related GStreamer elements
+ * Copyright (C) 2015 Jorge Luis Zapata
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Streams a synthetic torrent without any peer, only from a web seed set
+ * on btdemux and served by an HTTP server on the loopback answering the
+ * range requests from the content file. It fails if the stream does not
+ * reach EOS with the whole file or if the mirror was never asked
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <glib/gstdio.h>
+
+#include "gst_bt_test.hpp"
+
+#define DEFAULT_PIECE_LENGTH (64 * 1024)
+#define DEFAULT_SIZE (4 * 1024 * 1024)
+#define DEFAULT_TIMEOUT 60
+
+typedef struct _GstBtWebSeedMirror
+{
+  GstBtTestContent *content;
+  volatile gint requests;
+} GstBtWebSeedMirror;
+
+static gint piece_length = DEFAULT_PIECE_LENGTH;
+static gint64 size = DEFAULT_SIZE;
+static gint timeout = DEFAULT_TIMEOUT;
+
+static GOptionEntry entries[] = {
+  { "piece-length", 0, 0, G_OPTION_ARG_INT, &piece_length,
+      "Piece length of the torrent", "BYTES" },
+  { "size", 0, 0, G_OPTION_ARG_INT64, &size,
+      "Size of the content", "BYTES" },
+  { "timeout", 0, 0, G_OPTION_ARG_INT, &timeout,
+      "Seconds to wait for the stream", "SECONDS" },
+  { NULL }
+};
+
+/* Serve the bytes of the content file asked on the range header */
+static gint
+gst_bt_web_seed_serve (const gchar * path, const gchar * range,
+    GString * headers, GString * body, gpointer user_data)
+{
+  GstBtWebSeedMirror *mirror = (GstBtWebSeedMirror *) user_data;
+  GstBtTestContent *content = mirror->content;
+  gchar *location;
+  FILE *f;
+  gint64 start = 0;
+  gint64 end = content->size - 1;
+  gint status = 200;
+
+  g_atomic_int_inc (&mirror->requests);
+  if (*path != '/' || strcmp (path + 1, content->name))
+    return 404;
+
+  if (range) {
+    if (sscanf (range, "bytes=%" G_GINT64_FORMAT "-%" G_GINT64_FORMAT,
+        &start, &end) < 1 || start > end || start >= content->size) {
+      g_string_append_printf (headers, "Content-Range: bytes */%"
+          G_GINT64_FORMAT "\r\n", content->size);
+      return 416;
+    }
+
+    end = MIN (end, content->size - 1);
+    g_string_append_printf (headers, "Content-Range: bytes %" G_GINT64_FORMAT
+        "-%" G_GINT64_FORMAT "/%" G_GINT64_FORMAT "\r\n", start, end,
+        content->size);
+    status = 206;
+  }
+
+  location = g_build_filename (content->dir, content->name, NULL);
+  f = g_fopen (location, "rb");
+  g_free (location);
+  if (!f)
+    return 404;
+
+  g_string_set_size (body, end - start + 1);
+  if (fseeko (f, start, SEEK_SET) ||
+      fread (body->str, 1, body->len, f) != body->len) {
+    g_string_set_size (body, 0);
+    status = 404;
+  }
+  fclose (f);
+
+  return status;
+}
+
+int
+main (int argc, char **argv)
+{
+  GOptionContext *ctx;
+  GError *err = NULL;
+  GstElementFactory *factory;
+  GstBtWebSeedMirror mirror;
+  GstBtTestHttp *http;
+  GstBtTestResult result;
+  GstElement *pipeline;
+  GstElement *demux;
+  gchar *description;
+  gchar *location;
+  gchar *url;
+  gboolean ret;
+
+  if (!g_thread_supported ())
+    g_thread_init (NULL);
+
+  ctx = g_option_context_new ("- btdemux streaming from a web seed");
+  g_option_context_add_main_entries (ctx, entries, NULL);
+  g_option_context_add_group (ctx, gst_init_get_option_group ());
+  if (!g_option_context_parse (ctx, &argc, &argv, &err)) {
+    g_printerr ("%s\n", err->message);
+    g_error_free (err);
+    return 1;
+  }
+  g_option_context_free (ctx);
+
+  if (piece_length < 16 * 1024 || size < 1) {
+    g_printerr ("Invalid options\n");
+    return 1;
+  }
+
+  factory = gst_element_factory_find ("btdemux");
+  if (!factory) {
+    g_printerr ("btdemux not found, check GST_PLUGIN_PATH\n");
+    return 1;
+  }
+  gst_object_unref (factory);
+
+  /* no tracker and no url-list, the mirror is only known by btdemux */
+  mirror.content = gst_bt_test_content_new (&size, 1, piece_length, NULL,
+      NULL);
+  mirror.requests = 0;
+  if (!mirror.content)
+    return 1;
+
+  http = gst_bt_test_http_new (gst_bt_web_seed_serve, &mirror);
+  if (!http) {
+    gst_bt_test_content_free (mirror.content);
+    return 1;
+  }
+
+  location = g_build_filename (mirror.content->dir, "download", NULL);
+  description = g_strdup_printf ("filesrc location=\"%s\" ! "
+      "btdemux name=demux temp-location=\"%s\" ! fakesink name=sink",
+      mirror.content->torrent, location);
+  pipeline = gst_bt_test_pipeline_new (description);
+  g_free (description);
+  g_free (location);
+  if (!pipeline) {
+    gst_bt_test_http_free (http);
+    gst_bt_test_content_free (mirror.content);
+    return 1;
+  }
+
+  url = g_strdup_printf ("http://127.0.0.1:%d/%s",
+      gst_bt_test_http_get_port (http), mirror.content->name);
+  demux = gst_bin_get_by_name (GST_BIN (pipeline), "demux");
+  g_object_set (demux, "web-seeds", url, NULL);
+  gst_object_unref (demux);
+  g_free (url);
+
+  ret = gst_bt_test_run (pipeline, -1, 0, timeout * GST_SECOND, &result);
+  gst_object_unref (pipeline);
+  gst_bt_test_http_free (http);
+
+  gst_bt_test_result_print ("web seed", &result);
+  if (ret && result.bytes != (guint64) mirror.content->size) {
+    g_printerr ("Expected %" G_GINT64_FORMAT " bytes\n",
+        mirror.content->size);
+    ret = FALSE;
+  }
+  if (ret && !g_atomic_int_get (&mirror.requests)) {
+    g_printerr ("The web seed was never asked\n");
+    ret = FALSE;
+  }
+  gst_bt_test_content_free (mirror.content);
+
+  return ret ? 0 : 1;
+}